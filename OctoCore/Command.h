@@ -1,12 +1,21 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <climits>
+#include <cstddef>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
+#include <typeinfo>
 #include <unordered_map>
+#include <vector>
 
 #include "DataTypes.h"
 #include "FieldHash.h"
 #include "Exception.h"
+#include "MapPool.h"
+#include "Status.h"
 
 namespace Octo {
 
@@ -27,14 +36,20 @@ public:
     using StrList = StrList;
     using Map = Map;
     using StrMap = StrMap;
-    /** Normal constructor for use by derived classes */
-    CommandBase(CommandId commandId) : m_command_id(commandId), m_args(std::make_shared<Map>()) {}
+    /** Command ID reserved for compound commands (see State::Transaction) */
+    enum : CommandId { CompoundCommandId = INT32_MIN };
+    /** Normal constructor for use by derived classes.
+     *  The args start out as the shared empty map; argsMutable() copies it on the first write.
+     *  This means that commands without any OCTO_ARG()s never need to allocate a FieldMap.
+     */
+    CommandBase(CommandId commandId) :
+        m_command_id(commandId), m_args(std::const_pointer_cast<FieldMap>(MapPool::emptyMap())) {}
 protected:
     /** Internal constructor that points to existing arguments.
      *  This is used to re-create an instance of a command subclass just prior to running it
      *  on an Octo::State.
      */
-    CommandBase(CommandId commandId, const std::shared_ptr<Map>& args) : m_command_id(commandId), m_args(args) {}
+    CommandBase(CommandId commandId, const std::shared_ptr<FieldMap>& args) : m_command_id(commandId), m_args(args) {}
     /** protected non-virtual destructor to handle memory allocation correctly. */
     ~CommandBase() {}
 
@@ -43,24 +58,36 @@ protected:
 public:
     /** args(): Get this command's arguments (read-only).
      *  The result of this call can be stored indefinitely and is guaranteed to never change.
+     *  Calling it again returns the same map, unless the args have been modified since.
      */
-    std::shared_ptr<const Map> args() const { return m_args; }
+    std::shared_ptr<const FieldMap> args() const {
+        if (m_flat_args_encoder) {
+            encodeFlatArgs();
+        }
+        return m_args;
+    }
     
     /** Get the ID of this command. The ID is unique within the CommandRegistry. */
     CommandId commandId() const { return m_command_id; }
 protected:
     /** Get a raw constant pointer to arguments. Used by ArgField only. */
-    const Map* argsReadOnly() const { return m_args.get(); }
+    const FieldMap* argsReadOnly() const { return m_args.get(); }
     /** Get a raw mutable pointer to arguments. Used by ArgField only. */
-    Map* argsMutable() {
+    FieldMap* argsMutable() const {
         // This implements copy-on-write: If some other object has stored/copied a pointer to
-        // our arguments, we will re-create them and work with a new copy.
+        // our arguments, we will re-create them and work with a new copy. Copying a FieldMap
+        // shares its values, so only the fields that are then modified actually get copied.
         if (m_args.use_count() > 1) {
-            const Map* old_args = m_args.get();
-            m_args = std::make_shared<Map>(*old_args);
+            const FieldMap* old_args = m_args.get();
+            m_args = MapPool::global().acquire(*old_args);
         }
         return m_args.get();
     }
+    /** FlatArgsEncoderFn: Writes the OCTO_FLAT_ARGS() fields of a command into its args map */
+    using FlatArgsEncoderFn = void (*)(const CommandBase* command, FieldMap* args);
+    /** Note that the OCTO_FLAT_ARGS() fields may have been modified, so the next call to args()
+     *  must write them into the args map (using 'encoder'). Used by OCTO_FLAT_ARGS() only. */
+    void flatArgsChanged(FlatArgsEncoderFn encoder) { m_flat_args_encoder = encoder; }
 
     /** ArgField: A wrapper used to make arg fields act more like member variables */
     template<FieldId _fieldID, typename T>
@@ -69,7 +96,9 @@ protected:
         using UnwrappedTypeMutable = typename mutate_as<T>::type;
         CommandBase* const m_cmd;
         ArgField(CommandBase* c) : m_cmd(c) {}
-        inline void operator=(const T& val) { (*m_cmd->argsMutable())[_fieldID] = wrap(val); }
+        inline void operator=(const T& val) { wrapInto(&m_cmd->argsMutable()->overwrite(_fieldID), val); }
+        /** Assigning an rvalue container (e.g. std::move(someIntList)) adopts its contents without copying */
+        inline void operator=(T&& val) { wrapInto(&m_cmd->argsMutable()->overwrite(_fieldID), std::move(val)); }
         inline UnwrappedTypeMutable operator*() {
             GenericValue& value = (*m_cmd->argsMutable())[_fieldID];
             return unwrap<UnwrappedTypeMutable>(value);
@@ -88,30 +117,81 @@ protected:
             GenericValue& value = (*m_cmd->argsMutable())[_fieldID];
             return unwrap<UnwrappedTypeMutable>(value)[arg];
         }
+        // Builders for list types, which write straight into the args storage so that large
+        // lists never need to be built separately and then copied in:
+        inline void reserve(int size) { (**this).Reserve(size); }
+        template<typename U>
+        inline void emplace(U&& value) { appendTo(&(**this), std::forward<U>(value)); }
+        template<typename U>
+        inline void assign(const std::vector<U>& values) {
+            auto& list = **this;
+            list.Clear();
+            list.Reserve(static_cast<int>(values.size()));
+            for (const U& value : values) { appendTo(&list, value); }
+        }
+        /** Assign from a vector whose elements can be moved (e.g. the strings of a vector<string>) */
+        template<typename U>
+        inline void assign(std::vector<U>&& values) {
+            auto& list = **this;
+            list.Clear();
+            list.Reserve(static_cast<int>(values.size()));
+            for (U& value : values) { appendTo(&list, std::move(value)); }
+        }
     };
 public:
     /** Result: base class for wrappers used to provider typed access to result data. */
     struct ResultBase {
-        ResultBase(const std::shared_ptr<Map>& data, bool isMutable) : m_is_mutable(isMutable), m_data(data) {}
-        ResultBase(const std::shared_ptr<const Map>& data) : m_is_mutable(false), m_data(std::const_pointer_cast<Map>(data)) {}
+        /** Placeholder with no data, e.g. for a StatusOr<Result> that holds an error */
+        ResultBase() : m_is_mutable(false) {}
+        ResultBase(const std::shared_ptr<FieldMap>& data, bool isMutable) : m_is_mutable(isMutable), m_data(data) {}
+        ResultBase(const std::shared_ptr<const FieldMap>& data) :
+            m_is_mutable(false), m_data(std::const_pointer_cast<FieldMap>(data)) {}
         /** setResultField: Helper method used to modify result fields. Available as set_{field_name}() */
         template<typename T>
         void setResultField(FieldId _fieldID, T&& value) {
             if (not m_is_mutable) {
-                throw CommandResultMisuseException();
+                OCTO_THROW(CommandResultMisuseException());
             }
-            (*m_data)[_fieldID] = wrap(std::move(value));
+            wrapInto(&m_data->overwrite(_fieldID), std::move(value));
         }
-        const Map* data() const { return m_data.get(); }
+        /** willNotApply: Reject the command without throwing an exception, e.g. because it
+         *  conflicts with the current state. Call this from forward() and then return, without
+         *  having changed the state. The command will not be added to the undo history;
+         *  State::tryRunCommand() returns a FAILED_PRECONDITION status with the given reason,
+         *  and State::runCommand() throws a CommandWillNotApplyException.
+         */
+        void willNotApply(google::protobuf::StringPiece reason) {
+            m_rejection = std::make_shared<const std::string>(reason.ToString());
+        }
+        /** Has willNotApply() been called? */
+        bool isRejected() const { return m_rejection != nullptr; }
+        /** The status set by willNotApply(), or an OK status if it has not been called */
+        Status commandStatus() const {
+            return m_rejection ? Status(StatusCode::FAILED_PRECONDITION, *m_rejection) : Status();
+        }
+        const FieldMap* data() const { return m_data.get(); }
+        std::shared_ptr<const FieldMap> sharedData() const { return m_data; }
     private:
-        const bool m_is_mutable;
-        const std::shared_ptr<Map> m_data;
+        bool m_is_mutable;
+        std::shared_ptr<FieldMap> m_data;
+        // The reason given to willNotApply(). A null pointer (rather than a Status, which holds a
+        // string) on success, so that a successful command never constructs or destroys a string.
+        std::shared_ptr<const std::string> m_rejection;
     };
 private:
     /** m_command_id: Every command has a unique ID */
     const CommandId m_command_id;
-    /** m_args: ALL data that describes this command must be stored in here */
-    std::shared_ptr<Map> m_args;
+    /** Write any modified OCTO_FLAT_ARGS() fields into m_args (copying it first if it is shared) */
+    void encodeFlatArgs() const {
+        const FlatArgsEncoderFn encoder = m_flat_args_encoder;
+        m_flat_args_encoder = nullptr;
+        encoder(this, argsMutable());
+    }
+    /** m_args: ALL data that describes this command must be stored in here. It is mutable so
+     *  that args() can bring it up to date with the OCTO_FLAT_ARGS() fields. */
+    mutable std::shared_ptr<FieldMap> m_args;
+    /** m_flat_args_encoder: Set while the OCTO_FLAT_ARGS() fields may differ from m_args */
+    mutable FlatArgsEncoderFn m_flat_args_encoder = nullptr;
 };
 
 /** OCTO_ARG(fieldType, fieldName): Create an argument "field" on a command.
@@ -144,6 +224,7 @@ private:
 #define OCTO_RESULTS(result_fields) \
     struct Result : public ::Octo::CommandBase::ResultBase { \
         using ResultBase::ResultBase; \
+        static constexpr bool has_fields = (sizeof(#result_fields) > 1); \
         result_fields \
     }; \
     static_assert(sizeof(Result) == sizeof(::Octo::CommandBase::ResultBase), "Result struct cannot have member variables.");
@@ -173,6 +254,154 @@ private:
     }
 
 
+/** OCTO_FLAT_ARGS(): An alternative to OCTO_ARG() for commands that are run often and need
+ *  fast access to their arguments. It may contain any number of OCTO_FLAT_ARG() fields, which
+ *  become plain typed members of a 'FlatArgs' struct accessible via flatArgs(), so reading an
+ *  argument is just a member access rather than a FieldMap lookup.
+ *  The FlatArgs struct is written into the args map only when needed, i.e. by the first call to
+ *  args() (e.g. to add the command to the undo history or to serialize it) after flatArgs() was
+ *  used to modify it, and is decoded from a FieldMap once each time a command is re-created from
+ *  its args (undo, redo, replaying a remote command).
+ *  Every flat field is always present (it defaults to a value-initialized fieldType). A field
+ *  that has never been modified may be left out of the args map, in which case it is decoded
+ *  as its default value.
+ */
+#define OCTO_FLAT_ARGS(arg_fields) \
+    struct FlatArgs { \
+        enum : int { _octo_begin_index = __COUNTER__ }; \
+        arg_fields \
+        /* Skip over any __COUNTER__ values that were not used by a field, down to the beginning: */ \
+        template<class V, int N> void visit(V& v, std::integral_constant<int, N>) { \
+            visit(v, std::integral_constant<int, N - 1>()); \
+        } \
+        template<class V, int N> void visit(V& v, std::integral_constant<int, N>) const { \
+            visit(v, std::integral_constant<int, N - 1>()); \
+        } \
+        template<class V> void visit(V&, std::integral_constant<int, _octo_begin_index>) {} \
+        template<class V> void visit(V&, std::integral_constant<int, _octo_begin_index>) const {} \
+        enum : int { _octo_end_index = __COUNTER__ }; \
+        template<class V> void visitAll(V& v) { visit(v, std::integral_constant<int, _octo_end_index - 1>()); } \
+        template<class V> void visitAll(V& v) const { visit(v, std::integral_constant<int, _octo_end_index - 1>()); } \
+    }; \
+    using HasFlatArgs = std::true_type; \
+    friend class ::Octo::CommandRegistry; \
+    friend class ::Octo::State; \
+    FlatArgs m_flat_args; \
+    FlatArgs& flatArgs() { \
+        using Self = typename std::remove_reference<decltype(*this)>::type; \
+        flatArgsChanged([](const ::Octo::CommandBase* command, ::Octo::FieldMap* args) { \
+            ::Octo::FlatArgsEncoder encoder {args}; \
+            static_cast<const Self*>(command)->m_flat_args.visitAll(encoder); \
+        }); \
+        return m_flat_args; \
+    } \
+    const FlatArgs& flatArgs() const { return m_flat_args; }
+
+/** OCTO_FLAT_ARG(fieldType, fieldName): Declare a field within OCTO_FLAT_ARGS().
+ *  Each field gets a sequence number from __COUNTER__ so that the fields can be visited in turn
+ *  when converting FlatArgs to and from a FieldMap. The numbers need not be consecutive (e.g. if
+ *  another macro uses __COUNTER__ between two fields); the numbers in between are skipped.
+ *  The expansion is deferred until OCTO_FLAT_ARGS() itself is expanded, so that the fields are
+ *  numbered after its _octo_begin_index (macro arguments are otherwise expanded first).
+ */
+#define OCTO_FLAT_ARG(fieldType, fieldName) OCTO_FLAT_ARG_IMPL OCTO_DEFER() (fieldType, fieldName)
+#define OCTO_DEFER()
+#define OCTO_FLAT_ARG_IMPL(fieldType, fieldName) \
+    enum : int { fieldName##_flat_index = __COUNTER__ }; \
+    enum : FieldId { fieldName##_field_id = #fieldName ## _octo_field_name_hash }; \
+    fieldType fieldName {}; \
+    template<class V> void visit(V& v, std::integral_constant<int, fieldName##_flat_index>) { \
+        v(fieldName##_field_id, fieldName); \
+        visit(v, std::integral_constant<int, fieldName##_flat_index - 1>()); \
+    } \
+    template<class V> void visit(V& v, std::integral_constant<int, fieldName##_flat_index>) const { \
+        v(fieldName##_field_id, fieldName); \
+        visit(v, std::integral_constant<int, fieldName##_flat_index - 1>()); \
+    }
+
+/** FlatArgsEncoder: Visitor used to write the fields of an OCTO_FLAT_ARGS() struct into a FieldMap */
+struct FlatArgsEncoder {
+    FieldMap* map;
+    template<typename T>
+    void operator()(FieldId fieldId, const T& value) const { wrapInto(&map->overwrite(fieldId), value); }
+};
+
+/** FlatArgsDecoder: Visitor used to read the fields of an OCTO_FLAT_ARGS() struct from a FieldMap.
+ *  Fields that are missing from the map (or have the wrong type) keep their current value. */
+struct FlatArgsDecoder {
+    const FieldMap* map;
+    template<typename T>
+    void operator()(FieldId fieldId, T& value) const {
+        auto it = map->find(fieldId);
+        if (it != map->end() and can_unwrap<T>(it->second)) {
+            value = unwrap<typename unwrap_as<T>::type>(it->second);
+        }
+    }
+};
+
+
+/** StatePtrCache: Converts Octo::State pointers to pointers of type Target (a subclass or
+ *  interface), like dynamic_cast<Target*>, but only does the expensive RTTI walk once per
+ *  concrete State class. The pointer adjustment found by dynamic_cast is the same for all
+ *  objects of the same concrete type, so it is remembered in a small table keyed by typeid.
+ *  Lookups are lock-free; only adding a new concrete type to the table takes a lock.
+ *  An optional 'check' adds a further condition that depends only on the concrete type (e.g.
+ *  whether a command is registered with the state's CommandRegistry); it is also only called
+ *  the first time that each concrete type is seen.
+ */
+template<class Target>
+class StatePtrCache {
+public:
+    template<class Base>
+    Target* cast(Base* state) {
+        return cast(state, [](Base*) { return true; });
+    }
+    template<class Base, class Check>
+    Target* cast(Base* state, Check check) {
+        if (state == nullptr) {
+            return nullptr; // As dynamic_cast does (typeid(*state) would throw std::bad_typeid)
+        }
+        const std::type_info& type = typeid(*state);
+        const int count = m_count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            const Slot& slot = m_slots[i];
+            if (slot.type == &type or *slot.type == type) {
+                if (not slot.applicable) {
+                    return nullptr;
+                }
+                return reinterpret_cast<Target*>(reinterpret_cast<char*>(state) + slot.offset);
+            }
+        }
+        // This is the first time we've seen this type of State.
+        Target* result = check(state) ? dynamic_cast<Target*>(state) : nullptr;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const int n = m_count.load(std::memory_order_relaxed);
+        if (n < Capacity) { // If the table is full, we just fall back to using dynamic_cast every time.
+            for (int i = 0; i < n; i++) {
+                if (*m_slots[i].type == type) {
+                    return result; // Another thread just added it
+                }
+            }
+            m_slots[n].type = &type;
+            m_slots[n].applicable = (result != nullptr);
+            m_slots[n].offset = result ? reinterpret_cast<char*>(result) - reinterpret_cast<char*>(state) : 0;
+            m_count.store(n + 1, std::memory_order_release);
+        }
+        return result;
+    }
+private:
+    static constexpr int Capacity = 8;
+    struct Slot {
+        const std::type_info* type;
+        std::ptrdiff_t offset;
+        bool applicable;
+    };
+    Slot m_slots[Capacity];
+    std::atomic<int> m_count {0};
+    std::mutex m_mutex;
+};
+
+
 /** Command: Base class template for commands that affect an Octo::State.
  *  Each Command subclass describes a type of atomic change made to an Octo::State.
  *  Commands should always be reversible and consistently replayable (undo-redo).
@@ -210,6 +439,20 @@ private:
  *     only be modified during the forward() method. It is also required that if a command is
  *     run forward() then backward() then forward(), that the second call to forward must not
  *     modify and of the result values. These fields cannot be modified during backward().
+ *
+ *  Command subclasses may also:
+ *   * Implement 'bool merge(Result& result, const ThisCommand& next, const Result& nextResult)'
+ *     to combine consecutive commands of the same type (e.g. typing one character at a time)
+ *     into a single undo step. It is called on a copy of the command at the top of the undo
+ *     queue (with a mutable copy of its result) after 'next' has been run. To merge, it must
+ *     update its own args and the result so that running backward() reverses both commands
+ *     and running forward() again (redo) repeats both, then return true. If it returns false,
+ *     'next' is added to the undo queue as usual.
+ *   * Implement 'void affectedObjects(const Result& result, std::vector<ObjectId>* objects) const'
+ *     to append the IDs of every object that the command reads or modifies. This allows
+ *     State::undoSession() to undo the command even if commands from other sessions have been
+ *     run since, as long as they don't affect any of the same objects. Commands that don't
+ *     implement it are assumed to affect everything.
  */
 template<class _State, int _commandId>
 class Command : public CommandBase {
@@ -218,7 +461,12 @@ public:
     /** Default constructor */
     Command() : CommandBase(_commandId) {}
     /** Constructor for internal use by OctoCore */
-    Command(const std::shared_ptr<Map>& args) : CommandBase(_commandId, args) {}
+    Command(const std::shared_ptr<FieldMap>& args) : CommandBase(_commandId, args) {}
+    /** Subclasses that use OCTO_FLAT_ARGS() replace these: */
+    using HasFlatArgs = std::false_type;
+    struct FlatArgs {
+        template<class V> void visitAll(V&) {}
+    };
     /** Compile-time constant accessor for the command ID */
     constexpr static int commandId() { return _commandId; }
     /** acceptStatePtr: Convert an Octo::State pointer in order to run this command.
@@ -226,7 +474,10 @@ public:
      *  subclass/interface type, or nullptr if this command cannot be applied to that state.
      *  The memory address returned by this method may be different than the argument given.
      */
-    static State* acceptStatePtr(Octo::State* state) { return dynamic_cast<State*>(state); }
+    static State* acceptStatePtr(Octo::State* state) {
+        static StatePtrCache<State> cache;
+        return cache.cast(state);
+    }
 };
 
 
@@ -234,28 +485,177 @@ public:
 class CommandRegistry {
 private:
     using CommandId = CommandBase::CommandId;
-    typedef void (*ForwardFn)(State* state, const std::shared_ptr<const Map>& args, const std::shared_ptr<Map>& result, bool mutableResult);
-    typedef void (*BackwardFn)(State* state, const std::shared_ptr<const Map>& args, const std::shared_ptr<const Map>& result);
+    // These return an INVALID_ARGUMENT status if the command cannot be applied to the given state,
+    // or the status set by ResultBase::willNotApply().
+    typedef Status (*ForwardFn)(State* state, const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<FieldMap>& result, bool mutableResult);
+    typedef Status (*BackwardFn)(State* state, const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result);
+    // Combines the command 'args'/'result' with the subsequent command 'nextArgs'/'nextResult'. See Command::merge()
+    typedef bool (*MergeFn)(const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result,
+                            const std::shared_ptr<const FieldMap>& nextArgs,
+                            const std::shared_ptr<const FieldMap>& nextResult,
+                            std::shared_ptr<const FieldMap>* mergedArgs, std::shared_ptr<const FieldMap>* mergedResult);
+    // Appends the IDs of the objects affected by the command 'args'/'result'. See Command::affectedObjects()
+    typedef void (*AffectedFn)(const std::shared_ptr<const FieldMap>& args,
+                               const std::shared_ptr<const FieldMap>& result, std::vector<ObjectId>* objects);
     /** Entry: Represent a pointer to a command class */
     struct Entry {
         ForwardFn forward;
         BackwardFn backward;
+        MergeFn merge; // nullptr if the command does not implement merge()
+        AffectedFn affected; // nullptr if the command does not implement affectedObjects()
+        bool has_results; // False if the command's OCTO_RESULTS() is empty, so it never needs a result map
+    };
+    /** Slot: One cell of the lookup table. Empty slots have a null 'entry'. */
+    struct Slot {
+        CommandId command_id;
+        const Entry* entry;
     };
     /** m_entries: The internal map of commands. Allows for fast lookups based on command ID */
     std::unordered_map<CommandId, Entry> m_entries;
+    /** m_table: Once frozen, every entry is found at m_table[slotIndex(commandId)] (or nowhere).
+     *  Until then it holds a single empty slot, so getCommand() falls back to m_entries. */
+    std::vector<Slot> m_table {Slot { 0, nullptr }};
+    bool m_frozen = false;
+    // Parameters of slotIndex(). For dense IDs this is just (cid - m_base); for sparse IDs it is a
+    // multiplicative hash that was chosen by compileTable() to be collision-free for the registered IDs.
+    CommandId m_base = 0;
+    uint32_t m_multiplier = 1;
+    uint32_t m_shift = 0;
+    uint32_t m_mask = 0;
+    uint32_t slotIndex(CommandId cid) const {
+        return ((static_cast<uint32_t>(cid) - static_cast<uint32_t>(m_base)) * m_multiplier >> m_shift) & m_mask;
+    }
+    /** decodeFlatArgs: Load the OCTO_FLAT_ARGS() fields (if any) of a re-created command */
+    template<class CommandSubclass>
+    static void decodeFlatArgs(CommandSubclass& cmd, const FieldMap& args, std::true_type) {
+        FlatArgsDecoder decoder {&args};
+        cmd.m_flat_args.visitAll(decoder);
+    }
+    template<class CommandSubclass>
+    static void decodeFlatArgs(CommandSubclass&, const FieldMap&, std::false_type) {}
+    /** mergeFn: Get Registration::merge if the command implements merge(), or else nullptr */
+    template<class CommandSubclass>
+    static auto mergeFn(int) -> decltype(
+        std::declval<CommandSubclass&>().merge(
+            std::declval<typename CommandSubclass::Result&>(), std::declval<const CommandSubclass&>(),
+            std::declval<const typename CommandSubclass::Result&>()
+        ),
+        MergeFn()
+    ) { return &Registration<CommandSubclass>::merge; }
+    template<class CommandSubclass>
+    static MergeFn mergeFn(long) { return nullptr; }
+    /** affectedFn: Get Registration::affected if the command implements affectedObjects(), or else nullptr */
+    template<class CommandSubclass>
+    static auto affectedFn(int) -> decltype(
+        std::declval<const CommandSubclass&>().affectedObjects(
+            std::declval<const typename CommandSubclass::Result&>(), std::declval<std::vector<ObjectId>*>()
+        ),
+        AffectedFn()
+    ) { return &Registration<CommandSubclass>::affected; }
+    template<class CommandSubclass>
+    static AffectedFn affectedFn(long) { return nullptr; }
     /** registerCommand: Internal method to add a new entry to the registry */
     void registerCommand(CommandId commandId, Entry entry) {
+        if (m_frozen) {
+            OCTO_THROW(StateException("Attempted to register a command with a CommandRegistry that has been frozen."));
+        }
+        if (commandId == CommandBase::CompoundCommandId) {
+            OCTO_THROW(StateException("That command ID is reserved for compound commands."));
+        }
         if (m_entries.count(commandId) != 0) {
-            throw StateException("Attempted to register the same command ID twice in the same CommandRegistry.");
+            OCTO_THROW(StateException("Attempted to register the same command ID twice in the same CommandRegistry."));
         }
         m_entries.emplace(std::make_pair(commandId, entry));
     }
+    /** buildTable: Try to place every entry into a table of 'size' slots using the current
+     *  slotIndex() parameters. Returns false if two command IDs would share a slot. */
+    bool buildTable(uint32_t size) {
+        m_mask = size - 1;
+        m_table.assign(size, Slot { 0, nullptr });
+        for (const auto& it : m_entries) {
+            Slot& slot = m_table[slotIndex(it.first)];
+            if (slot.entry != nullptr) {
+                return false;
+            }
+            slot = Slot { it.first, &it.second };
+        }
+        return true;
+    }
+    /** compileTable: Build the flat lookup table used by getCommand() once frozen, so that a
+     *  lookup costs a single indexed load. The table points into m_entries, which can no longer
+     *  change by then.
+     *
+     *  If the registered IDs are reasonably dense, the table is a plain array indexed by
+     *  (commandId - smallestId). Otherwise a perfect hash is searched for.
+     */
+    void compileTable() {
+        uint32_t num_entries = static_cast<uint32_t>(m_entries.size());
+        uint32_t size = 1;
+        while (size < num_entries) { size <<= 1; }
+        if (num_entries > 0) {
+            CommandId min_id = INT_MAX, max_id = INT_MIN;
+            for (const auto& it : m_entries) {
+                min_id = std::min(min_id, it.first);
+                max_id = std::max(max_id, it.first);
+            }
+            const uint64_t range = static_cast<uint64_t>(static_cast<int64_t>(max_id) - min_id) + 1;
+            if (range <= 2 * static_cast<uint64_t>(num_entries) + 16) {
+                // Dense: direct indexing
+                while (size < range) { size <<= 1; }
+                m_base = min_id;
+                m_multiplier = 1;
+                m_shift = 0;
+                buildTable(size);
+            } else {
+                // Sparse: find a multiplier that maps every ID to its own slot. With a table
+                // at least twice as big as the number of entries this takes only a few tries.
+                size = std::max(size * 2, 2u);
+                uint32_t seed = 2654435769u; // 2^32 / golden ratio
+                for (int attempt = 0; ; attempt++) {
+                    m_base = 0;
+                    m_multiplier = seed | 1;
+                    m_shift = 32;
+                    for (uint32_t s = size; s > 1; s >>= 1) { m_shift--; }
+                    if (buildTable(size)) {
+                        break;
+                    }
+                    seed = seed * 1664525u + 1013904223u;
+                    if (attempt % 64 == 63) {
+                        size <<= 1;
+                    }
+                }
+            }
+        } else {
+            buildTable(size);
+        }
+    }
 public:
+    /** freeze: Compile the registry into a flat lookup table so that getCommand() costs a
+     *  single indexed load. Call this once all commands have been registered (i.e. after static
+     *  initialization); any further attempt to register a command will throw a StateException.
+     *  Until then, getCommand() uses a (slower) hash table lookup.
+     */
+    void freeze() {
+        if (not m_frozen) {
+            compileTable();
+            m_frozen = true;
+        }
+    }
+    /** Has freeze() been called on this registry? */
+    bool isFrozen() const { return m_frozen; }
+
     /** getCommand: Given a command ID, get a handle that allows us to run that command.
      *  This method returns a pointer to a wrapper object with forward() and backward() methods.
      *  If the commandId is invalid, it will return nullptr.
      */
     const Entry* getCommand(CommandId cid) const {
+        const Slot& slot = m_table[slotIndex(cid)];
+        if (slot.command_id == cid and slot.entry != nullptr) {
+            return slot.entry;
+        }
+        if (m_frozen) {
+            return nullptr;
+        }
         auto it = m_entries.find(cid);
         return (it != m_entries.end()) ? &(it->second) : nullptr;
     }
@@ -268,39 +668,77 @@ public:
          *  Accessing the 'args' and reading/writing 'result' should both be accomplished using
          *  the typesafe field accessors generated by CommandArg and CommandResult.
          */
-        static void forward(Octo::State* state, const std::shared_ptr<const Map>& args, const std::shared_ptr<Map>& result, bool mutableResult) {
+        static Status forward(Octo::State* state, const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<FieldMap>& result, bool mutableResult) {
             if (State* typed_state = CommandSubclass::acceptStatePtr(state)) {
                 // The CommandBase constructor requires mutable args, so we const_cast it.
                 // The interface of the forward() method and checks within CommandBase
                 // ensure that the args will not be modified by the forward() method.
-                std::shared_ptr<Map> args_mutable = std::const_pointer_cast<Map>(args);
-                const CommandSubclass cmd {args_mutable};
+                std::shared_ptr<FieldMap> args_mutable = std::const_pointer_cast<FieldMap>(args);
+                CommandSubclass cmd {args_mutable};
+                decodeFlatArgs(cmd, *args, typename CommandSubclass::HasFlatArgs());
                 typename CommandSubclass::Result res {result, mutableResult};
-                cmd.forward(typed_state, res);
-            } else { throw InapplicableCommandException(); }
+                static_cast<const CommandSubclass&>(cmd).forward(typed_state, res);
+                return res.commandStatus();
+            } else { return inapplicableCommandStatus(); }
         }
         /** Construct an instance of the command with the given args and run it backward.
          *  Accessing the 'args' and reading 'result' should both be accomplished using
          *  the typesafe field accessors generated by CommandArg and CommandResult.
          */
-        static void backward(Octo::State* state, const std::shared_ptr<const Map>& args, const std::shared_ptr<const Map>& result) {
+        static Status backward(Octo::State* state, const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result) {
             if (State* typed_state = CommandSubclass::acceptStatePtr(state)) {
                 // The CommandBase constructor requires mutable args, so we use const_cast.
                 // The interface of the backward() method and checks within CommandBase ensure that neither
                 // the args nor the result will be modified by calling backward().
-                std::shared_ptr<Map> args_mutable = std::const_pointer_cast<Map>(args);
-                const CommandSubclass cmd {args_mutable};
+                std::shared_ptr<FieldMap> args_mutable = std::const_pointer_cast<FieldMap>(args);
+                CommandSubclass cmd {args_mutable};
+                decodeFlatArgs(cmd, *args, typename CommandSubclass::HasFlatArgs());
                 const typename CommandSubclass::Result res {result};
-                cmd.backward(typed_state, res);
-            } else { throw InapplicableCommandException(); }
+                static_cast<const CommandSubclass&>(cmd).backward(typed_state, res);
+                return Status();
+            } else { return inapplicableCommandStatus(); }
+        }
+        /** Re-create the command 'args' and the subsequent command 'nextArgs', and call merge() */
+        static bool merge(const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result,
+                          const std::shared_ptr<const FieldMap>& nextArgs,
+                          const std::shared_ptr<const FieldMap>& nextResult,
+                          std::shared_ptr<const FieldMap>* mergedArgs, std::shared_ptr<const FieldMap>* mergedResult) {
+            // The stored args are shared, so any changes that merge() makes to them are copy-on-write.
+            CommandSubclass cmd {std::const_pointer_cast<FieldMap>(args)};
+            decodeFlatArgs(cmd, *args, typename CommandSubclass::HasFlatArgs());
+            CommandSubclass next {std::const_pointer_cast<FieldMap>(nextArgs)};
+            decodeFlatArgs(next, *nextArgs, typename CommandSubclass::HasFlatArgs());
+            auto merged_result = std::make_shared<FieldMap>(*result); // Shares the values with 'result'
+            typename CommandSubclass::Result res {merged_result, true};
+            const typename CommandSubclass::Result next_res {nextResult};
+            if (not cmd.merge(res, static_cast<const CommandSubclass&>(next), next_res)) {
+                return false;
+            }
+            *mergedArgs = cmd.args();
+            *mergedResult = merged_result->empty() ? MapPool::emptyMap() : std::move(merged_result);
+            return true;
+        }
+        /** Re-create the command and call affectedObjects() */
+        static void affected(const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result,
+                             std::vector<ObjectId>* objects) {
+            CommandSubclass cmd {std::const_pointer_cast<FieldMap>(args)};
+            decodeFlatArgs(cmd, *args, typename CommandSubclass::HasFlatArgs());
+            const typename CommandSubclass::Result res {result};
+            static_cast<const CommandSubclass&>(cmd).affectedObjects(res, objects);
         }
         /** Given a subclass of Command, register it with the appropriate CommandRegistry */
         Registration() {
             static_assert(
-                sizeof(CommandSubclass) == sizeof(CommandBase),
-                "Command subclasses cannot have data members."
+                sizeof(CommandSubclass) == sizeof(CommandBase) + (
+                    CommandSubclass::HasFlatArgs::value ? sizeof(typename CommandSubclass::FlatArgs) : 0
+                ),
+                "Command subclasses cannot have data members (other than OCTO_FLAT_ARGS)."
             );
-            Entry entry { &Registration::forward, &Registration::backward };
+            Entry entry {
+                &Registration::forward, &Registration::backward, mergeFn<CommandSubclass>(0),
+                affectedFn<CommandSubclass>(0),
+                CommandSubclass::Result::has_fields
+            };
             State::getCommandRegistry()->registerCommand(CommandSubclass::commandId(), entry);
         }
     };
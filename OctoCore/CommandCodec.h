@@ -0,0 +1,70 @@
+/**
+ * CommandCodec: Reads and writes commands (ID, args and result) in CommandData wire format.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "FieldHash.h"
+#include "MapPool.h"
+
+namespace Octo {
+
+/** CommandFrame: One command that has been run: its ID, args and result, and the session that ran it */
+struct CommandFrame {
+    int32_t command_id;
+    std::shared_ptr<const FieldMap> args;
+    std::shared_ptr<const FieldMap> result;
+    uint16_t session_id = 0;
+    /** The child commands of a compound command that was committed by a State::Transaction.
+     *  While this is set, the children are not encoded into 'args' and 'result' (which are
+     *  empty) until encodeChildren() is called, e.g. before the command is written to a file. */
+    std::shared_ptr<const std::vector<CommandFrame>> children = nullptr;
+};
+
+/** Number of bytes needed to encode the given command as a CommandData message */
+size_t commandDataSize(int32_t commandId, const FieldMap& args, const FieldMap& result, uint16_t sessionId = 0);
+/** Encode a command as a CommandData message. The output is identical to serializing a
+ *  CommandData with the same contents, but the FieldMaps are written directly, without first
+ *  being converted to MapValues. A non-zero session ID is written as field 4, which
+ *  CommandData parsers that don't know about it will skip. */
+void writeCommandData(google::protobuf::io::CodedOutputStream* output, int32_t commandId,
+                      const FieldMap& args, const FieldMap& result, uint16_t sessionId = 0);
+/** JournalFields: Extra CommandData fields (5 and 6) written to journal files. See Journal.h. */
+struct JournalFields {
+    uint32_t op = 0;
+    uint64_t value = 0;
+};
+/** Number of bytes needed to encode the given journal fields. Fields that are zero are omitted. */
+size_t journalFieldsSize(const JournalFields& fields);
+/** Append the journal fields to a CommandData message written by writeCommandData() */
+void writeJournalFields(google::protobuf::io::CodedOutputStream* output, const JournalFields& fields);
+/** Decode a CommandData message, reading until the end of the input or the current limit.
+ *  Missing args or result maps are set to MapPool::emptyMap(). If 'journal' is given, the
+ *  journal fields are read into it (otherwise they are skipped like any other unknown field).
+ *  Returns false if the data is malformed. */
+bool readCommandData(google::protobuf::io::CodedInputStream* input, CommandFrame* frame,
+                     JournalFields* journal = nullptr);
+
+/** Compound commands (see State::Transaction) store their child commands in these fields:
+ *  args:   command_ids (IntList): The ID of each child command
+ *          command_args (List of Map): The args of each child command
+ *  result: command_results (List of Map): The result of each child command
+ */
+enum : FieldId {
+    compound_command_ids_field_id = "command_ids"_octo_field_name_hash,
+    compound_command_args_field_id = "command_args"_octo_field_name_hash,
+    compound_command_results_field_id = "command_results"_octo_field_name_hash,
+};
+/** Encode the child commands of a compound command into its args and result */
+void encodeCompoundCommand(const std::vector<CommandFrame>& children, FieldMap* args, FieldMap* result);
+/** If 'frame' has unencoded children (see CommandFrame::children), encode them into new args
+ *  and result maps */
+void encodeChildren(CommandFrame* frame);
+/** Decode the child commands of a compound command. If the compound command has not been run
+ *  yet ('result' is empty), each child gets an empty result. Returns false if the args are invalid. */
+bool decodeCompoundCommand(const FieldMap& args, const FieldMap& result, std::vector<CommandFrame>* children);
+
+} // namespace Octo
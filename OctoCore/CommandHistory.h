@@ -0,0 +1,116 @@
+/**
+ * CommandHistory: The undo/redo history of a State.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "CommandCodec.h"
+
+namespace Octo {
+
+/** CommandHistory: A list of commands (oldest first) with a cursor that separates the commands
+ *  that can be undone (before the cursor) from those that can be redone (after it).
+ *  Undo and redo just move the cursor, so no records are moved or copied.
+ *
+ *  The commands are stored in a ring buffer, so that the oldest commands can be removed (and,
+ *  when paging in commands from a HistorySpill, added) without moving the others. Command IDs
+ *  and session IDs are kept in separate arrays from the args/result pointers, so that scanning
+ *  them only touches a few cache lines. An index from each session ID to its commands makes
+ *  lastFromSession() fast, however many commands other sessions have run.
+ *
+ *  Indices passed to commandId()/record() count from the oldest command in the history.
+ */
+class CommandHistory {
+public:
+    /** Record: The data of one command */
+    struct Record {
+        std::shared_ptr<const FieldMap> args;
+        std::shared_ptr<const FieldMap> result;
+        std::shared_ptr<const std::vector<CommandFrame>> children; // See CommandFrame::children
+        size_t footprint; // Counted towards bytes(). Zero unless trackBytes() is enabled.
+        uint64_t serial; // Increases from the oldest command to the newest. Used by the session index.
+    };
+
+    CommandHistory() {}
+    CommandHistory(const CommandHistory&) = delete;
+    CommandHistory& operator=(const CommandHistory&) = delete;
+
+    /** Number of commands in the history */
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    /** Number of commands before the cursor, i.e. that can be undone */
+    size_t undoCount() const { return m_cursor; }
+    /** Number of commands after the cursor, i.e. that can be redone */
+    size_t redoCount() const { return m_size - m_cursor; }
+    /** Total footprint (serialized size of the args and result) of the commands. This is kept
+     *  up to date while trackBytes() is enabled; otherwise it is computed by each call. */
+    size_t bytes() const;
+    /** Keep a running total of the commands' footprints, so that bytes() is fast. This costs a
+     *  byteSize() call for every command added, so it is only worth enabling to enforce a limit. */
+    void trackBytes(bool enabled);
+
+    int32_t commandId(size_t index) const { return m_ids[slot(index)]; }
+    const Record& record(size_t index) const { return m_records[slot(index)]; }
+    uint16_t sessionId(size_t index) const { return m_sessions[slot(index)]; }
+    /** Find the most recent command from the given session that is before the cursor */
+    bool lastFromSession(uint16_t sessionId, size_t* index) const;
+
+    /** Move the cursor back/forward by one command. The caller must check undoCount()/redoCount(). */
+    void undo() { m_cursor--; }
+    void redo() { m_cursor++; }
+    /** Move the cursor so that undoCount() == position */
+    void setCursor(size_t position) { m_cursor = position; }
+
+    /** Add a command at the end of the history. The cursor moves past it if it was at the end. */
+    void pushBack(int32_t commandId, std::shared_ptr<const FieldMap> args, std::shared_ptr<const FieldMap> result,
+                  uint16_t sessionId, std::shared_ptr<const std::vector<CommandFrame>> children = nullptr);
+    /** Add a command at the start of the history. The cursor stays on the same command. */
+    void pushFront(int32_t commandId, std::shared_ptr<const FieldMap> args, std::shared_ptr<const FieldMap> result,
+                   uint16_t sessionId, std::shared_ptr<const std::vector<CommandFrame>> children = nullptr);
+    /** Remove the newest command. If it was before the cursor, the cursor moves back. */
+    void popBack();
+    /** Remove the oldest command. If it was before the cursor, the cursor moves back. */
+    void popFront();
+    /** Remove every command after the cursor */
+    void discardRedo();
+    /** Remove the command at 'index', which must be before the cursor. The cursor moves back. */
+    void erase(size_t index);
+private:
+    size_t slot(size_t index) const { return (m_head + index) & (m_ids.size() - 1); }
+    /** Make room for at least one more command */
+    void reserveOne() {
+        if (m_size == m_ids.size()) {
+            grow();
+        }
+    }
+    void grow();
+    /** Store a command in an empty slot */
+    void fillSlot(size_t slotIndex, int32_t commandId, std::shared_ptr<const FieldMap> args,
+                  std::shared_ptr<const FieldMap> result, uint16_t sessionId, uint64_t serial,
+                  std::shared_ptr<const std::vector<CommandFrame>> children);
+    /** Release a slot's data, so that its FieldMaps can be recycled */
+    void clearSlot(size_t slotIndex);
+    /** Find the index of the command with the given serial number */
+    size_t indexOfSerial(uint64_t serial) const;
+
+    // These arrays have the same size (a power of two, or zero) and are indexed by slot():
+    std::vector<int32_t> m_ids;
+    std::vector<uint16_t> m_sessions;
+    std::vector<Record> m_records;
+    // The serial numbers of each session's commands, oldest first:
+    std::unordered_map<uint16_t, std::deque<uint64_t>> m_session_index;
+    uint64_t m_front_serial = 1ull << 62; // Serial number of the last command added with pushFront()
+    uint64_t m_back_serial = 1ull << 62; // Serial number to give the next command added with pushBack()
+    size_t m_head = 0; // Slot of the oldest command
+    size_t m_size = 0;
+    size_t m_cursor = 0;
+    size_t m_bytes = 0; // Only counted while m_track_bytes is set
+    bool m_track_bytes = false;
+};
+
+} // namespace Octo
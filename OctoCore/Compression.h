@@ -0,0 +1,24 @@
+/**
+ * Compression: A small, fast compressor for blocks of journal data.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Octo {
+
+/** Compress 'size' bytes at 'data', appending the compressed bytes to 'output'.
+ *  This is a simple LZ77 compressor that writes the LZ4 block format: runs of literal bytes,
+ *  each followed by a copy of up to 64KB back. It replaces repeated byte sequences, such as the
+ *  field IDs, tags and strings that most commands share, and is fast enough to be used while
+ *  commands are being journaled. Each block is independent of any other. */
+void compressBlock(const char* data, size_t size, std::string* output);
+
+/** Decompress a block written by compressBlock() into the 'rawSize' bytes at 'output'.
+ *  Returns false if the block is corrupt or does not decompress to exactly 'rawSize' bytes. */
+bool decompressBlock(const uint8_t* data, size_t size, char* output, size_t rawSize);
+
+} // namespace Octo
@@ -75,18 +75,39 @@ struct mutate_as {
     typedef typename make_reference_mutable<typename unwrap_as<T>::type>::type type;
 };
 
+/** wrapInto: Like wrap(), but writes the value straight into an existing GenericValue, which is
+ *  cheaper than assigning the result of wrap(). Containers passed as rvalues are moved in
+ *  (for all but Map and StrMap) rather than copied.
+ */
+template<typename E>
+inline void adoptEntries(google::protobuf::RepeatedField<E>* target, google::protobuf::RepeatedField<E>* source) {
+    target->Clear();
+    target->Swap(source);
+}
+template<typename E>
+inline void adoptEntries(google::protobuf::RepeatedPtrField<E>* target, google::protobuf::RepeatedPtrField<E>* source) {
+    target->Clear();
+    target->Swap(source);
+}
+template<typename K, typename V>
+inline void adoptEntries(google::protobuf::Map<K, V>* target, google::protobuf::Map<K, V>* source) {
+    *target = *source; // protobuf's Map cannot be swapped
+}
+
 #define _octo_wrap_basic(Type, accessor_name) \
-    inline GenericValue    wrap(Type value) { GenericValue v; v.set_##accessor_name(value); return std::move(v); } \
+    inline GenericValue    wrap(Type value) { GenericValue v; v.set_##accessor_name(value); return v; } \
+    inline void            wrapInto(GenericValue* target, Type value) { target->set_##accessor_name(value); } \
     template<> inline Type unwrap<Type>(const GenericValue& value) { return value.accessor_name(); } \
     template<> inline bool can_unwrap<Type>(const GenericValue& value) { return value.has_##accessor_name(); }
 
 #define _octo_wrap_container(ContainerType, ContainerWrapperType, accessor_name) \
-    inline GenericValue wrap(ContainerType&& value) { \
-        ContainerWrapperType wrapper; \
-        *wrapper.mutable_entries() = std::move(value); \
-        GenericValue v; *v.mutable_##accessor_name() = std::move(wrapper); \
-        return std::move(v); \
+    inline void wrapInto(GenericValue* target, const ContainerType& value) { \
+        *target->mutable_##accessor_name()->mutable_entries() = value; \
+    } \
+    inline void wrapInto(GenericValue* target, ContainerType&& value) { \
+        adoptEntries(target->mutable_##accessor_name()->mutable_entries(), &value); \
     } \
+    inline GenericValue wrap(ContainerType&& value) { GenericValue v; wrapInto(&v, std::move(value)); return v; } \
     template<> inline const ContainerType& \
     unwrap<const ContainerType&>(const GenericValue& value) { \
         return value.accessor_name().entries(); } \
@@ -105,8 +126,11 @@ _octo_wrap_basic(int64_t, int64)
 _octo_wrap_basic(double, real)
 // Special case for string objects:
 /** Wrap a string. Must always contain UTF-8 encoded or 7-bit ASCII text */
-inline GenericValue             wrap(const string& value) { GenericValue v; v.set_string(value); return std::move(v); }
-inline GenericValue             wrap(const char* value) { GenericValue v; v.set_string(value); return std::move(v); }
+inline GenericValue             wrap(const string& value) { GenericValue v; v.set_string(value); return v; }
+inline GenericValue             wrap(const char* value) { GenericValue v; v.set_string(value); return v; }
+inline void                     wrapInto(GenericValue* target, const string& value) { target->set_string(value); }
+inline void                     wrapInto(GenericValue* target, string&& str) { target->mutable_string()->swap(str); }
+inline void                     wrapInto(GenericValue* target, const char* value) { target->set_string(value); }
 template<> inline const string& unwrap<const string&>(const GenericValue& value) { return value.string(); }
 template<> inline string&       unwrap<string&>(GenericValue& value) { return *value.mutable_string(); }
 template<> inline bool          can_unwrap<string>(const GenericValue& value) { return value.has_string(); }
@@ -118,4 +142,12 @@ _octo_wrap_container(StrList, StringListValue, str_list)
 _octo_wrap_container(Map, MapValue, map)
 _octo_wrap_container(StrMap, SMapValue, str_map)
 
+/** appendTo: Add a value to the end of a list container, constructing it in place */
+inline void appendTo(IntList* list, int64_t value) { list->Add(value); }
+inline void appendTo(StrList* list, const string& value) { *list->Add() = value; }
+inline void appendTo(StrList* list, string&& value) { *list->Add() = std::move(value); }
+inline void appendTo(StrList* list, const char* value) { *list->Add() = value; }
+template<typename T>
+inline void appendTo(List* list, T&& value) { wrapInto(list->Add(), std::forward<T>(value)); }
+
 } // namespace Octo
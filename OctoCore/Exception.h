@@ -4,9 +4,22 @@
  */
 #pragma once
 
+#include <cstdlib>
 #include <exception>
 #include <string>
 
+/** OCTO_THROW(exception): Used by OctoCore wherever it would throw an exception.
+ *  When compiled with exceptions disabled (-fno-exceptions), this aborts instead. Code that needs
+ *  to handle errors in such builds should use the non-throwing API (e.g. State::tryRunCommand()).
+ */
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+    #define OCTO_EXCEPTIONS_ENABLED 1
+    #define OCTO_THROW(exception) throw exception
+#else
+    #define OCTO_EXCEPTIONS_ENABLED 0
+    #define OCTO_THROW(exception) std::abort()
+#endif
+
 namespace Octo {
 
 /** Base class for all exceptions thrown by OctoCore */
@@ -19,10 +32,10 @@ public:
 
 /** Base class for an State error */
 class StateException : public Exception {
-    const char* m_error_reason;
+    const std::string m_error_reason;
 public:
-    StateException(const char* errorReason) : m_error_reason(errorReason) {}
-    virtual const char* what() const noexcept { return m_error_reason; }
+    StateException(std::string errorReason) : m_error_reason(std::move(errorReason)) {}
+    virtual const char* what() const noexcept { return m_error_reason.c_str(); }
 };
 
 class InapplicableCommandException : public StateException {
@@ -37,10 +50,10 @@ class CommandException : public Exception {};
 
 /** Error when trying to initialize a command that is incompatible with the current State */
 class CommandWillNotApplyException : public CommandException {
-    const char* m_error_reason;
+    const std::string m_error_reason;
 public:
-    CommandWillNotApplyException(const char* errorReason) : m_error_reason(errorReason) {}
-    virtual const char* what() const noexcept { return m_error_reason; }
+    CommandWillNotApplyException(std::string errorReason) : m_error_reason(std::move(errorReason)) {}
+    virtual const char* what() const noexcept { return m_error_reason.c_str(); }
 };
 
 /** Error when trying to initialize a command that is incompatible with the current State */
@@ -0,0 +1,191 @@
+/**
+ * FieldMap: The container used to hold the args and result data of commands.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "DataTypes.h"
+#include "Exception.h"
+#include "SlabPool.h"
+
+namespace google { namespace protobuf { namespace io {
+    class CodedInputStream;
+    class CodedOutputStream;
+}}}
+
+namespace Octo {
+
+/** FieldMap: A small map from FieldId to GenericValue, sorted by key.
+ *  Command args and results typically have only a handful of fields, so rather than a hash map
+ *  (like Octo::Map), FieldMap keeps its entries in a sorted array. The first InlineCapacity
+ *  entries are stored inside the FieldMap itself, so small maps need no extra array allocation.
+ *
+ *  Each value is held in a reference-counted node, and copying a FieldMap shares the nodes
+ *  rather than copying the values. A shared value is copied only when it is modified (via
+ *  operator[] or the non-const at()), so modifying one field of a copied map copies only that
+ *  field, however large the other fields are. overwrite() replaces a shared value without
+ *  copying it at all. Iterating over a FieldMap gives read-only access. The nodes are allocated
+ *  from a SlabPool, so that dropping a long undo history releases their memory in whole slabs.
+ *
+ *  FieldMap has the same wire format as MapValue, so a serialized FieldMap can be parsed as a
+ *  MapValue and vice versa.
+ */
+class FieldMap {
+    /** Slot: One entry of the sorted array */
+    struct Slot {
+        FieldId key;
+        std::shared_ptr<GenericValue> value;
+    };
+public:
+    /** value_type: A key-value pair. Named like std::pair so that iterating feels like any other map. */
+    struct value_type {
+        FieldId first;
+        const GenericValue& second;
+        const value_type* operator->() const { return this; } // Allows it->second on iterators
+    };
+    class const_iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = FieldMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type;
+        using reference = value_type;
+
+        explicit const_iterator(const Slot* slot) : m_slot(slot) {}
+        value_type operator*() const { return value_type { m_slot->key, *m_slot->value }; }
+        value_type operator->() const { return **this; }
+        const_iterator& operator++() { ++m_slot; return *this; }
+        const_iterator operator+(difference_type n) const { return const_iterator(m_slot + n); }
+        difference_type operator-(const const_iterator& other) const { return m_slot - other.m_slot; }
+        bool operator==(const const_iterator& other) const { return m_slot == other.m_slot; }
+        bool operator!=(const const_iterator& other) const { return m_slot != other.m_slot; }
+    private:
+        const Slot* m_slot;
+    };
+    using iterator = const_iterator;
+
+    /** Number of entries that can be stored without allocating an array on the heap */
+    static constexpr size_t InlineCapacity = 4;
+
+    FieldMap() : m_size(0), m_slots(m_inline) {}
+    FieldMap(const FieldMap& other);
+    FieldMap& operator=(const FieldMap& other);
+    FieldMap(const Map& other) : FieldMap() { copyFrom(other); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const_iterator begin() const { return const_iterator(m_slots); }
+    const_iterator end() const { return const_iterator(m_slots + m_size); }
+
+    const_iterator find(FieldId key) const {
+        const Slot* slot = lowerBound(key);
+        return const_iterator((slot != m_slots + m_size and slot->key == key) ? slot : m_slots + m_size);
+    }
+    size_t count(FieldId key) const { return find(key) != end() ? 1 : 0; }
+    /** Get the value with the given key. Throws std::out_of_range if there is no such value. */
+    const GenericValue& at(FieldId key) const {
+        const Slot* slot = lowerBound(key);
+        if (slot == m_slots + m_size or slot->key != key) {
+            OCTO_THROW(std::out_of_range("FieldMap::at"));
+        }
+        return *slot->value;
+    }
+    GenericValue& at(FieldId key) {
+        Slot* slot = lowerBound(key);
+        if (slot == m_slots + m_size or slot->key != key) {
+            OCTO_THROW(std::out_of_range("FieldMap::at"));
+        }
+        return mutableValue(*slot);
+    }
+    /** Get the value with the given key, inserting an empty value if there is none. */
+    GenericValue& operator[](FieldId key) {
+        Slot* slot = lowerBound(key);
+        if (slot != m_slots + m_size and slot->key == key) {
+            return mutableValue(*slot);
+        }
+        return *insertAt(slot - m_slots, key).value;
+    }
+    /** Get an empty value with the given key, to be overwritten with a new value. Any existing
+     *  value is discarded; unlike operator[], a value shared with another FieldMap is replaced
+     *  by a new one rather than being copied first. */
+    GenericValue& overwrite(FieldId key) {
+        Slot* slot = lowerBound(key);
+        if (slot != m_slots + m_size and slot->key == key) {
+            if (slot->value.use_count() > 1) {
+                slot->value = newValue();
+            } else {
+                slot->value->Clear();
+            }
+            return *slot->value;
+        }
+        return *insertAt(slot - m_slots, key).value;
+    }
+    /** Remove the value with the given key, if present. Returns the number of values removed. */
+    size_t erase(FieldId key);
+    void clear();
+
+    /** Copy the entries of a protobuf Map/MapValue into this FieldMap (replacing any existing entries) */
+    void copyFrom(const Map& other);
+    void copyFrom(const MapValue& other) { copyFrom(other.entries()); }
+    /** Copy the entries of this FieldMap into a MapValue */
+    void copyTo(MapValue* other) const;
+
+    /** Number of bytes required to serialize this map (in MapValue wire format) */
+    size_t byteSize() const;
+    /** Serialize this map in MapValue wire format. */
+    void serialize(google::protobuf::io::CodedOutputStream* output) const;
+    std::string serializeAsString() const;
+    /** Parse MapValue wire format data, adding the entries to this map. Parses until the end of
+     *  the input or the current limit. Returns false if the data is malformed. */
+    bool mergeFrom(google::protobuf::io::CodedInputStream* input);
+    bool parseFromString(const std::string& data);
+private:
+    Slot* lowerBound(FieldId key) const {
+        Slot* const end = m_slots + m_size;
+        if (m_size <= InlineCapacity) { // Linear search is fastest for very small maps
+            Slot* slot = m_slots;
+            while (slot != end and slot->key < key) { ++slot; }
+            return slot;
+        }
+        return std::lower_bound(m_slots, end, key, [](const Slot& s, FieldId k) { return s.key < k; });
+    }
+    /** Allocate a new value node (and its reference count) from the shared SlabPool */
+    static std::shared_ptr<GenericValue> newValue() {
+        return std::allocate_shared<GenericValue>(SlabAllocator<GenericValue>());
+    }
+    static std::shared_ptr<GenericValue> newValue(const GenericValue& value) {
+        return std::allocate_shared<GenericValue>(SlabAllocator<GenericValue>(), value);
+    }
+    /** Get a value for writing, first copying it if it is shared with another FieldMap */
+    static GenericValue& mutableValue(Slot& slot) {
+        if (slot.value.use_count() > 1) {
+            slot.value = newValue(*slot.value);
+        }
+        return *slot.value;
+    }
+    /** Release the value of a slot that is no longer in use. If the value is not shared, it is
+     *  kept (cleared) so that it can be re-used without allocating. */
+    static void recycle(Slot& slot) {
+        if (slot.value.use_count() == 1) {
+            slot.value->Clear();
+        } else {
+            slot.value.reset();
+        }
+    }
+    Slot& insertAt(size_t index, FieldId key);
+    void setSlotsPointer() { m_slots = m_heap.empty() ? m_inline : m_heap.data(); }
+
+    size_t m_size;
+    Slot* m_slots; // Points to either m_inline or m_heap.data()
+    Slot m_inline[InlineCapacity]; // Unused slots hold either nothing or a cleared value that can be re-used
+    std::vector<Slot> m_heap; // Holds all of the entries, once there are more than InlineCapacity
+};
+
+} // namespace Octo
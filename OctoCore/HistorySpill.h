@@ -0,0 +1,76 @@
+/**
+ * HistorySpill: Stores the oldest part of a State's undo history in a file.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <string>
+#include <vector>
+#ifndef EMSCRIPTEN
+#include <future>
+#endif
+
+#include "CommandCodec.h"
+
+namespace Octo {
+
+/** HistorySpill: A stack of blocks of commands, stored in a file.
+ *  When the undo history gets long, State moves its oldest commands into a block at the end
+ *  of the file (pushBlock), and reads the most recent block back in (popBlock) once the
+ *  commands that are still in memory have all been undone. Each block is a sequence of
+ *  length-prefixed CommandData messages. The space left at the start of the file by dropped
+ *  blocks (see dropOldest) is reclaimed by moving the remaining blocks down, once it is large
+ *  enough to be worth it, so the file stays in proportion to the commands it holds.
+ *
+ *  prefetch() reads and decodes the most recent block on a background thread (except in
+ *  Emscripten builds), so that popBlock() usually doesn't have to wait for the disk.
+ *  The file is deleted when the HistorySpill is destroyed.
+ */
+class HistorySpill {
+public:
+    /** Create the spill file at 'path', replacing any existing file. Throws StateException if
+     *  the file cannot be created. */
+    explicit HistorySpill(std::string path);
+    ~HistorySpill();
+    HistorySpill(const HistorySpill&) = delete;
+    HistorySpill& operator=(const HistorySpill&) = delete;
+
+    /** Write a block of commands (oldest first) to the end of the file */
+    void pushBlock(const std::vector<CommandFrame>& commands);
+    /** Read back the most recently written block of commands (oldest first) and remove it */
+    std::vector<CommandFrame> popBlock();
+    /** Start loading the most recent block in the background, if it is not already loaded */
+    void prefetch();
+    /** Forget the oldest command in the file */
+    void dropOldest();
+
+    /** Number of commands in the file */
+    size_t commandCount() const { return m_command_count; }
+    /** Number of blocks in the file */
+    size_t blockCount() const { return m_blocks.size(); }
+private:
+    struct Block {
+        uint64_t offset; // Position of the block in the file
+        size_t size; // Size of the block in bytes
+        size_t count; // Number of commands in the block
+        size_t skip; // Number of commands at the start of the block that have been dropped
+    };
+    /** Read and decode a block. This may be called from a background thread. */
+    static std::vector<CommandFrame> readBlock(int fd, Block block);
+    /** Wait for any prefetch in progress, and return its result if it is for the given block */
+    bool takePrefetched(size_t blockIndex, std::vector<CommandFrame>* commands);
+    /** Move the blocks to the start of the file, if enough space before them has been freed */
+    void compact();
+
+    const std::string m_path;
+    int m_fd;
+    std::vector<Block> m_blocks;
+    uint64_t m_end = 0; // End of the last block
+    size_t m_command_count = 0;
+    #ifndef EMSCRIPTEN
+    std::future<std::vector<CommandFrame>> m_prefetch;
+    size_t m_prefetch_block = 0; // Index of the block being loaded by m_prefetch
+    #endif
+};
+
+} // namespace Octo
@@ -0,0 +1,311 @@
+/**
+ * Journal: An append-only log of the changes made to a State.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef EMSCRIPTEN
+#include <future>
+#include <thread>
+#endif
+
+#include "CommandCodec.h"
+
+namespace Octo {
+
+/** JournalOp: The type of change recorded by a journal frame */
+enum class JournalOp : uint32_t {
+    Command = 0, // A command was run and added to the undo history (value: the session's next object ID)
+    Apply = 1, // A command was run without being added to the undo history (value: as for Command)
+    Undo = 2,
+    Redo = 3,
+    UndoTo = 4, // value: the history position
+    RedoTo = 5, // value: the history position
+    UndoSession = 6, // The session ID is stored in the command's session_id field
+    SwitchBranch = 7, // value: the branch ID
+    StopMerging = 8, // value: 1 if the next command is not merged with the one after it either
+};
+
+/** JournalFrame: One entry in a journal */
+struct JournalFrame {
+    JournalOp op;
+    CommandFrame command; // The command, for Command and Apply frames
+    uint64_t value;
+};
+
+/** JournalPosition: Where a frame is in a journal */
+struct JournalPosition {
+    uint32_t segment; // The segment number
+    uint64_t frame; // The index of the frame within its segment
+};
+
+/** JournalBlock: An entry in the block index of a compressed segment (see JournalWriter) */
+struct JournalBlock {
+    uint64_t first_frame; // The index of the block's first frame within the segment
+    uint64_t frame_count;
+    uint64_t offset; // Where the block starts in the segment file
+};
+
+/** JournalDurability: When appended frames are flushed to the disk
+ *   * None: Each frame is passed to the operating system as soon as it is appended, but is only
+ *     flushed to the disk when the OS decides to (or sync() is called). A crash of the process
+ *     loses nothing, but a crash of the machine may lose recent frames.
+ *   * Batched: Frames are collected into batches, each of which is written and flushed to the
+ *     disk with a single fdatasync() (group commit). A batch is flushed once it is older than
+ *     the batch delay or larger than the batch size (see setBatchWindow()), so at most that
+ *     window of frames is lost if the machine crashes. append() never waits for the disk.
+ *   * Synchronous: append() returns once the frame is on the disk. Frames appended concurrently
+ *     from several threads while a flush is in progress share the next flush.
+ */
+enum class JournalDurability {
+    None,
+    Batched,
+    Synchronous,
+};
+
+/** JournalWriter: Appends frames to the segment files of a journal.
+ *  A journal is a directory of segment files, which are numbered in the order they were written.
+ *  Each segment is a sequence of length-prefixed CommandData messages. Frames that don't
+ *  describe a command have an empty CommandData apart from the extra JournalFields.
+ *  A new segment is started whenever the current one grows beyond 'segmentBytes', and each
+ *  JournalWriter starts a new segment rather than appending to a segment that may have been
+ *  left incomplete by a crash.
+ *
+ *  If 'compressedBlockBytes' is not zero, the segments are compressed instead: the frames are
+ *  collected into blocks of about that many bytes, and each block is compressed on its own (see
+ *  compressBlock()), so that it can be decompressed without reading the rest of the segment.
+ *  A compressed segment starts with a four-byte marker, then each block is stored as its
+ *  compressed size, raw size, index of its first frame and number of frames (varints) followed
+ *  by the compressed frames. When the segment is finished, a block index is appended: the first
+ *  frame, frame count and offset of each block (varints), then the offset of the index (64 bits,
+ *  little-endian) and a four-byte marker. A reader uses the index to find the block that holds
+ *  a given frame, and the block headers if the index is missing because of a crash.
+ *  Blocks are also ended early whenever frames are flushed (see JournalDurability). With None
+ *  durability, the frames of an unfinished block are passed to the OS once the block is full,
+ *  or once the batch delay (see setBatchWindow()) has passed since the oldest of them was
+ *  appended, in a block of their own, so a crash of the process loses at most that window
+ *  of frames. A background thread does this (except in Emscripten builds, where the next
+ *  append() does).
+ *
+ *  When frames are flushed to the disk depends on the JournalDurability. With Batched
+ *  durability, a background thread flushes each batch once its time is up (except in
+ *  Emscripten builds, where the next append() or sync() does). append() and sync() may be
+ *  called from several threads at once.
+ */
+class JournalWriter {
+public:
+    /** Open the journal in 'directory', creating the directory if necessary. The first segment
+     *  is numbered after every segment in the directory, and at least as high as its latest
+     *  snapshot, so that it is replayed after that snapshot. Throws StateException if the
+     *  directory cannot be created. */
+    explicit JournalWriter(std::string directory, JournalDurability durability = JournalDurability::None,
+                           size_t segmentBytes = 64 << 20, size_t compressedBlockBytes = 0);
+    /** Flushes any frames that have not been written yet */
+    ~JournalWriter();
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    /** Append a frame. Throws StateException if the journal cannot be written. */
+    void append(const JournalFrame& frame);
+    /** Write any frames that are waiting to be written, and flush them all to the disk */
+    void sync();
+    /** Flush the current segment and start a new one, unless the current one is still empty.
+     *  Returns the number of the new segment, i.e. of the first frame appended after this. */
+    uint32_t startSegment();
+    /** Set how long (at most) a batch waits before it is flushed, and the size at which it is
+     *  flushed straight away. Used with Batched durability, and with None durability for
+     *  compressed segments (see above). The default is 2ms and 1MB. */
+    void setBatchWindow(std::chrono::microseconds delay, size_t maxBytes);
+
+    const std::string& directory() const { return m_directory; }
+    JournalDurability durability() const { return m_durability; }
+    bool isCompressed() const { return m_block_bytes > 0; }
+    /** Number of the segment currently being written */
+    uint32_t segmentNumber() const { return m_segment; }
+    /** Number of frames that have been flushed to the disk so far, and the number of flushes */
+    uint64_t syncedFrames() const;
+    uint64_t syncCount() const;
+private:
+    using Lock = std::unique_lock<std::mutex>;
+    using Clock = std::chrono::steady_clock;
+    /** Start writing a new segment file. Returns false if it cannot be created. */
+    bool openSegment(uint32_t number);
+    /** Write the block index of the current segment (if it is compressed), optionally flush the
+     *  segment to the disk, and close it. Returns false if it cannot be written. */
+    bool finishSegment(bool flush);
+    /** Write the frames in m_write_buffer to the current segment, starting a new one if it is
+     *  full. Called by writePending() with the lock released. */
+    bool writeFrames();
+    bool writeBlocks();
+    /** Write 'size' bytes to the end of the current segment */
+    bool writeData(const char* data, size_t size);
+    /** Write the pending frames, and optionally flush them to the disk. Called with the lock
+     *  held, by at most one thread at a time (see m_writing). Unlocks while writing. */
+    void writePending(Lock& lock, bool flush);
+    /** Wait until the first 'count' frames are on the disk, flushing them if no other thread is */
+    void waitForSync(Lock& lock, uint64_t count);
+    #ifndef EMSCRIPTEN
+    /** Body of the background thread that flushes batches */
+    void flushBatches();
+    #endif
+
+    const std::string m_directory;
+    const JournalDurability m_durability;
+    const size_t m_segment_bytes;
+    const size_t m_block_bytes; // Zero if the segments are not compressed
+    std::chrono::microseconds m_batch_delay {2000};
+    size_t m_batch_bytes = 1 << 20;
+    // These are only used by the thread that is writing:
+    int m_fd = -1;
+    uint32_t m_segment = 0;
+    size_t m_segment_size = 0; // Bytes written to the current segment
+    std::string m_write_buffer; // The frames being written
+    std::string m_block_buffer; // The block being compressed
+    std::vector<JournalBlock> m_blocks; // The blocks of the current segment so far
+    uint64_t m_segment_frames = 0; // Number of frames written to the current segment
+    // These are guarded by m_mutex:
+    std::string m_pending; // Encoded frames that have not been written yet
+    Clock::time_point m_pending_since; // When the oldest pending frame was appended
+    uint64_t m_appended = 0; // Number of frames appended
+    uint64_t m_written = 0; // Number of frames passed to the OS
+    uint64_t m_synced = 0; // Number of frames flushed to the disk
+    uint64_t m_sync_count = 0;
+    bool m_writing = false; // Is a thread writing (with the lock released)?
+    bool m_failed = false; // Has a write failed?
+    mutable std::mutex m_mutex;
+    std::condition_variable m_write_done; // Signalled whenever a thread finishes writing
+    #ifndef EMSCRIPTEN
+    std::condition_variable m_batch_ready; // Wakes the batch thread
+    bool m_stop = false; // Tells the batch thread to exit
+    std::thread m_batch_thread;
+    #endif
+};
+
+/** JournalReader: Reads the frames of a journal, oldest first.
+ *  Each segment is memory-mapped (except in Emscripten builds, or if mapping fails, where it is
+ *  read into a buffer instead), and the frames are decoded straight from the mapped pages, so
+ *  the data is not copied before it is parsed. The blocks of compressed segments are
+ *  decompressed one at a time, and seek() only needs to decompress the block that holds the
+ *  frame it seeks to.
+ *
+ *  Decoding the args and results of the frames is the slowest part of reading a journal, so it
+ *  can be done by background threads: the segments are split into chunks of frames, which a
+ *  pool of 'decodeThreads' threads decodes ahead of the frame that next() returns, up to
+ *  'decodeThreads' chunks at a time. The frames are still returned in order. Emscripten builds
+ *  always decode on the calling thread.
+ */
+class JournalReader {
+public:
+    /** Open the journal in 'directory', starting from segment 'firstSegment' (e.g. the segment
+     *  number of a snapshot). A missing directory is treated as an empty journal. */
+    explicit JournalReader(std::string directory, uint32_t firstSegment = 0, size_t decodeThreads = 0);
+    ~JournalReader();
+    JournalReader(const JournalReader&) = delete;
+    JournalReader& operator=(const JournalReader&) = delete;
+
+    /** Read the next frame. Returns false at the end of the journal. If a segment ends with a
+     *  frame that is incomplete or corrupt (e.g. because the process crashed while writing it),
+     *  the rest of that segment is skipped and isTruncated() returns true. */
+    bool next(JournalFrame* frame);
+    bool isTruncated() const { return m_truncated; }
+    /** Skip to 'position', so that next() returns the first frame at or after it (e.g. to catch
+     *  up from the position() that was read last time, plus one frame). */
+    void seek(JournalPosition position);
+    /** The position of the frame that next() returned last */
+    JournalPosition position() const { return m_position; }
+private:
+    /** SegmentData: The contents of a segment, mapped into memory or read into a buffer. It is
+     *  shared with the decode threads, and released once they are all done with it. */
+    struct SegmentData;
+    /** Chunk: A run of consecutive frames from one segment, decoded together */
+    struct Chunk {
+        std::vector<JournalFrame> frames;
+        size_t segment = 0; // Which segment the frames are from (m_next_segment when it was loaded)
+        uint64_t first_frame = 0; // The index of the first frame within the segment
+        bool truncated = false; // Is the rest of the segment after these frames unreadable?
+    };
+    /** Load the next segment into m_segment, and set m_offset to its start. Returns false if
+     *  there are no more segments. */
+    bool loadNextSegment();
+    /** Decode the frames (or blocks of frames) between 'begin' and 'end'. This may be called
+     *  from a background thread. */
+    static Chunk decodeChunk(std::shared_ptr<const SegmentData> segment, size_t begin, size_t end,
+                             size_t segmentIndex, uint64_t firstFrame);
+    #ifndef EMSCRIPTEN
+    /** DecodeJob: A chunk that is waiting to be decoded by one of the decode threads */
+    struct DecodeJob {
+        std::shared_ptr<const SegmentData> segment;
+        size_t begin;
+        size_t end;
+        size_t segment_index;
+        uint64_t first_frame;
+        std::promise<Chunk> chunk;
+    };
+    /** Start decoding chunks until m_decode_threads chunks are in progress or the journal ends */
+    void fillPipeline();
+    /** Run by each decode thread: decode the chunks in m_jobs until m_stop is set */
+    void decodeJobs();
+    #endif
+
+    const std::string m_directory;
+    std::vector<uint32_t> m_segments; // Numbers of the segments, in order
+    size_t m_next_segment = 0; // Index into m_segments
+    std::shared_ptr<const SegmentData> m_segment; // The segment being read (or split into chunks)
+    size_t m_offset = 0; // Position of the next frame (or block, or chunk) in m_segment
+    uint64_t m_frame = 0; // Index of the frame (or of the first frame of the block or chunk) at m_offset
+    std::string m_block; // The decompressed block that next() is returning frames from
+    size_t m_block_offset = 0; // Position of the next frame in m_block
+    uint64_t m_block_frame = 0; // Index of the frame at m_block_offset
+    JournalPosition m_position {0, 0};
+    const size_t m_decode_threads;
+    Chunk m_chunk; // The decoded frames that next() is returning
+    size_t m_chunk_position = 0; // Index of the next frame in m_chunk
+    #ifndef EMSCRIPTEN
+    std::deque<std::future<Chunk>> m_pipeline; // The chunks being decoded, in order
+    std::vector<std::thread> m_decoders; // Started by the first call to fillPipeline()
+    // These are guarded by m_jobs_mutex:
+    std::deque<DecodeJob> m_jobs; // The chunks that no decode thread has started on yet, in order
+    bool m_stop = false; // Tells the decode threads to exit
+    std::mutex m_jobs_mutex;
+    std::condition_variable m_job_ready; // Wakes a decode thread
+    #endif
+    bool m_truncated = false;
+};
+
+/** JournalSnapshot: A copy of a State, saved in its journal directory so that the journal can
+ *  be replayed from the snapshot instead of from the start. See State::writeJournalSnapshot().
+ *  A snapshot file is numbered after the first journal segment that was written after it.
+ *  It contains three kinds of length-prefixed messages: the header and model (serialized
+ *  FieldMaps), then the commands of the undo/redo history (CommandData).
+ */
+struct JournalSnapshot {
+    FieldMap header; // The State's own data, e.g. the next object ID
+    FieldMap model; // The data of the State subclass, as written by State::_serializeState()
+    std::vector<CommandFrame> history; // The undo/redo history, oldest first
+};
+/** Write a snapshot file. It is written to a temporary file which is flushed to the disk and
+ *  then renamed, so that a crash can't leave an incomplete snapshot. Throws StateException if
+ *  the file cannot be written. */
+void writeSnapshotFile(const std::string& directory, uint32_t segment, const JournalSnapshot& snapshot);
+/** Read a snapshot file. Returns false if it cannot be read or is corrupt. */
+bool readSnapshotFile(const std::string& path, JournalSnapshot* snapshot);
+
+/** Get the numbers of the segment files in a journal directory, in order */
+std::vector<uint32_t> listJournalSegments(const std::string& directory);
+/** Get the numbers of the snapshot files in a journal directory, in order */
+std::vector<uint32_t> listJournalSnapshots(const std::string& directory);
+/** Get the path of a journal segment file */
+std::string journalSegmentPath(const std::string& directory, uint32_t number);
+/** Get the path of a journal snapshot file */
+std::string journalSnapshotPath(const std::string& directory, uint32_t number);
+/** Delete the segments and snapshots numbered before 'segment', once a snapshot numbered
+ *  'segment' has replaced them (see State::compactJournal()) */
+void removeJournalBefore(const std::string& directory, uint32_t segment);
+
+} // namespace Octo
@@ -0,0 +1,71 @@
+/**
+ * MapPool: Recycles the memory of the FieldMap objects used to hold command args and results.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "FieldMap.h"
+
+namespace Octo {
+
+/** MapPool: A free list of memory blocks for FieldMap objects.
+ *  Maps handed out by acquire() are created with std::allocate_shared(), so each map and its
+ *  reference count share a single block. When the last reference to a map is dropped (e.g. when
+ *  the redo queue is cleared), its block goes back to the pool to be re-used by the next map
+ *  instead of going back to the heap allocator.
+ *  The pool is kept alive by the maps it has handed out, so those may outlive its owner.
+ */
+class MapPool : public std::enable_shared_from_this<MapPool> {
+public:
+    /** Maximum number of free blocks that will be retained; any more are deleted. */
+    static constexpr size_t MaxFreeMaps = 256;
+
+    MapPool() {}
+    ~MapPool();
+    MapPool(const MapPool&) = delete;
+    MapPool& operator=(const MapPool&) = delete;
+
+    /** Get an empty map from the pool, or allocate a new one if the pool is empty. */
+    std::shared_ptr<FieldMap> acquire();
+    /** Get a copy of 'other' from the pool. The copy shares its values with 'other' (see FieldMap). */
+    std::shared_ptr<FieldMap> acquire(const FieldMap& other);
+
+    /** Number of blocks currently waiting in the pool to be re-used */
+    size_t freeCount() const;
+
+    /** global: A pool shared by the whole process, for maps that don't belong to a particular
+     *  State, e.g. the args of commands (which are created before they are run on a State). */
+    static MapPool& global();
+
+    /** emptyMap: A single, shared, immutable empty map. Used as the result of any command that
+     *  does not declare any result fields, so that such commands don't allocate anything. */
+    static const std::shared_ptr<const FieldMap>& emptyMap();
+private:
+    /** Allocator: Used with std::allocate_shared() to get blocks from the pool */
+    template<typename T>
+    struct Allocator {
+        using value_type = T;
+        std::shared_ptr<MapPool> pool;
+        explicit Allocator(std::shared_ptr<MapPool> p) : pool(std::move(p)) {}
+        template<typename U>
+        Allocator(const Allocator<U>& other) : pool(other.pool) {}
+        T* allocate(size_t n) { return static_cast<T*>(pool->allocateBlock(n * sizeof(T))); }
+        void deallocate(T* block, size_t n) { pool->releaseBlock(block, n * sizeof(T)); }
+        template<typename U>
+        bool operator==(const Allocator<U>& other) const { return pool == other.pool; }
+        template<typename U>
+        bool operator!=(const Allocator<U>& other) const { return pool != other.pool; }
+    };
+    void* allocateBlock(size_t bytes);
+    void releaseBlock(void* block, size_t bytes);
+
+    mutable std::mutex m_mutex; // The last reference to a map may be dropped on any thread
+    size_t m_block_bytes = 0; // Size of the blocks in m_free (they all hold a map and its reference count)
+    std::vector<void*> m_free;
+};
+
+} // namespace Octo
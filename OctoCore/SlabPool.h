@@ -0,0 +1,106 @@
+/**
+ * SlabPool: Allocates small objects of a single size from large slabs of memory.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace Octo {
+
+/** SlabPool: A thread-safe pool of fixed-size blocks, carved out of SlabBytes-sized slabs.
+ *  Allocating or freeing a block just takes it from or puts it back on its slab's free list,
+ *  which is much cheaper than going to the heap allocator for each object. Once every block of
+ *  a slab has been freed, the whole slab is released at once (though one slab with free blocks
+ *  is always kept, so that a pool which repeatedly grows and shrinks by a few objects doesn't
+ *  allocate and release a slab each time). So when a long run of objects that were allocated
+ *  together is freed, e.g. the values of commands trimmed from the undo history, their memory
+ *  is returned in whole slabs rather than being left fragmented.
+ *  Objects are still destroyed one by one; only their memory is managed in bulk.
+ */
+class SlabPool {
+public:
+    static constexpr size_t SlabBytes = 64 << 10;
+    static constexpr size_t Alignment = alignof(std::max_align_t);
+
+    /** Create a pool of blocks of (at least) 'blockBytes' each */
+    explicit SlabPool(size_t blockBytes);
+    /** Release every slab. All blocks must have been freed. */
+    ~SlabPool();
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* allocate();
+    void deallocate(void* block);
+
+    /** Size of each block */
+    size_t blockBytes() const { return m_block_bytes; }
+    /** Number of slabs currently allocated */
+    size_t slabCount() const;
+
+    /** shared: The pool for blocks of BlockBytes, shared by the whole process. It is never
+     *  destroyed, so its blocks can be freed at any time (even during static destruction). */
+    template<size_t BlockBytes>
+    static SlabPool& shared() {
+        static SlabPool* pool = new SlabPool(BlockBytes);
+        return *pool;
+    }
+private:
+    /** Slab: The header at the start of each slab, followed by its blocks */
+    struct Slab {
+        Slab* prev; // In m_available
+        Slab* next;
+        void* free; // Linked list of freed blocks
+        size_t used; // Number of blocks handed out
+        size_t fresh; // Number of blocks that have ever been handed out (the rest follow those)
+    };
+    static Slab* slabOf(void* block) {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(block) & ~(SlabBytes - 1));
+    }
+    char* firstBlock(Slab* slab) const { return reinterpret_cast<char*>(slab) + m_header_bytes; }
+    void link(Slab* slab);
+    void unlink(Slab* slab);
+
+    const size_t m_block_bytes;
+    const size_t m_header_bytes;
+    const size_t m_blocks_per_slab;
+    mutable std::mutex m_mutex; // Blocks may be freed on any thread
+    Slab* m_available = nullptr; // The slabs that have a block to hand out
+    size_t m_available_count = 0;
+    size_t m_slab_count = 0; // Including the slabs that are full
+};
+
+/** SlabAllocator: A standard allocator that takes single objects from the shared SlabPool for
+ *  their size, e.g. for use with std::allocate_shared(). Arrays come from the heap. */
+template<typename T>
+struct SlabAllocator {
+    using value_type = T;
+    static_assert(alignof(T) <= SlabPool::Alignment, "SlabAllocator cannot align T.");
+    static constexpr size_t BlockBytes = (sizeof(T) + SlabPool::Alignment - 1) & ~(SlabPool::Alignment - 1);
+
+    SlabAllocator() {}
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(SlabPool::shared<BlockBytes>().allocate());
+    }
+    void deallocate(T* object, size_t n) {
+        if (n != 1) {
+            ::operator delete(object);
+            return;
+        }
+        SlabPool::shared<BlockBytes>().deallocate(object);
+    }
+    template<typename U>
+    bool operator==(const SlabAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const SlabAllocator<U>&) const { return false; }
+};
+
+} // namespace Octo
@@ -1,10 +1,15 @@
 #pragma once
 #include <atomic>
-#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 #include "Command.h"
+#include "CommandHistory.h"
 #include "Exception.h"
+#include "HistorySpill.h"
+#include "Journal.h"
+#include "MapPool.h"
+#include "Status.h"
 
 namespace Octo {
 
@@ -12,6 +17,15 @@ class State {
 public:
     using SessionId = uint16_t;
     using ObjectId = int64_t;
+    /** Snapshot: A copy of a state's data, as created by _saveSnapshot(). Used for checkpoints. */
+    using Snapshot = std::shared_ptr<const void>;
+    /** BranchInfo: Describes a branch of the undo tree. See enableUndoTree(). */
+    struct BranchInfo {
+        uint64_t id;
+        uint64_t parent_id; // The branch that this one leaves, or zero if it leaves the current history
+        size_t fork_position; // The historyPosition() at which this branch leaves its parent
+        size_t length; // Number of commands in the branch
+    };
 
     /** Destructor for this state manager. */
     virtual ~State();
@@ -30,19 +44,262 @@ public:
      */
     ObjectId getNextObjectId();
 
-    /** Run a command, and optionally add it to the undo queue. */
+    /** Run a command, and optionally add it to the undo queue.
+     *  The command type is known at compile time, so this calls CommandType::forward() directly
+     *  (which allows it to be inlined) instead of going through the CommandRegistry.
+     *  Throws InapplicableCommandException or CommandWillNotApplyException if the command
+     *  cannot be run.
+     */
     template<class CommandType>
     typename CommandType::Result runCommand(const CommandType& command, bool allowUndo = true) {
-        return typename CommandType::Result {_runCommand(command, allowUndo)};
+        typename CommandType::Result result;
+        throwIfError(_runCommand(command, allowUndo, &result));
+        return result;
     }
-    /** Is there a command in the undo queue that we can undo? */
-    bool canUndo() const { return (not m_undo.empty()); }
-    /** Undo the last command */
+    /** Run a command given only its ID and arguments, and optionally add it to the undo queue.
+     *  This is slower than the templated version above, and is intended for commands whose type
+     *  is not known at compile time, e.g. commands that are being replayed or that were received
+     *  from a remote session. Returns the command's result data.
+     */
+    std::shared_ptr<const FieldMap> runCommand(CommandBase::CommandId commandId,
+                                               const std::shared_ptr<const FieldMap>& args, bool allowUndo = true);
+    /** Run a command on behalf of another session, e.g. one received from a remote client.
+     *  The command is recorded as belonging to 'sessionId', so that undoSession(sessionId) can
+     *  undo it. */
+    std::shared_ptr<const FieldMap> runCommand(CommandBase::CommandId commandId,
+                                               const std::shared_ptr<const FieldMap>& args, bool allowUndo,
+                                               SessionId sessionId);
+    /** Undo the last command, if any */
     void undo();
-    /** Is there a command in the redo queue that we can replay? */
-    bool canRedo() const { return (not m_redo.empty()); }
-    /** Redo the last command */
+    /** Redo the last undone command, if any */
     void redo();
+    /** Undo/redo commands until historyPosition() == position. If checkpoints are enabled, this
+     *  may instead restore the nearest checkpoint and redo the commands between it and 'position'.
+     *  Throws StateException if 'position' cannot be reached. */
+    void undoTo(size_t position);
+    void redoTo(size_t position);
+    /** Undo the most recent command run by the given session, leaving the commands that other
+     *  sessions have run since then in place. This is only possible if none of those commands
+     *  affect the same objects (see Command::affectedObjects()); otherwise this throws
+     *  CommandWillNotApplyException. If the command is the last one in the history, this is
+     *  the same as undo(). Otherwise, it is removed from the history, and the redo queue is
+     *  cleared as if a new command had been run. */
+    void undoSession(SessionId sessionId);
+    /** Switch to another branch of the undo tree: undo commands back to the point where the
+     *  branch leaves the current history, then redo the branch's commands. The commands that
+     *  were undone become a new branch. Throws StateException if there is no such branch. */
+    void switchBranch(uint64_t branchId);
+
+    /** Non-throwing versions of the above, for builds without exception support and for code
+     *  where rejected commands are common (rejecting a command via ResultBase::willNotApply()
+     *  is much cheaper than throwing an exception). See Status.h for the possible error codes.
+     *  Exceptions thrown by the command itself are not caught.
+     */
+    template<class CommandType>
+    StatusOr<typename CommandType::Result> tryRunCommand(const CommandType& command, bool allowUndo = true) {
+        typename CommandType::Result result;
+        Status status = _runCommand(command, allowUndo, &result);
+        if (not status.ok()) {
+            return status;
+        }
+        return result;
+    }
+    StatusOr<std::shared_ptr<const FieldMap>> tryRunCommand(CommandBase::CommandId commandId,
+                                                            const std::shared_ptr<const FieldMap>& args,
+                                                            bool allowUndo = true);
+    StatusOr<std::shared_ptr<const FieldMap>> tryRunCommand(CommandBase::CommandId commandId,
+                                                            const std::shared_ptr<const FieldMap>& args,
+                                                            bool allowUndo, SessionId sessionId);
+    /** Undo the last command. Returns an OUT_OF_RANGE status if there is nothing to undo. */
+    Status tryUndo();
+    /** Redo the last undone command. Returns an OUT_OF_RANGE status if there is nothing to redo. */
+    Status tryRedo();
+    /** Returns an OUT_OF_RANGE status if 'position' cannot be reached. */
+    Status tryUndoTo(size_t position);
+    Status tryRedoTo(size_t position);
+    /** Returns an OUT_OF_RANGE status if the session has no command in memory that can be undone,
+     *  or a FAILED_PRECONDITION status if a later command affects the same objects. */
+    Status tryUndoSession(SessionId sessionId);
+    /** Returns a NOT_FOUND status if there is no such branch */
+    Status trySwitchBranch(uint64_t branchId);
+    /** Returns the status of the first command in the journal that could not be run */
+    Status tryReplayJournal(const std::string& directory, size_t decodeThreads = 0);
+
+    /** Transaction: Runs a batch of commands as a single, atomic undo step.
+     *  Get one from beginTransaction(), run() commands with it, then commit(). If a command
+     *  cannot be run, or the Transaction is destroyed without being committed (e.g. because a
+     *  command threw an exception), the commands it already ran are undone in reverse order,
+     *  leaving the state as it was.
+     *  Once committed, the batch is stored as a single compound command, with the ID
+     *  CommandBase::CompoundCommandId (see CommandCodec.h for its format). Compound commands
+     *  can be run with runCommand(commandId, args), e.g. to submit a batch from a remote session,
+     *  and are likewise applied atomically. A committed transaction is never merged with the
+     *  commands before or after it, even if it consists of a single command.
+     *  Don't run commands directly on the state while a transaction is in progress.
+     */
+    class Transaction {
+    public:
+        Transaction(Transaction&& other) : m_state(other.m_state), m_commands(std::move(other.m_commands)) {
+            other.m_state = nullptr;
+        }
+        ~Transaction() { rollback(); }
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        /** Run a command as part of this transaction. If the command cannot be run, the
+         *  transaction is rolled back and an exception is thrown. */
+        template<class CommandType>
+        typename CommandType::Result run(const CommandType& command) {
+            typename CommandType::Result result;
+            throwIfError(_run(command, &result));
+            return result;
+        }
+        /** Non-throwing version of run() */
+        template<class CommandType>
+        StatusOr<typename CommandType::Result> tryRun(const CommandType& command) {
+            typename CommandType::Result result;
+            Status status = _run(command, &result);
+            if (not status.ok()) {
+                return status;
+            }
+            return result;
+        }
+        /** Add the commands that have been run to the undo queue as a single undo step */
+        void commit();
+        /** Undo the commands that have been run. Does nothing if the transaction is finished.
+         *  Returns an error if a command could not be undone, leaving the state inconsistent.
+         *  (The destructor cannot report this, so call rollback() to find out.) */
+        Status rollback();
+        /** Has the transaction been committed or rolled back? */
+        bool isFinished() const { return m_state == nullptr; }
+    private:
+        friend class State;
+        explicit Transaction(State* state) : m_state(state) {}
+        template<class CommandType>
+        Status _run(const CommandType& command, typename CommandType::Result* result) {
+            if (m_state == nullptr) {
+                return Status(StatusCode::FAILED_PRECONDITION, "The transaction has already finished.");
+            }
+            Status status;
+            {
+                JournalPause pause(m_state); // The whole transaction is journaled by commit()
+                status = m_state->_runCommand(command, false, result);
+            }
+            if (not status.ok()) {
+                Status rollback_status = rollback();
+                return rollback_status.ok() ? status : rollback_status;
+            }
+            m_commands.push_back(CommandFrame { CommandType::commandId(), command.args(), result->sharedData() });
+            return status;
+        }
+        State* m_state; // nullptr once finished
+        std::vector<CommandFrame> m_commands;
+    };
+    /** Start a transaction. See Transaction. */
+    Transaction beginTransaction() { return Transaction(this); }
+
+    /** Is there a command in the undo queue that we can undo? */
+    bool canUndo() const { return m_history.undoCount() > 0 or (m_spill and m_spill->commandCount() > 0); }
+    /** Is there a command in the redo queue that we can replay? */
+    bool canRedo() const { return m_history.redoCount() > 0; }
+    /** The number of commands that have been recorded in the undo history and are currently
+     *  applied, including any that have since been dropped due to setHistoryLimits().
+     *  Undoing a command decreases it by one, and redoing or running a command increases it. */
+    size_t historyPosition() const {
+        return m_history_base + m_history.undoCount() + (m_spill ? m_spill->commandCount() : 0);
+    }
+    /** Don't merge the next command into the last one, even if it implements merge(). Use this
+     *  to end an undo step, e.g. when the user moves the cursor between typing two words. */
+    void stopMerging();
+
+    /** Limit the memory used by the undo/redo history. Once a limit is exceeded, the oldest
+     *  commands are dropped from the history (so they can no longer be undone) until it fits.
+     *  The most recent command is always kept. A limit of zero means no limit (the default).
+     *  If enableHistorySpill() has been called, commands that exceed maxBytes are moved to the
+     *  spill file instead of being dropped.
+     *  maxBytes: Limit on historyFootprint()
+     *  maxRecords: Limit on historyLength()
+     */
+    void setHistoryLimits(size_t maxBytes, size_t maxRecords = 0);
+    /** Approximate memory used by the undo/redo history: the serialized size of the args and
+     *  result data of every command in it (not counting commands in the spill file).
+     *  This is only kept up to date while a byte limit is set; otherwise each call computes it. */
+    size_t historyFootprint() const { return m_history.bytes(); }
+    /** Number of commands in the undo/redo history (including commands in the spill file) */
+    size_t historyLength() const {
+        return m_history.size() + (m_spill ? m_spill->commandCount() : 0);
+    }
+    /** Keep only the most recent 'hotRecords' commands of the undo history in memory. Older
+     *  commands are moved to a file at 'path' in blocks of 'recordsPerBlock', and read back
+     *  when undo() reaches them. Throws StateException if the file cannot be created.
+     */
+    void enableHistorySpill(std::string path, size_t hotRecords = 1024, size_t recordsPerBlock = 256);
+    /** Save a checkpoint (using _saveSnapshot()) every 'interval' commands, keeping at most
+     *  'maxCheckpoints' of the most recent ones. undoTo() and redoTo() use checkpoints to make
+     *  long jumps through the history without running every command in between.
+     *  Commands run with allowUndo = false are not part of the history, so restoring a
+     *  checkpoint may revert them. An interval of zero disables checkpoints.
+     */
+    void enableCheckpoints(size_t interval, size_t maxCheckpoints = 16);
+
+    /** Keep undone commands when a new command is run, instead of discarding them. They become
+     *  a branch of the undo tree, which switchBranch() can return to. At most 'maxBranches'
+     *  branches are kept; the oldest are discarded first. Branches are not counted by
+     *  historyLength() or historyFootprint().
+     */
+    void enableUndoTree(size_t maxBranches = 64);
+    /** The branches of the undo tree, oldest first */
+    std::vector<BranchInfo> branches() const;
+    /** Append every command that is run, and every undo and redo, to a journal in 'directory'
+     *  (see JournalWriter). Together with replayJournal(), this allows the state and its undo
+     *  history to be rebuilt after the process exits, e.g. to recover from a crash. The new
+     *  entries go in a new segment file, after any that are already in the directory, so to
+     *  continue a journal, call replayJournal() first and then enableJournal() on the same
+     *  directory. Throws StateException if the directory cannot be created.
+     *  'durability' sets when the entries are flushed to the disk (see JournalDurability). With
+     *  Batched durability, 'batchMicroseconds' and 'batchBytes' set the batch window.
+     *  If 'compressedBlockBytes' is not zero, the journal is compressed in blocks of about that
+     *  size, which usually makes it several times smaller and quicker to replay.
+     */
+    void enableJournal(std::string directory, JournalDurability durability = JournalDurability::None,
+                       uint32_t batchMicroseconds = 2000, size_t batchBytes = 1 << 20,
+                       size_t compressedBlockBytes = 0);
+    /** Flush every journal entry written so far to the disk, whatever the durability */
+    void syncJournal();
+    /** Rebuild the state by running the commands and undo/redo steps recorded in the journal in
+     *  'directory', which should be called on a newly constructed state. The recorded results of
+     *  the commands are re-used (as when redoing a command), so new object IDs are not generated.
+     *  Configure the state first (e.g. with setHistoryLimits() and enableUndoTree()) in the same
+     *  way as when the journal was written, so that the undo history is rebuilt the same way.
+     *  If the directory contains snapshots (see writeJournalSnapshot()), the most recent one is
+     *  loaded, and only the part of the journal written after it is replayed.
+     *  With 'decodeThreads' > 0, that many background threads decode the journal ahead of the
+     *  commands being run (see JournalReader); the commands are still run in order, on this thread.
+     *  Throws an exception if a command in the journal cannot be run.
+     */
+    void replayJournal(const std::string& directory, size_t decodeThreads = 0);
+    /** Save a snapshot of the state (using _serializeState()) in the journal directory, so that
+     *  replayJournal() can start from it instead of replaying the whole journal. The snapshot
+     *  includes the undo/redo history that is in memory, but not branches of the undo tree,
+     *  checkpoints or commands in the history spill file. Throws StateException if the journal
+     *  is not enabled, the state can't be serialized, or the snapshot can't be written.
+     */
+    void writeJournalSnapshot();
+    /** Compact the journal while it is being written: save a snapshot (see
+     *  writeJournalSnapshot()), then delete the segments and older snapshots that it replaces.
+     *  Afterwards the journal holds just the live state and its undo/redo history, as limited by
+     *  setHistoryLimits(), so replaying it takes time in proportion to the size of the state
+     *  rather than to the number of edits ever made. Commands that were undone and then
+     *  discarded by a new command, and the other branches of the undo tree, are dropped.
+     *  Throws StateException as writeJournalSnapshot() does.
+     */
+    void compactJournal();
+    /** Compact a journal that is not being written (e.g. offline, or before continuing it):
+     *  replay it into this state, which should be new and configured like the state that wrote
+     *  it (see replayJournal()), then replace it with a snapshot as compactJournal() does.
+     *  Throws an exception if the journal cannot be replayed or the snapshot cannot be written.
+     */
+    void compactJournal(const std::string& directory);
 
 protected:
     /** Construct a state manager.
@@ -61,32 +318,186 @@ protected:
      *  If you include OCTO_STATE_DEFAULTS in your class declaration this is implemented for you.
      */
     virtual CommandRegistry* _getCommandRegistry() const;
+    /** Copy this state's data, for use as a checkpoint. Override this along with
+     *  _restoreSnapshot() to make enableCheckpoints() work. The default returns nullptr,
+     *  meaning that snapshots are not supported. */
+    virtual Snapshot _saveSnapshot() const;
+    /** Replace this state's data with a copy saved by _saveSnapshot() */
+    virtual void _restoreSnapshot(const Snapshot& snapshot);
+    /** Write this state's data into 'data', for a snapshot file. Override this along with
+     *  _deserializeState() to make writeJournalSnapshot() work. The default returns false,
+     *  meaning that serialization is not supported. */
+    virtual bool _serializeState(FieldMap* data) const;
+    /** Replace this state's data with the data written by _serializeState() */
+    virtual void _deserializeState(const FieldMap& data);
     
 private:
-    /** Run a command, and optionally add it to the undo queue. */
-    std::shared_ptr<const Map> _runCommand(const CommandBase& command, bool allowUndo);
+    /** JournalPause: Stops operations from being journaled while it exists, e.g. because they
+     *  are part of a larger operation that will be journaled as a whole */
+    struct JournalPause {
+        explicit JournalPause(State* state) : m_state(state) { m_state->m_journal_depth++; }
+        ~JournalPause() { m_state->m_journal_depth--; }
+        State* m_state;
+    };
+    /** Convert a State pointer in order to run a CommandType on it, like acceptStatePtr(), but
+     *  also return nullptr if the command is not registered for use with the state. Both depend
+     *  only on the concrete type of the state (commands are registered during static
+     *  initialization), so they are checked once per type rather than on every call. */
+    template<class CommandType>
+    static typename CommandType::State* _acceptCommand(State* state) {
+        static StatePtrCache<typename CommandType::State> cache;
+        return cache.cast(state, [](State* s) {
+            return s->_getCommandRegistry()->getCommand(CommandType::commandId()) != nullptr;
+        });
+    }
+    /** Run a command of a type known at compile time, storing its result in 'resultOut' */
+    template<class CommandType>
+    Status _runCommand(const CommandType& command, bool allowUndo, typename CommandType::Result* resultOut) {
+        typename CommandType::State* typed_state = _acceptCommand<CommandType>(this);
+        if (typed_state == nullptr) {
+            // Either this state is the wrong type, or the command is not registered for use with it
+            return inapplicableCommandStatus();
+        }
+        if (not CommandType::Result::has_fields) {
+            // Commands without result fields all share the same (immutable) empty result
+            *resultOut = typename CommandType::Result {MapPool::emptyMap()};
+            command.forward(typed_state, *resultOut);
+            if (resultOut->isRejected()) {
+                return resultOut->commandStatus();
+            }
+            if (allowUndo) {
+                _recordCommand(CommandType::commandId(), command.args(), MapPool::emptyMap(), m_session_id);
+            } else if (m_journal) {
+                _journalCommand(JournalOp::Apply, CommandType::commandId(), command.args(), MapPool::emptyMap(),
+                                m_session_id);
+            }
+            return Status();
+        }
+        auto result = _newResultMap();
+        typename CommandType::Result mutable_result {result, true};
+        command.forward(typed_state, mutable_result);
+        if (mutable_result.isRejected()) {
+            return mutable_result.commandStatus();
+        }
+        if (allowUndo) {
+            _recordCommand(CommandType::commandId(), command.args(), result, m_session_id);
+        } else if (m_journal) {
+            _journalCommand(JournalOp::Apply, CommandType::commandId(), command.args(), result, m_session_id);
+        }
+        *resultOut = typename CommandType::Result {std::shared_ptr<const FieldMap>(std::move(result))};
+        return Status();
+    }
+    /** Run an operation, then append it to the journal if it changed the state. The position
+     *  of undoTo()/redoTo() is journaled as the position that was actually reached. */
+    template<class Operation>
+    Status _journaled(JournalOp op, uint64_t value, SessionId sessionId, Operation operation) {
+        if (not m_journal or m_journal_depth > 0) {
+            return operation();
+        }
+        const size_t position = historyPosition();
+        Status status;
+        {
+            JournalPause pause(this);
+            status = operation();
+        }
+        if (status.ok() or historyPosition() != position) {
+            if (op == JournalOp::UndoTo or op == JournalOp::RedoTo) {
+                value = historyPosition();
+            }
+            m_journal->append(JournalFrame { op, CommandFrame { 0, nullptr, nullptr, sessionId }, value });
+        }
+        return status;
+    }
+    /** Append a command that has just been run to the journal, unless journaling is paused */
+    void _journalCommand(JournalOp op, CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                         const std::shared_ptr<const FieldMap>& result, SessionId sessionId);
+    /** Copy the state and its undo history into a JournalSnapshot. Throws StateException if
+     *  _serializeState() is not implemented. */
+    JournalSnapshot _saveJournalSnapshot() const;
+    /** Replace the state and its undo history with a snapshot read from a journal directory */
+    void _loadJournalSnapshot(const JournalSnapshot& snapshot);
+    /** Implementations of the public undo/redo methods, without journaling */
+    Status _undo();
+    Status _redo();
+    Status _undoTo(size_t position);
+    Status _redoTo(size_t position);
+    Status _undoSession(SessionId sessionId);
+    Status _switchBranch(uint64_t branchId);
+    /** Run/undo a command of any type, including compound commands. Used by the type-erased API.
+     *  For a compound command, 'children' may give its unencoded children (see CommandFrame). */
+    Status _forward(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                    const std::shared_ptr<FieldMap>& result, bool mutableResult,
+                    const std::vector<CommandFrame>* children = nullptr);
+    Status _backward(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                     const std::shared_ptr<const FieldMap>& result,
+                     const std::vector<CommandFrame>* children = nullptr);
+    /** Run the children of a compound command. If 'mutableResult' is set, they get new results,
+     *  which are encoded into 'result'. */
+    Status _forwardCompound(std::vector<CommandFrame>* children, const std::shared_ptr<FieldMap>& result,
+                            bool mutableResult);
+    /** Run the given commands in order. If one fails, the ones before it are undone again.
+     *  If 'newResults' is set, each command gets a new result map; otherwise the results that
+     *  are already in 'commands' are used. */
+    Status _forwardAll(std::vector<CommandFrame>* commands, bool newResults);
+    /** Undo the given commands, in reverse order */
+    Status _backwardAll(const std::vector<CommandFrame>& commands);
+    /** Get a command in the history as a CommandFrame, with its children (if any) encoded */
+    CommandFrame _encodedRecord(size_t index) const;
+    /** Get an empty map to hold the result of a command, re-using recycled memory if possible. */
+    std::shared_ptr<FieldMap> _newResultMap();
+    /** Find the checkpoint closest to (and not after) 'position' whose commands are all in memory */
+    std::map<size_t, Snapshot>::const_iterator _findCheckpoint(size_t position) const;
+    /** Restore a checkpoint, then redo commands until historyPosition() == position */
+    Status _jumpFromCheckpoint(std::map<size_t, Snapshot>::const_iterator checkpoint, size_t position);
+    /** Remove the commands after the cursor from the history, keeping them as a new branch if
+     *  the undo tree is enabled */
+    void _detachRedo();
+    /** Discard the branches that leave the history before its oldest command or after
+     *  'maxForkPosition' (along with their sub-branches), and the oldest ones if there are too many */
+    void _pruneBranches(size_t maxForkPosition);
+    /** Append the IDs of the objects that a command affects. Returns false if it doesn't say. */
+    bool _affectedObjects(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                          const std::shared_ptr<const FieldMap>& result, std::vector<ObjectId>* objects,
+                          const std::vector<CommandFrame>* children = nullptr);
+    /** Add a command that has just been run (by the given session) to the undo queue. */
+    void _recordCommand(CommandBase::CommandId commandId, std::shared_ptr<const FieldMap> args,
+                        std::shared_ptr<const FieldMap> result, SessionId sessionId,
+                        std::shared_ptr<const std::vector<CommandFrame>> children = nullptr);
+    /** Drop (or spill) the oldest commands from the history until it is within the limits set by
+     *  setHistoryLimits() and enableHistorySpill() */
+    void _enforceHistoryLimits();
+    /** Drop the oldest command from the history, or if there are no commands to undo, the one
+     *  that is furthest from being redone */
+    void _dropOldestRecord();
+    /** Move the oldest 'count' commands of the undo queue to the spill file */
+    void _spillOldestRecords(size_t count);
 
     // Data:
 protected:
     const SessionId m_session_id;
 
 private:
-    struct CommandRecord {
-        const int32_t command_id;
-        const std::shared_ptr<const Map> args;
-        const std::shared_ptr<const Map> result;
-
-        CommandRecord(int32_t commandId, std::shared_ptr<const Map> args, std::shared_ptr<const Map> result):
-            command_id(commandId), args(args), result(result) {}
-        CommandRecord() : command_id(0), args(nullptr), result(nullptr) {}
-        // Disable copying but allow moves:
-        CommandRecord(const CommandRecord&) = delete;
-        CommandRecord& operator=(const CommandRecord&) = delete;
-        CommandRecord(CommandRecord&&) = default;
-        CommandRecord& operator=(CommandRecord&&) = default;
+    CommandHistory m_history; // The undo/redo history (except for any commands in m_spill)
+    bool m_allow_merge = true; // Can the next command be merged into the top of the undo queue?
+    size_t m_history_max_bytes = 0;
+    size_t m_history_max_records = 0;
+    std::unique_ptr<HistorySpill> m_spill; // Holds the oldest part of the undo queue, if enabled
+    size_t m_spill_hot_records = 0;
+    size_t m_spill_block_records = 0;
+    size_t m_history_base = 0; // Number of commands dropped from the start of the history (see historyPosition())
+    std::map<size_t, Snapshot> m_checkpoints; // Keyed by historyPosition()
+    size_t m_checkpoint_interval = 0;
+    size_t m_checkpoint_max = 0;
+    struct Branch {
+        BranchInfo info;
+        std::vector<CommandFrame> commands; // Oldest first
     };
-    std::deque<CommandRecord> m_undo;
-    std::deque<CommandRecord> m_redo;
+    std::vector<Branch> m_branches; // Ordered by ID, i.e. oldest first
+    uint64_t m_next_branch_id = 1;
+    size_t m_max_branches = 0; // Zero if the undo tree is disabled
+    std::unique_ptr<JournalWriter> m_journal; // If enabled
+    int m_journal_depth = 0; // Journaling is paused while this is non-zero (see JournalPause)
+    std::shared_ptr<MapPool> m_result_pool; // Created on first use
     #ifdef EMSCRIPTEN
     ObjectId m_next_object_id; // 64-bit atomics don't work properly in Emscripten :-/
     # else
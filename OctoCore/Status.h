@@ -0,0 +1,52 @@
+/**
+ * Status: Error reporting for the non-throwing API of OctoCore
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <google/protobuf/stubs/status.h>
+#include <google/protobuf/stubs/statusor.h>
+
+#include "Exception.h"
+
+namespace Octo {
+
+/** Status: The result of an operation that can fail, like State::tryRunCommand().
+ *  This is protobuf's util::Status. The error codes used by OctoCore are:
+ *   * INVALID_ARGUMENT: The command is not compatible with that State (InapplicableCommandException)
+ *   * FAILED_PRECONDITION: The command will not apply to the current state, e.g. because of a
+ *     conflict. The error message gives the reason. (CommandWillNotApplyException)
+ *   * OUT_OF_RANGE: There is no command to undo/redo
+ */
+using Status = google::protobuf::util::Status;
+/** StatusOr<T>: Either a T, or a non-OK Status */
+template<typename T>
+using StatusOr = google::protobuf::util::StatusOr<T>;
+namespace StatusCode = google::protobuf::util::error;
+
+inline Status inapplicableCommandStatus() {
+    return Status(StatusCode::INVALID_ARGUMENT, "That Octo::Command is not compatible with that Octo::State.");
+}
+
+/** throwIfError: Convert a non-OK Status into the equivalent exception */
+inline void throwIfError(const Status& status) {
+    switch (status.error_code()) {
+    case StatusCode::OK:
+        return;
+    case StatusCode::INVALID_ARGUMENT:
+        OCTO_THROW(InapplicableCommandException());
+    case StatusCode::FAILED_PRECONDITION:
+        OCTO_THROW(CommandWillNotApplyException(status.error_message().ToString()));
+    default:
+        OCTO_THROW(StateException(status.error_message().ToString()));
+    }
+}
+
+/** valueOrThrow: Get the value from a StatusOr<T>, or throw the equivalent exception */
+template<typename T>
+T valueOrThrow(const StatusOr<T>& statusOr) {
+    throwIfError(statusOr.status());
+    return statusOr.ValueOrDie();
+}
+
+} // namespace Octo
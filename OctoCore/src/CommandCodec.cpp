@@ -0,0 +1,180 @@
+#include "CommandCodec.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+using namespace Octo;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+    // Tags of the fields of the CommandData message:
+    const uint32_t COMMAND_ID_TAG = WireFormatLite::MakeTag(1, WireFormatLite::WIRETYPE_VARINT);
+    const uint32_t ARGS_TAG = WireFormatLite::MakeTag(2, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    const uint32_t RESULT_TAG = WireFormatLite::MakeTag(3, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    const uint32_t SESSION_ID_TAG = WireFormatLite::MakeTag(4, WireFormatLite::WIRETYPE_VARINT);
+    const uint32_t JOURNAL_OP_TAG = WireFormatLite::MakeTag(5, WireFormatLite::WIRETYPE_VARINT);
+    const uint32_t JOURNAL_VALUE_TAG = WireFormatLite::MakeTag(6, WireFormatLite::WIRETYPE_VARINT);
+
+    inline size_t lengthDelimitedSize(size_t size) {
+        return 1 + CodedOutputStream::VarintSize32(static_cast<uint32_t>(size)) + size;
+    }
+
+    bool readMap(CodedInputStream* input, std::shared_ptr<const FieldMap>* map) {
+        uint32_t length;
+        if (not input->ReadVarint32(&length)) {
+            return false;
+        }
+        auto new_map = MapPool::global().acquire();
+        const CodedInputStream::Limit limit = input->PushLimit(static_cast<int>(length));
+        if (not new_map->mergeFrom(input)) {
+            return false;
+        }
+        input->PopLimit(limit);
+        *map = std::move(new_map);
+        return true;
+    }
+}
+
+size_t Octo::commandDataSize(int32_t commandId, const FieldMap& args, const FieldMap& result, uint16_t sessionId) {
+    return 1 + CodedOutputStream::VarintSize32SignExtended(commandId) +
+        lengthDelimitedSize(args.byteSize()) + lengthDelimitedSize(result.byteSize()) +
+        (sessionId ? 1 + CodedOutputStream::VarintSize32(sessionId) : 0);
+}
+
+void Octo::writeCommandData(CodedOutputStream* output, int32_t commandId, const FieldMap& args,
+                            const FieldMap& result, uint16_t sessionId) {
+    output->WriteTag(COMMAND_ID_TAG);
+    output->WriteVarint32SignExtended(commandId);
+    output->WriteTag(ARGS_TAG);
+    output->WriteVarint32(static_cast<uint32_t>(args.byteSize()));
+    args.serialize(output);
+    output->WriteTag(RESULT_TAG);
+    output->WriteVarint32(static_cast<uint32_t>(result.byteSize()));
+    result.serialize(output);
+    if (sessionId) {
+        output->WriteTag(SESSION_ID_TAG);
+        output->WriteVarint32(sessionId);
+    }
+}
+
+size_t Octo::journalFieldsSize(const JournalFields& fields) {
+    return (fields.op ? 1 + CodedOutputStream::VarintSize32(fields.op) : 0) +
+        (fields.value ? 1 + CodedOutputStream::VarintSize64(fields.value) : 0);
+}
+
+void Octo::writeJournalFields(CodedOutputStream* output, const JournalFields& fields) {
+    if (fields.op) {
+        output->WriteTag(JOURNAL_OP_TAG);
+        output->WriteVarint32(fields.op);
+    }
+    if (fields.value) {
+        output->WriteTag(JOURNAL_VALUE_TAG);
+        output->WriteVarint64(fields.value);
+    }
+}
+
+bool Octo::readCommandData(CodedInputStream* input, CommandFrame* frame, JournalFields* journal) {
+    frame->command_id = 0;
+    frame->args = MapPool::emptyMap();
+    frame->result = MapPool::emptyMap();
+    frame->session_id = 0;
+    if (journal) {
+        *journal = JournalFields {};
+    }
+    while (uint32_t tag = input->ReadTag()) {
+        if (tag == COMMAND_ID_TAG) {
+            uint32_t command_id;
+            if (not input->ReadVarint32(&command_id)) {
+                return false;
+            }
+            frame->command_id = static_cast<int32_t>(command_id);
+        } else if (tag == ARGS_TAG) {
+            if (not readMap(input, &frame->args)) {
+                return false;
+            }
+        } else if (tag == RESULT_TAG) {
+            if (not readMap(input, &frame->result)) {
+                return false;
+            }
+        } else if (tag == SESSION_ID_TAG) {
+            uint32_t session_id;
+            if (not input->ReadVarint32(&session_id)) {
+                return false;
+            }
+            frame->session_id = static_cast<uint16_t>(session_id);
+        } else if (journal and tag == JOURNAL_OP_TAG) {
+            if (not input->ReadVarint32(&journal->op)) {
+                return false;
+            }
+        } else if (journal and tag == JOURNAL_VALUE_TAG) {
+            if (not input->ReadVarint64(&journal->value)) {
+                return false;
+            }
+        } else if (not WireFormatLite::SkipField(input, tag)) {
+            return false;
+        }
+    }
+    return input->ConsumedEntireMessage();
+}
+
+void Octo::encodeCompoundCommand(const std::vector<CommandFrame>& children, FieldMap* args, FieldMap* result) {
+    IntList& ids = *(*args)[compound_command_ids_field_id].mutable_int_list()->mutable_entries();
+    List& child_args = *(*args)[compound_command_args_field_id].mutable_list()->mutable_entries();
+    List& child_results = *(*result)[compound_command_results_field_id].mutable_list()->mutable_entries();
+    ids.Reserve(static_cast<int>(children.size()));
+    child_args.Reserve(static_cast<int>(children.size()));
+    child_results.Reserve(static_cast<int>(children.size()));
+    for (const CommandFrame& child : children) {
+        if (child.children) {
+            CommandFrame encoded = child;
+            encodeChildren(&encoded);
+            ids.Add(encoded.command_id);
+            encoded.args->copyTo(child_args.Add()->mutable_map());
+            encoded.result->copyTo(child_results.Add()->mutable_map());
+            continue;
+        }
+        ids.Add(child.command_id);
+        child.args->copyTo(child_args.Add()->mutable_map());
+        child.result->copyTo(child_results.Add()->mutable_map());
+    }
+}
+
+void Octo::encodeChildren(CommandFrame* frame) {
+    if (not frame->children) {
+        return;
+    }
+    auto args = std::make_shared<FieldMap>();
+    auto result = std::make_shared<FieldMap>();
+    encodeCompoundCommand(*frame->children, args.get(), result.get());
+    frame->args = std::move(args);
+    frame->result = std::move(result);
+    frame->children.reset();
+}
+
+bool Octo::decodeCompoundCommand(const FieldMap& args, const FieldMap& result, std::vector<CommandFrame>* children) {
+    auto ids = args.find(compound_command_ids_field_id);
+    auto child_args = args.find(compound_command_args_field_id);
+    auto child_results = result.find(compound_command_results_field_id);
+    if (ids == args.end() or child_args == args.end() or
+        ids->second.int_list().entries_size() != child_args->second.list().entries_size()) {
+        return false;
+    }
+    const int count = ids->second.int_list().entries_size();
+    const bool has_results = (child_results != result.end());
+    if (has_results and child_results->second.list().entries_size() != count) {
+        return false;
+    }
+    children->clear();
+    children->reserve(count);
+    for (int i = 0; i < count; i++) {
+        CommandFrame child { static_cast<int32_t>(ids->second.int_list().entries(i)), nullptr, MapPool::emptyMap() };
+        child.args = std::make_shared<FieldMap>(child_args->second.list().entries(i).map().entries());
+        if (has_results and child_results->second.list().entries(i).map().entries_size() > 0) {
+            child.result = std::make_shared<FieldMap>(child_results->second.list().entries(i).map().entries());
+        }
+        children->push_back(std::move(child));
+    }
+    return true;
+}
@@ -0,0 +1,63 @@
+#include "OctoCore/CommandCodec.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::CommandFrame;
+using Octo::FieldMap;
+using Octo::wrap;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+namespace testing {
+
+    TEST(CommandCodecTest, test_command_data_compatibility) {
+        FieldMap args, result;
+        args[1] = wrap("an argument");
+        args[2] = wrap(int64_t {-5});
+        result[3] = wrap(true);
+
+        std::string data;
+        {
+            google::protobuf::io::StringOutputStream string_stream(&data);
+            CodedOutputStream output(&string_stream);
+            Octo::writeCommandData(&output, -42, args, result);
+        }
+        EXPECT_EQ(data.size(), Octo::commandDataSize(-42, args, result));
+
+        // The output can be parsed as a CommandData message:
+        Octo::CommandData message;
+        ASSERT_TRUE(message.ParseFromString(data));
+        EXPECT_EQ(message.command_id(), -42);
+        EXPECT_EQ(message.args().entries().at(1).string(), "an argument");
+        EXPECT_EQ(message.result().entries().at(3).boolean(), true);
+
+        // ... and a CommandData message can be read:
+        message.mutable_args()->mutable_entries()->erase(2);
+        const std::string message_data = message.SerializeAsString();
+        CodedInputStream input(reinterpret_cast<const uint8_t*>(message_data.data()), message_data.size());
+        CommandFrame frame;
+        ASSERT_TRUE(Octo::readCommandData(&input, &frame));
+        EXPECT_EQ(frame.command_id, -42);
+        EXPECT_EQ(frame.args->size(), 1);
+        EXPECT_EQ(frame.args->at(1).string(), "an argument");
+        EXPECT_EQ(frame.result->at(3).boolean(), true);
+        EXPECT_EQ(frame.session_id, 0);
+
+        // The session ID is stored in an extra field, which CommandData ignores:
+        data.clear();
+        {
+            google::protobuf::io::StringOutputStream string_stream(&data);
+            CodedOutputStream output(&string_stream);
+            Octo::writeCommandData(&output, 7, args, result, 300);
+        }
+        EXPECT_EQ(data.size(), Octo::commandDataSize(7, args, result, 300));
+        ASSERT_TRUE(message.ParseFromString(data));
+        EXPECT_EQ(message.command_id(), 7);
+        CodedInputStream input2(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+        ASSERT_TRUE(Octo::readCommandData(&input2, &frame));
+        EXPECT_EQ(frame.session_id, 300);
+    }
+}
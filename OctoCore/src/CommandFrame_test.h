@@ -0,0 +1,30 @@
+/**
+ * Helpers for tests that store sequences of command frames.
+ *
+ * Part of OctoCore by Braden MacDonald
+ */
+#pragma once
+#include <vector>
+
+#include "OctoCore/CommandCodec.h"
+#include "OctoCore/MapPool.h"
+
+namespace testing {
+
+/** testCommand: A command with a single arg, field 1, which is ten times its ID, and an empty result */
+inline Octo::CommandFrame testCommand(int32_t id, uint16_t sessionId = 0) {
+    auto args = std::make_shared<Octo::FieldMap>();
+    (*args)[1] = Octo::wrap(static_cast<int64_t>(id) * 10);
+    return Octo::CommandFrame { id, args, Octo::MapPool::emptyMap(), sessionId };
+}
+
+/** testCommands: 'count' test commands with consecutive IDs starting at 'firstId' */
+inline std::vector<Octo::CommandFrame> testCommands(int32_t firstId, int count, uint16_t sessionId = 0) {
+    std::vector<Octo::CommandFrame> commands;
+    for (int32_t id = firstId; id < firstId + count; id++) {
+        commands.push_back(testCommand(id, sessionId));
+    }
+    return commands;
+}
+
+} // namespace testing
@@ -0,0 +1,177 @@
+#include "CommandHistory.h"
+
+#include <algorithm>
+
+using namespace Octo;
+
+namespace {
+    /** The serialized size of a command's args and result, or of its children's */
+    size_t footprintOf(const std::shared_ptr<const FieldMap>& args, const std::shared_ptr<const FieldMap>& result,
+                       const std::vector<CommandFrame>* children) {
+        if (children == nullptr) {
+            return args->byteSize() + result->byteSize();
+        }
+        size_t total = 0;
+        for (const CommandFrame& child : *children) {
+            total += footprintOf(child.args, child.result, child.children.get());
+        }
+        return total;
+    }
+}
+
+void CommandHistory::pushBack(int32_t commandId, std::shared_ptr<const FieldMap> args,
+                              std::shared_ptr<const FieldMap> result, uint16_t sessionId,
+                              std::shared_ptr<const std::vector<CommandFrame>> children) {
+    reserveOne();
+    const uint64_t serial = m_back_serial++;
+    fillSlot(slot(m_size), commandId, std::move(args), std::move(result), sessionId, serial, std::move(children));
+    m_session_index[sessionId].push_back(serial);
+    if (m_cursor == m_size) {
+        m_cursor++;
+    }
+    m_size++;
+}
+
+void CommandHistory::pushFront(int32_t commandId, std::shared_ptr<const FieldMap> args,
+                               std::shared_ptr<const FieldMap> result, uint16_t sessionId,
+                               std::shared_ptr<const std::vector<CommandFrame>> children) {
+    reserveOne();
+    m_head = (m_head + m_ids.size() - 1) & (m_ids.size() - 1);
+    const uint64_t serial = --m_front_serial;
+    fillSlot(m_head, commandId, std::move(args), std::move(result), sessionId, serial, std::move(children));
+    m_session_index[sessionId].push_front(serial);
+    m_size++;
+    m_cursor++;
+}
+
+void CommandHistory::popBack() {
+    const size_t s = slot(m_size - 1);
+    m_session_index[m_sessions[s]].pop_back(); // It's the newest command of its session
+    clearSlot(s);
+    if (m_cursor == m_size) {
+        m_cursor--;
+    }
+    m_size--;
+}
+
+void CommandHistory::popFront() {
+    m_session_index[m_sessions[m_head]].pop_front(); // It's the oldest command of its session
+    clearSlot(m_head);
+    m_head = (m_head + 1) & (m_ids.size() - 1);
+    m_size--;
+    if (m_cursor > 0) {
+        m_cursor--;
+    }
+}
+
+void CommandHistory::discardRedo() {
+    while (m_size > m_cursor) {
+        popBack();
+    }
+}
+
+void CommandHistory::erase(size_t index) {
+    const size_t s = slot(index);
+    std::deque<uint64_t>& serials = m_session_index[m_sessions[s]];
+    serials.erase(std::lower_bound(serials.begin(), serials.end(), m_records[s].serial));
+    clearSlot(s);
+    // Move the newer commands down by one to fill the gap:
+    for (size_t i = index + 1; i < m_size; i++) {
+        const size_t from = slot(i), to = slot(i - 1);
+        m_ids[to] = m_ids[from];
+        m_sessions[to] = m_sessions[from];
+        m_records[to] = std::move(m_records[from]);
+    }
+    m_records[slot(m_size - 1)] = Record {};
+    m_size--;
+    m_cursor--;
+}
+
+bool CommandHistory::lastFromSession(uint16_t sessionId, size_t* index) const {
+    auto it = m_session_index.find(sessionId);
+    if (it == m_session_index.end() or it->second.empty()) {
+        return false;
+    }
+    const std::deque<uint64_t>& serials = it->second;
+    // Skip any of the session's commands that are after the cursor:
+    auto end = serials.end();
+    if (m_cursor < m_size) {
+        end = std::lower_bound(serials.begin(), serials.end(), m_records[slot(m_cursor)].serial);
+    }
+    if (end == serials.begin()) {
+        return false;
+    }
+    *index = indexOfSerial(*(end - 1));
+    return true;
+}
+
+size_t CommandHistory::indexOfSerial(uint64_t serial) const {
+    size_t low = 0, high = m_size; // Serial numbers increase with the index
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+        if (m_records[slot(mid)].serial < serial) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void CommandHistory::grow() {
+    const size_t capacity = m_ids.empty() ? 16 : m_ids.size() * 2;
+    std::vector<int32_t> ids(capacity);
+    std::vector<uint16_t> sessions(capacity);
+    std::vector<Record> records(capacity);
+    for (size_t i = 0; i < m_size; i++) {
+        const size_t s = slot(i);
+        ids[i] = m_ids[s];
+        sessions[i] = m_sessions[s];
+        records[i] = std::move(m_records[s]);
+    }
+    m_ids.swap(ids);
+    m_sessions.swap(sessions);
+    m_records.swap(records);
+    m_head = 0;
+}
+
+void CommandHistory::fillSlot(size_t slotIndex, int32_t commandId, std::shared_ptr<const FieldMap> args,
+                              std::shared_ptr<const FieldMap> result, uint16_t sessionId, uint64_t serial,
+                              std::shared_ptr<const std::vector<CommandFrame>> children) {
+    const size_t footprint = m_track_bytes ? footprintOf(args, result, children.get()) : 0;
+    m_ids[slotIndex] = commandId;
+    m_sessions[slotIndex] = sessionId;
+    m_records[slotIndex] = Record { std::move(args), std::move(result), std::move(children), footprint, serial };
+    m_bytes += footprint;
+}
+
+size_t CommandHistory::bytes() const {
+    if (m_track_bytes) {
+        return m_bytes;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < m_size; i++) {
+        const Record& r = m_records[slot(i)];
+        total += footprintOf(r.args, r.result, r.children.get());
+    }
+    return total;
+}
+
+void CommandHistory::trackBytes(bool enabled) {
+    if (enabled == m_track_bytes) {
+        return;
+    }
+    m_track_bytes = enabled;
+    m_bytes = 0;
+    for (size_t i = 0; i < m_size; i++) {
+        Record& r = m_records[slot(i)];
+        r.footprint = enabled ? footprintOf(r.args, r.result, r.children.get()) : 0;
+        m_bytes += r.footprint;
+    }
+}
+
+void CommandHistory::clearSlot(size_t slotIndex) {
+    Record& r = m_records[slotIndex];
+    m_bytes -= r.footprint;
+    r = Record {};
+}
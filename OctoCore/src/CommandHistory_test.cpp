@@ -0,0 +1,122 @@
+#include "OctoCore/CommandHistory.h"
+#include "OctoCore/MapPool.h"
+
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::CommandHistory;
+
+namespace {
+    std::shared_ptr<const Octo::FieldMap> makeArgs(int64_t value) {
+        auto args = std::make_shared<Octo::FieldMap>();
+        (*args)[1] = Octo::wrap(value);
+        return args;
+    }
+}
+
+namespace testing {
+
+    TEST(CommandHistoryTest, test_cursor) {
+        CommandHistory history;
+        for (int32_t id = 1; id <= 40; id++) { // More than the initial capacity
+            history.pushBack(id, makeArgs(1), Octo::MapPool::emptyMap(), 1);
+        }
+        EXPECT_EQ(history.size(), 40u);
+        EXPECT_EQ(history.undoCount(), 40u);
+        EXPECT_EQ(history.redoCount(), 0u);
+        const size_t bytes = history.bytes();
+        EXPECT_EQ(bytes, 40 * makeArgs(1)->byteSize());
+
+        history.undo();
+        history.undo();
+        EXPECT_EQ(history.undoCount(), 38u);
+        EXPECT_EQ(history.redoCount(), 2u);
+        EXPECT_EQ(history.commandId(history.undoCount()), 39); // The next command to redo
+        history.redo();
+        EXPECT_EQ(history.commandId(history.undoCount()), 40);
+
+        // Adding a command after the cursor discards the rest of the redo history:
+        history.discardRedo();
+        history.pushBack(41, makeArgs(1), Octo::MapPool::emptyMap(), 1);
+        EXPECT_EQ(history.size(), 40u);
+        EXPECT_EQ(history.redoCount(), 0u);
+        EXPECT_EQ(history.commandId(39), 41);
+        EXPECT_EQ(history.bytes(), bytes);
+        // Tracking the footprint gives the same total, kept up to date as commands are added:
+        history.trackBytes(true);
+        EXPECT_EQ(history.bytes(), bytes);
+        history.popBack();
+        history.pushBack(42, makeArgs(1000000), Octo::MapPool::emptyMap(), 1);
+        EXPECT_EQ(history.bytes(), bytes - makeArgs(1)->byteSize() + makeArgs(1000000)->byteSize());
+        EXPECT_EQ(history.record(39).footprint, makeArgs(1000000)->byteSize());
+    }
+
+    TEST(CommandHistoryTest, test_ring_buffer) {
+        CommandHistory history;
+        for (int32_t id = 1; id <= 16; id++) {
+            history.pushBack(id, makeArgs(id), Octo::MapPool::emptyMap(), 1);
+        }
+        // Removing from the front and adding at the back wraps around the buffer:
+        for (int32_t id = 17; id <= 24; id++) {
+            history.popFront();
+            history.pushBack(id, makeArgs(id), Octo::MapPool::emptyMap(), 1);
+        }
+        EXPECT_EQ(history.size(), 16u);
+        for (size_t i = 0; i < history.size(); i++) {
+            ASSERT_EQ(history.commandId(i), static_cast<int32_t>(9 + i));
+            ASSERT_EQ(history.record(i).args->at(1).int64(), static_cast<int64_t>(9 + i));
+        }
+        // Adding at the front keeps the cursor on the same command, and grows the buffer when full:
+        history.setCursor(10);
+        history.pushFront(8, makeArgs(8), Octo::MapPool::emptyMap(), 1);
+        EXPECT_EQ(history.undoCount(), 11u);
+        EXPECT_EQ(history.commandId(0), 8);
+        EXPECT_EQ(history.commandId(history.undoCount()), 19);
+        EXPECT_EQ(history.commandId(16), 24);
+
+        history.popBack();
+        EXPECT_EQ(history.size(), 16u);
+        EXPECT_EQ(history.undoCount(), 11u);
+        while (not history.empty()) {
+            history.popFront();
+        }
+        EXPECT_EQ(history.undoCount(), 0u);
+        EXPECT_EQ(history.bytes(), 0u);
+    }
+
+    TEST(CommandHistoryTest, test_sessions) {
+        CommandHistory history;
+        for (int32_t id = 0; id < 30; id++) {
+            history.pushBack(id, makeArgs(id), Octo::MapPool::emptyMap(), id % 3 == 0 ? 7 : 8);
+        }
+        size_t index;
+        EXPECT_FALSE(history.lastFromSession(9, &index));
+        ASSERT_TRUE(history.lastFromSession(7, &index));
+        EXPECT_EQ(history.commandId(index), 27);
+        // Commands after the cursor are skipped:
+        history.setCursor(27);
+        ASSERT_TRUE(history.lastFromSession(7, &index));
+        EXPECT_EQ(history.commandId(index), 24);
+        EXPECT_EQ(history.sessionId(index), 7);
+
+        // Erasing a command moves the later ones (and the cursor) back:
+        history.erase(index);
+        EXPECT_EQ(history.size(), 29u);
+        EXPECT_EQ(history.undoCount(), 26u);
+        EXPECT_EQ(history.commandId(24), 25);
+        ASSERT_TRUE(history.lastFromSession(7, &index));
+        EXPECT_EQ(history.commandId(index), 21);
+        ASSERT_TRUE(history.lastFromSession(8, &index));
+        EXPECT_EQ(history.commandId(index), 26);
+
+        // Commands added at the front are indexed too:
+        while (history.size() > 1) {
+            history.popFront();
+        }
+        history.pushFront(100, makeArgs(100), Octo::MapPool::emptyMap(), 9);
+        history.setCursor(1);
+        ASSERT_TRUE(history.lastFromSession(9, &index));
+        EXPECT_EQ(index, 0u);
+        EXPECT_FALSE(history.lastFromSession(7, &index));
+    }
+}
@@ -24,12 +24,73 @@ struct TestCommand : public Command<SimpleState, 3000> {
         OCTO_RESULT(ObjectId, oid_result);
     );
 
-    void forward(State* state, Result& result) const {}
-    void backward(State* state, const Result result) const {}
+    void forward(State*, Result&) const {}
+    void backward(State*, const Result) const {}
 };
 
 REGISTER_OCTO_COMMAND(TestCommand);
 
+/** FlatTestCommand: a command that uses OCTO_FLAT_ARGS */
+#define DEFERRED_COUNTER() enum : int { deferred_counter = __COUNTER__ };
+struct FlatTestCommand : public Command<SimpleState, 3001> {
+    using Command::Command;
+    OCTO_FLAT_ARGS(
+        OCTO_FLAT_ARG(bool, bool_arg);
+        OCTO_FLAT_ARG(int64_t, int_arg);
+        // Other uses of __COUNTER__ between the fields don't hide the fields after them:
+        enum : int { unrelated_counter = __COUNTER__ };
+        DEFERRED_COUNTER OCTO_DEFER() ()
+        OCTO_FLAT_ARG(string, str_arg);
+        OCTO_FLAT_ARG(IntList, list_arg);
+    )
+    OCTO_ARG(double, regular_arg); // Regular args can be mixed with flat args
+    OCTO_RESULTS(
+        OCTO_RESULT(int64_t, sum);
+    )
+    void forward(State*, Result& result) const {
+        int64_t sum = flatArgs().int_arg + (flatArgs().bool_arg ? 1 : 0) + flatArgs().str_arg.size();
+        for (auto value : flatArgs().list_arg) { sum += value; }
+        result.set_sum(sum + static_cast<int64_t>(regular_arg()));
+    }
+    void backward(State*, const Result) const {}
+};
+REGISTER_OCTO_COMMAND(FlatTestCommand);
+
+/** BulkCommand: a command with large list args */
+struct BulkCommand : public Command<SimpleState, 3002> {
+    using Command::Command;
+    OCTO_ARG(IntList, ids);
+    OCTO_ARG(StrList, names);
+    OCTO_ARG(List, values);
+    OCTO_RESULTS()
+    void forward(State*, Result&) const {}
+    void backward(State*, const Result) const {}
+};
+REGISTER_OCTO_COMMAND(BulkCommand);
+
+// A state whose command IDs are far apart, so that freezing its registry requires hashing
+namespace {
+    class SparseState : public Octo::State {
+    public:
+        SparseState() : State(10) {}
+        int m_counter = 0;
+        OCTO_STATE_DEFAULTS;
+    };
+}
+template<int _commandId, int _increment>
+struct SparseCommand : public Command<SparseState, _commandId> {
+    using Command<SparseState, _commandId>::Command;
+    OCTO_RESULTS()
+    void forward(SparseState* state, Result&) const { state->m_counter += _increment; }
+    void backward(SparseState* state, const Result) const { state->m_counter -= _increment; }
+};
+using SparseCommandA = SparseCommand<-7, 1>;
+using SparseCommandB = SparseCommand<4000, 10>;
+using SparseCommandC = SparseCommand<1234567, 100>;
+REGISTER_OCTO_COMMAND(SparseCommandA);
+REGISTER_OCTO_COMMAND(SparseCommandB);
+REGISTER_OCTO_COMMAND(SparseCommandC);
+
 namespace testing {
 
     TEST(CommandTest, test_args_guarantee) {
@@ -54,4 +115,124 @@ namespace testing {
         EXPECT_EQ(args2->at(fid).boolean(), false);
         EXPECT_EQ(args2->at(tc.int_arg_field_id).int64(), -50);
     }
+
+    TEST(CommandTest, test_flat_args) {
+        FlatTestCommand cmd;
+        EXPECT_EQ(cmd.flatArgs().int_arg, 0);
+        cmd.flatArgs().bool_arg = true;
+        cmd.flatArgs().int_arg = 40;
+        cmd.flatArgs().str_arg = "abc";
+        cmd.flatArgs().list_arg.Add(100);
+        cmd.flatArgs().list_arg.Add(200);
+        cmd.regular_arg() = 1000.0;
+
+        // Flat args are converted to a Map when needed:
+        auto args = cmd.args();
+        EXPECT_EQ(args->size(), 5u);
+        EXPECT_GT(FlatTestCommand::FlatArgs::str_arg_flat_index, FlatTestCommand::FlatArgs::int_arg_flat_index + 1);
+        EXPECT_EQ(args->at(FlatTestCommand::FlatArgs::int_arg_field_id).int64(), 40);
+        EXPECT_EQ(args->at(FlatTestCommand::FlatArgs::str_arg_field_id).string(), "abc");
+        EXPECT_EQ(args->at(FlatTestCommand::FlatArgs::list_arg_field_id).int_list().entries_size(), 2);
+        EXPECT_EQ(args->at(cmd.regular_arg_field_id).real(), 1000.0);
+        // The map is only rebuilt after the flat args were modified:
+        EXPECT_EQ(cmd.args(), args);
+        cmd.flatArgs().int_arg = 41;
+        auto args2 = cmd.args();
+        EXPECT_NE(args2, args);
+        EXPECT_EQ(args->at(FlatTestCommand::FlatArgs::int_arg_field_id).int64(), 40);
+        EXPECT_EQ(args2->at(FlatTestCommand::FlatArgs::int_arg_field_id).int64(), 41);
+        // The flat args are also included when the command is used as a CommandBase:
+        FlatTestCommand cmd2;
+        cmd2.flatArgs().int_arg = 42;
+        const Octo::CommandBase& base = cmd2;
+        EXPECT_EQ(base.args()->at(FlatTestCommand::FlatArgs::int_arg_field_id).int64(), 42);
+        cmd.flatArgs().int_arg = 40;
+
+        // ... and re-created from it:
+        SimpleState state;
+        EXPECT_EQ(state.runCommand(cmd).sum(), 1344);
+        auto result = state.runCommand(FlatTestCommand::commandId(), args);
+        EXPECT_EQ(result->at(FlatTestCommand::Result::sum_field_id).int64(), 1344);
+    }
+
+    TEST(CommandTest, test_arg_builders) {
+        BulkCommand cmd;
+        // Lists can be built in place:
+        cmd.ids().reserve(1000);
+        for (int64_t i = 0; i < 1000; i++) {
+            cmd.ids().emplace(i * 2);
+        }
+        cmd.names().emplace("first");
+        cmd.names().emplace(std::string("second"));
+        cmd.values().emplace("a string");
+        cmd.values().emplace(int64_t {5});
+        EXPECT_EQ(cmd.ids()->size(), 1000);
+        EXPECT_EQ(cmd.ids()->Get(999), 1998);
+        EXPECT_EQ(cmd.names()->Get(1), "second");
+        EXPECT_EQ(cmd.values()->Get(0).string(), "a string");
+        EXPECT_EQ(cmd.values()->Get(1).int64(), 5);
+
+        // An rvalue list is adopted without copying its elements:
+        Octo::IntList ids;
+        ids.Add(7);
+        ids.Add(8);
+        const int64_t* ids_data = ids.data();
+        cmd.ids() = std::move(ids);
+        EXPECT_EQ(cmd.ids()->size(), 2);
+        EXPECT_EQ(cmd.ids()->data(), ids_data);
+
+        // Assigning from a vector copies (or, for strings, moves) each element exactly once:
+        cmd.ids().assign(std::vector<int64_t> {3, 4, 5});
+        EXPECT_EQ(cmd.ids()->size(), 3);
+        EXPECT_EQ(cmd.ids()->Get(2), 5);
+        std::vector<std::string> names {"a name that is too long for the small string optimization"};
+        const char* name_data = names[0].data();
+        cmd.names().assign(std::move(names));
+        EXPECT_EQ(cmd.names()->size(), 1);
+        EXPECT_EQ(cmd.names()->Get(0).data(), name_data);
+    }
+
+    TEST(CommandTest, test_args_copy_on_write_is_per_field) {
+        BulkCommand cmd;
+        cmd.ids().assign(std::vector<int64_t>(100000, 1));
+        cmd.names().emplace("variant 1");
+        auto args1 = cmd.args();
+        // Changing one arg of a command whose args have been stored does not copy the other args:
+        *cmd.names()->Mutable(0) = "variant 2";
+        auto args2 = cmd.args();
+        EXPECT_NE(args1.get(), args2.get());
+        EXPECT_EQ(&args1->at(cmd.ids_field_id), &args2->at(cmd.ids_field_id));
+        EXPECT_EQ(args1->at(cmd.names_field_id).str_list().entries(0), "variant 1");
+        EXPECT_EQ(args2->at(cmd.names_field_id).str_list().entries(0), "variant 2");
+    }
+
+    TEST(CommandTest, test_frozen_registry) {
+        Octo::CommandRegistry* registry = SparseState::getCommandRegistry();
+        auto entry_b = registry->getCommand(SparseCommandB::commandId());
+        ASSERT_NE(entry_b, nullptr);
+        registry->freeze();
+        EXPECT_TRUE(registry->isFrozen());
+        // Lookups give the same results as before:
+        EXPECT_EQ(registry->getCommand(SparseCommandB::commandId()), entry_b);
+        EXPECT_NE(registry->getCommand(SparseCommandA::commandId()), nullptr);
+        EXPECT_NE(registry->getCommand(SparseCommandC::commandId()), nullptr);
+        EXPECT_EQ(registry->getCommand(0), nullptr);
+        EXPECT_EQ(registry->getCommand(3999), nullptr);
+        EXPECT_EQ(registry->getCommand(-1234567), nullptr);
+
+        SparseState state;
+        state.runCommand(SparseCommandA());
+        state.runCommand(SparseCommandB());
+        state.runCommand(SparseCommandC());
+        EXPECT_EQ(state.m_counter, 111);
+        state.undo();
+        EXPECT_EQ(state.m_counter, 11);
+        state.redo();
+        EXPECT_EQ(state.m_counter, 111);
+
+        // No more commands can be registered:
+        using LateCommand = SparseCommand<5, 1000>;
+        EXPECT_THROW(Octo::CommandRegistry::Registration<LateCommand>(), Octo::StateException);
+        EXPECT_EQ(registry->getCommand(LateCommand::commandId()), nullptr);
+    }
 }
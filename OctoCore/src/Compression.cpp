@@ -0,0 +1,138 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace Octo;
+
+namespace {
+    const size_t MIN_MATCH = 4; // Shortest copy that is worth encoding
+    const size_t MAX_OFFSET = 65535; // Copies are at most this far back
+    const size_t LAST_LITERALS = 5; // The last bytes of a block are always literals...
+    const size_t MATCH_LIMIT = 12; // ...and the last copy starts at least this far from the end
+    const int HASH_BITS = 12;
+
+    inline uint32_t read32(const char* data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    inline uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    /** Write the part of a length that doesn't fit in its 4 bits of the token */
+    void writeLength(size_t length, std::string* output) {
+        for (; length >= 255; length -= 255) {
+            output->push_back(static_cast<char>(255));
+        }
+        output->push_back(static_cast<char>(length));
+    }
+
+    /** Write a run of literals, then (unless this is the last sequence) a copy */
+    void writeSequence(const char* literals, size_t literalBytes, size_t offset, size_t matchBytes,
+                       std::string* output) {
+        const size_t match_code = matchBytes ? matchBytes - MIN_MATCH : 0;
+        output->push_back(static_cast<char>((std::min<size_t>(literalBytes, 15) << 4) |
+                                            std::min<size_t>(match_code, 15)));
+        if (literalBytes >= 15) {
+            writeLength(literalBytes - 15, output);
+        }
+        output->append(literals, literalBytes);
+        if (matchBytes) {
+            output->push_back(static_cast<char>(offset & 0xff));
+            output->push_back(static_cast<char>(offset >> 8));
+            if (match_code >= 15) {
+                writeLength(match_code - 15, output);
+            }
+        }
+    }
+
+    /** Read the rest of a length whose 4 bits in the token were all set */
+    bool readLength(const uint8_t*& input, const uint8_t* end, size_t* length) {
+        uint8_t byte;
+        do {
+            if (input == end) {
+                return false;
+            }
+            byte = *input++;
+            *length += byte;
+        } while (byte == 255);
+        return true;
+    }
+}
+
+void Octo::compressBlock(const char* data, size_t size, std::string* output) {
+    size_t anchor = 0; // Start of the literals that have not been written yet
+    if (size > MATCH_LIMIT) {
+        uint32_t table[1 << HASH_BITS] = {}; // Position + 1 of the last sequence with each hash
+        const size_t match_limit = size - MATCH_LIMIT;
+        const size_t extend_limit = size - LAST_LITERALS;
+        size_t position = 0;
+        while (position < match_limit) {
+            const uint32_t sequence = read32(data + position);
+            uint32_t& entry = table[hash(sequence)];
+            const size_t candidate = entry;
+            entry = static_cast<uint32_t>(position + 1);
+            if (candidate == 0 or position - (candidate - 1) > MAX_OFFSET or read32(data + candidate - 1) != sequence) {
+                position++;
+                continue;
+            }
+            const char* match = data + candidate - 1;
+            size_t length = MIN_MATCH;
+            while (position + length < extend_limit and match[length] == data[position + length]) {
+                length++;
+            }
+            writeSequence(data + anchor, position - anchor, data + position - match, length, output);
+            position += length;
+            anchor = position;
+        }
+    }
+    writeSequence(data + anchor, size - anchor, 0, 0, output);
+}
+
+bool Octo::decompressBlock(const uint8_t* data, size_t size, char* output, size_t rawSize) {
+    const uint8_t* input = data;
+    const uint8_t* const input_end = data + size;
+    char* out = output;
+    char* const output_end = output + rawSize;
+    while (input < input_end) {
+        const uint8_t token = *input++;
+        size_t literal_bytes = token >> 4;
+        if (literal_bytes == 15 and not readLength(input, input_end, &literal_bytes)) {
+            return false;
+        }
+        if (literal_bytes > static_cast<size_t>(input_end - input) or
+            literal_bytes > static_cast<size_t>(output_end - out)) {
+            return false;
+        }
+        std::memcpy(out, input, literal_bytes);
+        input += literal_bytes;
+        out += literal_bytes;
+        if (input == input_end) {
+            break; // The last sequence has no copy
+        }
+        if (input_end - input < 2) {
+            return false;
+        }
+        const size_t offset = input[0] | (static_cast<size_t>(input[1]) << 8);
+        input += 2;
+        size_t match_bytes = token & 15;
+        if (match_bytes == 15 and not readLength(input, input_end, &match_bytes)) {
+            return false;
+        }
+        match_bytes += MIN_MATCH;
+        if (offset == 0 or offset > static_cast<size_t>(out - output) or
+            match_bytes > static_cast<size_t>(output_end - out)) {
+            return false;
+        }
+        // The copy may overlap the bytes it is writing (e.g. a run of one repeated byte)
+        const char* match = out - offset;
+        for (size_t i = 0; i < match_bytes; i++) {
+            out[i] = match[i];
+        }
+        out += match_bytes;
+    }
+    return out == output_end;
+}
@@ -0,0 +1,91 @@
+#include "OctoCore/Compression.h"
+
+#include <random>
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+namespace {
+    /** Compress and decompress 'data', and check that it comes back unchanged */
+    std::string roundTrip(const std::string& data) {
+        std::string compressed;
+        Octo::compressBlock(data.data(), data.size(), &compressed);
+        std::string decompressed(data.size(), '\0');
+        EXPECT_TRUE(Octo::decompressBlock(reinterpret_cast<const uint8_t*>(compressed.data()), compressed.size(),
+                                          &decompressed[0], decompressed.size()));
+        EXPECT_EQ(decompressed, data);
+        return compressed;
+    }
+}
+
+namespace testing {
+
+    TEST(CompressionTest, test_round_trip) {
+        roundTrip("");
+        roundTrip("short");
+        roundTrip("exactly 13 ch");
+        // Long runs of literals and long copies need extra length bytes:
+        std::mt19937 random(42);
+        std::string noise;
+        for (int i = 0; i < 100000; i++) {
+            noise.push_back(static_cast<char>(random()));
+        }
+        const std::string compressed_noise = roundTrip(noise);
+        EXPECT_LT(compressed_noise.size(), noise.size() + noise.size() / 200 + 16);
+        const std::string run(100000, 'x');
+        EXPECT_LT(roundTrip(run).size(), 500u);
+        // Repeated records, like a block of journal frames, compress well:
+        std::string records;
+        for (int i = 0; i < 2000; i++) {
+            records += "\x08\x01\x12\x0c\x0a\x0a\x08\x01\x12\x06" "widget" + std::to_string(i % 50) + "\x1a\x00";
+        }
+        EXPECT_LT(roundTrip(records).size() * 4, records.size());
+        roundTrip(records + noise.substr(0, 1000) + records);
+    }
+
+    TEST(CompressionTest, test_reference_lz4) {
+        // A block written by the reference LZ4 compressor (lz4 1.9.4) decompresses correctly...
+        const uint8_t reference[] = {
+            0xf1, 0x19, 0x77, 0x69, 0x64, 0x67, 0x65, 0x74, 0x20, 0x30, 0x3a, 0x20, 0x74, 0x68, 0x65, 0x20,
+            0x71, 0x75, 0x69, 0x63, 0x6b, 0x20, 0x62, 0x72, 0x6f, 0x77, 0x6e, 0x20, 0x66, 0x6f, 0x78, 0x20,
+            0x6a, 0x75, 0x6d, 0x70, 0x73, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x1f, 0x00, 0xa3, 0x6c, 0x61, 0x7a,
+            0x79, 0x20, 0x64, 0x6f, 0x67, 0x3b, 0x20, 0x37, 0x00, 0x1f, 0x31, 0x37, 0x00, 0x23, 0x1f, 0x32,
+            0x37, 0x00, 0x23, 0x1f, 0x33, 0x37, 0x00, 0x23, 0x0f, 0xdc, 0x00, 0x4f, 0x50, 0x64, 0x6f, 0x67,
+            0x3b, 0x20,
+        };
+        std::string data;
+        for (int i = 0; i < 6; i++) {
+            data += "widget " + std::to_string(i % 4) + ": the quick brown fox jumps over the lazy dog; ";
+        }
+        ASSERT_EQ(data.size(), 330u);
+        std::string output(data.size(), '\0');
+        EXPECT_TRUE(Octo::decompressBlock(reference, sizeof(reference), &output[0], output.size()));
+        EXPECT_EQ(output, data);
+        // And compressBlock() writes the very same block:
+        EXPECT_EQ(roundTrip(data), std::string(reinterpret_cast<const char*>(reference), sizeof(reference)));
+    }
+
+    TEST(CompressionTest, test_corrupt_block) {
+        std::string data;
+        for (int i = 0; i < 1000; i++) {
+            data += "record " + std::to_string(i % 10) + ";";
+        }
+        std::string compressed;
+        Octo::compressBlock(data.data(), data.size(), &compressed);
+        const uint8_t* input = reinterpret_cast<const uint8_t*>(compressed.data());
+        std::string output(data.size(), '\0');
+        // Cut short, or decompressing to the wrong size:
+        EXPECT_FALSE(Octo::decompressBlock(input, compressed.size() - 1, &output[0], output.size()));
+        EXPECT_FALSE(Octo::decompressBlock(input, compressed.size(), &output[0], output.size() - 1));
+        // A copy from before the start of the block:
+        const uint8_t bad_offset[] = {0x10, 'a', 0x05, 0x00, 0x00};
+        EXPECT_FALSE(Octo::decompressBlock(bad_offset, sizeof(bad_offset), &output[0], 10));
+        // Damaged blocks never write outside the output, whatever the bytes are:
+        std::mt19937 random(7);
+        for (int i = 0; i < 1000; i++) {
+            std::string damaged = compressed;
+            damaged[random() % damaged.size()] = static_cast<char>(random());
+            Octo::decompressBlock(reinterpret_cast<const uint8_t*>(damaged.data()), damaged.size(),
+                                  &output[0], output.size());
+        }
+    }
+}
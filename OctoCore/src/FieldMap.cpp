@@ -0,0 +1,196 @@
+#include "FieldMap.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+
+using namespace Octo;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+    // Tags used by the MapValue wire format:
+    //   message MapValue { map<fixed32, GenericValue> entries = 1; }
+    // which is equivalent to:
+    //   message MapValue { repeated Entry entries = 1; }
+    //   message Entry { fixed32 key = 1; GenericValue value = 2; }
+    const uint32_t ENTRIES_TAG = WireFormatLite::MakeTag(1, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    const uint32_t KEY_TAG = WireFormatLite::MakeTag(1, WireFormatLite::WIRETYPE_FIXED32);
+    const uint32_t VALUE_TAG = WireFormatLite::MakeTag(2, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+    /** Size of an Entry message, given the serialized size of its value */
+    inline size_t entrySize(size_t valueSize) {
+        return 1 + 4 + 1 + CodedOutputStream::VarintSize32(static_cast<uint32_t>(valueSize)) + valueSize;
+    }
+}
+
+FieldMap::FieldMap(const FieldMap& other) : FieldMap() {
+    *this = other;
+}
+
+FieldMap& FieldMap::operator=(const FieldMap& other) {
+    if (this == &other) {
+        return *this;
+    }
+    // The values are shared, not copied. See mutableValue().
+    clear();
+    if (other.m_size > InlineCapacity) {
+        m_heap.assign(other.m_slots, other.m_slots + other.m_size);
+    } else {
+        std::copy(other.m_slots, other.m_slots + other.m_size, m_inline);
+    }
+    m_size = other.m_size;
+    setSlotsPointer();
+    return *this;
+}
+
+FieldMap::Slot& FieldMap::insertAt(size_t index, FieldId key) {
+    if (m_heap.empty() and m_size < InlineCapacity) {
+        // Shift the later slots up by one. The unused slot after them ends up at 'index'.
+        std::rotate(m_inline + index, m_inline + m_size, m_inline + m_size + 1);
+        Slot& slot = m_inline[index];
+        slot.key = key;
+        if (not slot.value) {
+            slot.value = newValue();
+        }
+        m_size++;
+        return slot;
+    }
+    if (m_heap.empty()) {
+        // Move everything from the inline storage to the heap
+        m_heap.reserve(InlineCapacity * 2);
+        for (size_t i = 0; i < m_size; i++) {
+            m_heap.push_back(std::move(m_inline[i]));
+        }
+    }
+    m_heap.insert(m_heap.begin() + index, Slot { key, newValue() });
+    m_size++;
+    setSlotsPointer();
+    return m_slots[index];
+}
+
+size_t FieldMap::erase(FieldId key) {
+    Slot* slot = lowerBound(key);
+    if (slot == m_slots + m_size or slot->key != key) {
+        return 0;
+    }
+    if (not m_heap.empty()) {
+        m_heap.erase(m_heap.begin() + (slot - m_slots));
+    } else {
+        // Move the erased slot to the end, where it becomes unused:
+        std::rotate(slot, slot + 1, m_inline + m_size);
+        recycle(m_inline[m_size - 1]);
+    }
+    m_size--;
+    setSlotsPointer();
+    return 1;
+}
+
+void FieldMap::clear() {
+    if (not m_heap.empty()) {
+        m_heap.clear();
+    } else {
+        for (size_t i = 0; i < m_size; i++) {
+            recycle(m_inline[i]);
+        }
+    }
+    m_size = 0;
+    setSlotsPointer();
+}
+
+void FieldMap::copyFrom(const Map& other) {
+    clear();
+    for (const auto& it : other) {
+        overwrite(it.first) = it.second;
+    }
+}
+
+void FieldMap::copyTo(MapValue* other) const {
+    Map& entries = *other->mutable_entries();
+    entries.clear();
+    for (const value_type& entry : *this) {
+        entries[entry.first] = entry.second;
+    }
+}
+
+size_t FieldMap::byteSize() const {
+    size_t total = 0;
+    for (const value_type& entry : *this) {
+        const size_t entry_size = entrySize(entry.second.ByteSize());
+        total += 1 + CodedOutputStream::VarintSize32(static_cast<uint32_t>(entry_size)) + entry_size;
+    }
+    return total;
+}
+
+void FieldMap::serialize(CodedOutputStream* output) const {
+    for (const value_type& entry : *this) {
+        const int value_size = entry.second.ByteSize(); // This also caches the sizes of any nested values
+        output->WriteTag(ENTRIES_TAG);
+        output->WriteVarint32(static_cast<uint32_t>(entrySize(value_size)));
+        output->WriteTag(KEY_TAG);
+        output->WriteLittleEndian32(entry.first);
+        output->WriteTag(VALUE_TAG);
+        output->WriteVarint32(static_cast<uint32_t>(value_size));
+        entry.second.SerializeWithCachedSizes(output);
+    }
+}
+
+std::string FieldMap::serializeAsString() const {
+    std::string data;
+    {
+        google::protobuf::io::StringOutputStream string_stream(&data);
+        CodedOutputStream output(&string_stream);
+        serialize(&output);
+    }
+    return data;
+}
+
+bool FieldMap::mergeFrom(CodedInputStream* input) {
+    while (uint32_t tag = input->ReadTag()) {
+        if (tag != ENTRIES_TAG) {
+            if (not WireFormatLite::SkipField(input, tag)) {
+                return false;
+            }
+            continue;
+        }
+        uint32_t entry_length;
+        if (not input->ReadVarint32(&entry_length)) {
+            return false;
+        }
+        const CodedInputStream::Limit entry_limit = input->PushLimit(static_cast<int>(entry_length));
+        FieldId key = 0;
+        GenericValue value;
+        while (uint32_t entry_tag = input->ReadTag()) {
+            if (entry_tag == KEY_TAG) {
+                if (not input->ReadLittleEndian32(&key)) {
+                    return false;
+                }
+            } else if (entry_tag == VALUE_TAG) {
+                uint32_t value_length;
+                if (not input->ReadVarint32(&value_length)) {
+                    return false;
+                }
+                const CodedInputStream::Limit value_limit = input->PushLimit(static_cast<int>(value_length));
+                if (not value.MergePartialFromCodedStream(input) or not input->ConsumedEntireMessage()) {
+                    return false;
+                }
+                input->PopLimit(value_limit);
+            } else if (not WireFormatLite::SkipField(input, entry_tag)) {
+                return false;
+            }
+        }
+        if (not input->ConsumedEntireMessage()) {
+            return false;
+        }
+        input->PopLimit(entry_limit);
+        overwrite(key).Swap(&value);
+    }
+    return input->ConsumedEntireMessage();
+}
+
+bool FieldMap::parseFromString(const std::string& data) {
+    clear();
+    CodedInputStream input(reinterpret_cast<const uint8_t*>(data.data()), static_cast<int>(data.size()));
+    return mergeFrom(&input);
+}
@@ -0,0 +1,137 @@
+#include "OctoCore/FieldMap.h"
+
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::FieldMap;
+using Octo::wrap;
+
+namespace testing {
+
+    TEST(FieldMapTest, test_sorted_inline_and_heap) {
+        FieldMap map;
+        EXPECT_TRUE(map.empty());
+        // Insert keys out of order, past the inline capacity:
+        const Octo::FieldId keys[] = {50, 10, 40, 20, 30, 5, 60};
+        for (auto key : keys) {
+            map[key] = wrap(static_cast<int64_t>(key) * 2);
+            for (auto key2 : keys) {
+                if (key2 == key) { break; }
+                ASSERT_EQ(map.at(key2).int64(), key2 * 2); // Earlier values are unaffected
+            }
+        }
+        EXPECT_EQ(map.size(), 7u);
+        Octo::FieldId previous = 0;
+        for (const auto& it : map) {
+            EXPECT_GT(it.first, previous);
+            EXPECT_EQ(it.second.int64(), it.first * 2);
+            previous = it.first;
+        }
+        EXPECT_EQ(map.count(30), 1u);
+        EXPECT_EQ(map.count(31), 0u);
+        EXPECT_THROW(map.at(31), std::out_of_range);
+
+        EXPECT_EQ(map.erase(30), 1u);
+        EXPECT_EQ(map.erase(30), 0u);
+        EXPECT_EQ(map.size(), 6u);
+        EXPECT_EQ(map.count(30), 0u);
+        EXPECT_EQ(map.at(40).int64(), 80);
+
+        FieldMap copy {map};
+        map.clear();
+        EXPECT_TRUE(map.empty());
+        EXPECT_EQ(copy.size(), 6u);
+        EXPECT_EQ(copy.at(60).int64(), 120);
+    }
+
+    TEST(FieldMapTest, test_inline_erase) {
+        FieldMap map;
+        map[3] = wrap("three");
+        map[1] = wrap("one");
+        map[2] = wrap("two");
+        map.erase(1);
+        EXPECT_EQ(map.size(), 2u);
+        EXPECT_EQ(map.begin()->first, 2u);
+        EXPECT_EQ(map.at(2).string(), "two");
+        EXPECT_EQ(map.at(3).string(), "three");
+        // Re-used inline entries must start out empty:
+        EXPECT_FALSE(map[1].has_string());
+    }
+
+    TEST(FieldMapTest, test_copies_share_values) {
+        FieldMap map;
+        map[1] = wrap("one");
+        Octo::IntList list;
+        for (int i = 0; i < 1000; i++) { list.Add(i); }
+        map[2] = wrap(std::move(list));
+
+        FieldMap copy {map};
+        const FieldMap& const_map = map;
+        const FieldMap& const_copy = copy;
+        EXPECT_EQ(&const_copy.at(2), &const_map.at(2)); // The list was not copied
+        // Modifying one field copies only that field:
+        copy[1] = wrap("uno");
+        EXPECT_EQ(map.at(1).string(), "one");
+        EXPECT_EQ(const_copy.at(1).string(), "uno");
+        EXPECT_EQ(&const_copy.at(2), &const_map.at(2));
+        copy[2].mutable_int_list()->mutable_entries()->Add(1000);
+        EXPECT_NE(&const_copy.at(2), &const_map.at(2));
+        EXPECT_EQ(const_copy.at(2).int_list().entries_size(), 1001);
+        EXPECT_EQ(map.at(2).int_list().entries_size(), 1000);
+        // Overwriting a shared field replaces it, without copying the old value first:
+        FieldMap copy3 {map};
+        const Octo::GenericValue* shared_list = &const_map.at(2);
+        copy3.overwrite(2).set_int64(5);
+        EXPECT_EQ(&const_map.at(2), shared_list);
+        EXPECT_EQ(map.at(2).int_list().entries_size(), 1000);
+        EXPECT_EQ(copy3.at(2).int64(), 5);
+        EXPECT_FALSE(copy3.at(2).has_int_list());
+        copy3.overwrite(3).set_int64(6); // Missing fields are inserted
+        EXPECT_EQ(copy3.at(3).int64(), 6);
+
+        // Clearing or erasing from a map does not affect values shared with a copy:
+        FieldMap copy2 {map};
+        map.erase(1);
+        map.clear();
+        EXPECT_EQ(copy2.at(1).string(), "one");
+        EXPECT_EQ(copy2.at(2).int_list().entries_size(), 1000);
+    }
+
+    TEST(FieldMapTest, test_wire_compatibility) {
+        FieldMap map;
+        map[7] = wrap("seven");
+        map[0xFFFFFFFF] = wrap(true);
+        Octo::IntList list;
+        list.Add(1);
+        list.Add(-2);
+        map[100] = wrap(std::move(list));
+
+        // A serialized FieldMap can be parsed as a MapValue:
+        Octo::MapValue map_value;
+        ASSERT_TRUE(map_value.ParseFromString(map.serializeAsString()));
+        EXPECT_EQ(map.byteSize(), map.serializeAsString().size());
+        EXPECT_EQ(map_value.entries().size(), 3u);
+        EXPECT_EQ(map_value.entries().at(7).string(), "seven");
+        EXPECT_EQ(map_value.entries().at(0xFFFFFFFF).boolean(), true);
+        EXPECT_EQ(map_value.entries().at(100).int_list().entries(1), -2);
+
+        // ... and the other way around:
+        map_value.mutable_entries()->erase(7);
+        (*map_value.mutable_entries())[8] = wrap(8.5);
+        FieldMap parsed;
+        ASSERT_TRUE(parsed.parseFromString(map_value.SerializeAsString()));
+        EXPECT_EQ(parsed.size(), 3u);
+        EXPECT_EQ(parsed.count(7), 0u);
+        EXPECT_EQ(parsed.at(8).real(), 8.5);
+        EXPECT_EQ(parsed.at(100).int_list().entries(0), 1);
+
+        // Conversion without serialization:
+        FieldMap converted {map_value.entries()};
+        EXPECT_EQ(converted.size(), 3u);
+        Octo::MapValue map_value2;
+        converted.copyTo(&map_value2);
+        EXPECT_EQ(map_value2.entries().at(8).real(), 8.5);
+
+        EXPECT_FALSE(parsed.parseFromString("\x0a\x05garbage"));
+    }
+}
@@ -0,0 +1,192 @@
+#include "HistorySpill.h"
+
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "Exception.h"
+
+using namespace Octo;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+namespace {
+    /** The space freed at the start of the file is reclaimed once it is at least this large */
+    const uint64_t COMPACT_MIN_BYTES = 64 * 1024;
+
+    void writeAll(int fd, const char* data, size_t size, uint64_t offset, const std::string& path) {
+        size_t written = 0;
+        while (written < size) {
+            const ssize_t n = ::pwrite(fd, data + written, size - written, offset + written);
+            if (n <= 0) {
+                OCTO_THROW(StateException("Unable to write to the undo history spill file " + path));
+            }
+            written += static_cast<size_t>(n);
+        }
+    }
+
+    bool readAll(int fd, char* data, size_t size, uint64_t offset) {
+        size_t read = 0;
+        while (read < size) {
+            const ssize_t n = ::pread(fd, data + read, size - read, offset + read);
+            if (n <= 0) {
+                return false;
+            }
+            read += static_cast<size_t>(n);
+        }
+        return true;
+    }
+}
+
+HistorySpill::HistorySpill(std::string path) : m_path(std::move(path)) {
+    m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (m_fd < 0) {
+        OCTO_THROW(StateException("Unable to create the undo history spill file " + m_path));
+    }
+}
+
+HistorySpill::~HistorySpill() {
+    #ifndef EMSCRIPTEN
+    if (m_prefetch.valid()) {
+        m_prefetch.wait();
+    }
+    #endif
+    ::close(m_fd);
+    ::unlink(m_path.c_str());
+}
+
+void HistorySpill::pushBlock(const std::vector<CommandFrame>& commands) {
+    std::string data;
+    {
+        google::protobuf::io::StringOutputStream string_stream(&data);
+        CodedOutputStream output(&string_stream);
+        for (const CommandFrame& command : commands) {
+            const size_t size = commandDataSize(command.command_id, *command.args, *command.result, command.session_id);
+            output.WriteVarint32(static_cast<uint32_t>(size));
+            writeCommandData(&output, command.command_id, *command.args, *command.result, command.session_id);
+        }
+    }
+    // Any prefetch in progress is reading an earlier part of the file, so this can't interfere with it.
+    writeAll(m_fd, data.data(), data.size(), m_end, m_path);
+    m_blocks.push_back(Block { m_end, data.size(), commands.size(), 0 });
+    m_end += data.size();
+    m_command_count += commands.size();
+}
+
+std::vector<CommandFrame> HistorySpill::popBlock() {
+    std::vector<CommandFrame> commands;
+    if (m_blocks.empty()) {
+        return commands;
+    }
+    const Block block = m_blocks.back();
+    if (not takePrefetched(m_blocks.size() - 1, &commands)) {
+        commands = readBlock(m_fd, block);
+    }
+    commands.erase(commands.begin(), commands.begin() + block.skip);
+    m_blocks.pop_back();
+    m_end = block.offset; // The space will be re-used by the next block that is pushed
+    m_command_count -= commands.size();
+    return commands;
+}
+
+void HistorySpill::prefetch() {
+    #ifndef EMSCRIPTEN
+    if (m_blocks.empty() or (m_prefetch.valid() and m_prefetch_block == m_blocks.size() - 1)) {
+        return;
+    }
+    if (m_prefetch.valid()) {
+        m_prefetch.wait(); // A stale prefetch, for a block that is no longer the most recent
+    }
+    m_prefetch_block = m_blocks.size() - 1;
+    m_prefetch = std::async(std::launch::async, &HistorySpill::readBlock, m_fd, m_blocks.back());
+    #endif
+}
+
+bool HistorySpill::takePrefetched(size_t blockIndex, std::vector<CommandFrame>* commands) {
+    #ifndef EMSCRIPTEN
+    if (m_prefetch.valid()) {
+        if (m_prefetch_block == blockIndex) {
+            *commands = m_prefetch.get();
+            return true;
+        }
+        m_prefetch.wait();
+        m_prefetch = std::future<std::vector<CommandFrame>>();
+    }
+    #endif
+    return false;
+}
+
+void HistorySpill::dropOldest() {
+    if (m_blocks.empty()) {
+        return;
+    }
+    Block& oldest = m_blocks.front();
+    oldest.skip++;
+    m_command_count--;
+    if (oldest.skip == oldest.count) {
+        #ifndef EMSCRIPTEN
+        if (m_prefetch.valid()) {
+            m_prefetch.wait(); // Its block may be about to be overwritten
+        }
+        m_prefetch_block--; // Keep pointing at the same block (or an invalid index, if it was this one)
+        #endif
+        m_blocks.erase(m_blocks.begin());
+        compact();
+    }
+}
+
+void HistorySpill::compact() {
+    const uint64_t start = m_blocks.empty() ? m_end : m_blocks.front().offset;
+    const uint64_t live_bytes = m_end - start;
+    // Moving the blocks costs as much I/O as they take up, so wait until the free space is at
+    // least as large. Then the blocks' old and new positions don't overlap, either.
+    if (start < COMPACT_MIN_BYTES or start < live_bytes) {
+        return;
+    }
+    #ifndef EMSCRIPTEN
+    if (m_prefetch.valid()) {
+        m_prefetch.wait(); // It read the block from its old position, so its result is still good
+    }
+    #endif
+    std::string buffer;
+    for (uint64_t moved = 0; moved < live_bytes; moved += buffer.size()) {
+        buffer.resize(static_cast<size_t>(std::min<uint64_t>(live_bytes - moved, COMPACT_MIN_BYTES)));
+        if (not readAll(m_fd, &buffer[0], buffer.size(), start + moved)) {
+            OCTO_THROW(StateException("Unable to read from the undo history spill file " + m_path));
+        }
+        writeAll(m_fd, buffer.data(), buffer.size(), moved, m_path);
+    }
+    for (Block& block : m_blocks) {
+        block.offset -= start;
+    }
+    m_end = live_bytes;
+    if (::ftruncate(m_fd, static_cast<off_t>(m_end)) != 0) {
+        OCTO_THROW(StateException("Unable to truncate the undo history spill file " + m_path));
+    }
+}
+
+std::vector<CommandFrame> HistorySpill::readBlock(int fd, Block block) {
+    std::string data(block.size, '\0');
+    if (not readAll(fd, &data[0], block.size, block.offset)) {
+        OCTO_THROW(StateException("Unable to read from the undo history spill file."));
+    }
+    std::vector<CommandFrame> commands(block.count);
+    CodedInputStream input(reinterpret_cast<const uint8_t*>(data.data()), static_cast<int>(data.size()));
+    input.SetTotalBytesLimit(INT_MAX, INT_MAX);
+    for (CommandFrame& command : commands) {
+        uint32_t size;
+        if (not input.ReadVarint32(&size)) {
+            OCTO_THROW(StateException("The undo history spill file is corrupt."));
+        }
+        const CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(size));
+        if (not readCommandData(&input, &command)) {
+            OCTO_THROW(StateException("The undo history spill file is corrupt."));
+        }
+        input.PopLimit(limit);
+    }
+    return commands;
+}
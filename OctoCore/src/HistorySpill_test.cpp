@@ -0,0 +1,85 @@
+#include "OctoCore/HistorySpill.h"
+#include "CommandFrame_test.h"
+
+#include <cstdio>
+#include <sys/stat.h>
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::CommandFrame;
+using Octo::HistorySpill;
+
+namespace testing {
+
+    TEST(HistorySpillTest, test_push_and_pop) {
+        const std::string path = "octocore_history_spill_test.tmp";
+        {
+            HistorySpill spill {path};
+            spill.pushBlock(testCommands(1, 3));
+            spill.pushBlock(testCommands(4, 2));
+            EXPECT_EQ(spill.commandCount(), 5);
+            spill.prefetch();
+
+            auto block = spill.popBlock(); // The most recent block comes back first
+            ASSERT_EQ(block.size(), 2);
+            EXPECT_EQ(block[0].command_id, 4);
+            EXPECT_EQ(block[1].args->at(1).int64(), 50);
+
+            // The space is re-used:
+            spill.pushBlock(testCommands(6, 1));
+            EXPECT_EQ(spill.popBlock()[0].command_id, 6);
+
+            // The oldest commands can be dropped:
+            spill.dropOldest();
+            EXPECT_EQ(spill.commandCount(), 2);
+            block = spill.popBlock();
+            ASSERT_EQ(block.size(), 2);
+            EXPECT_EQ(block[0].command_id, 2);
+            EXPECT_EQ(spill.blockCount(), 0);
+            EXPECT_TRUE(spill.popBlock().empty());
+        }
+        // The file is deleted:
+        EXPECT_EQ(std::fopen(path.c_str(), "r"), nullptr);
+    }
+
+    TEST(HistorySpillTest, test_file_size_is_bounded) {
+        const std::string path = "octocore_history_spill_bounded_test.tmp";
+        HistorySpill spill {path};
+        const std::string payload(1000, 'x');
+        auto fileSize = [&path]() {
+            struct stat info;
+            EXPECT_EQ(stat(path.c_str(), &info), 0);
+            return static_cast<size_t>(info.st_size);
+        };
+        // Keep the file at about 10 blocks, by dropping the oldest commands as new ones are pushed:
+        size_t max_size = 0;
+        for (int32_t id = 1; id <= 3000; id += 3) {
+            std::vector<CommandFrame> block = testCommands(id, 3);
+            for (CommandFrame& command : block) {
+                auto args = std::make_shared<Octo::FieldMap>(*command.args);
+                (*args)[2] = Octo::wrap(payload);
+                command.args = args;
+            }
+            spill.pushBlock(block);
+            while (spill.commandCount() > 30) {
+                spill.dropOldest();
+            }
+            max_size = std::max(max_size, fileSize());
+        }
+        // Although 1MB of commands were pushed, the file never held more than the freed space
+        // that was waiting to be reclaimed plus about twice the commands that were still in it:
+        EXPECT_LT(max_size, 2 * 64 * 1024 + 2 * 30 * 1100);
+        // The commands are all still intact:
+        auto block = spill.popBlock();
+        ASSERT_EQ(block.size(), 3u);
+        EXPECT_EQ(block[2].command_id, 3000);
+        EXPECT_EQ(block[2].args->at(2).string(), payload);
+        for (int i = 0; i < 9; i++) {
+            block = spill.popBlock();
+            ASSERT_EQ(block.size(), 3u);
+        }
+        EXPECT_EQ(block[0].command_id, 2971);
+        EXPECT_EQ(block[0].args->at(1).int64(), 29710);
+        EXPECT_EQ(spill.commandCount(), 0u);
+    }
+}
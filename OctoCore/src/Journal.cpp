@@ -0,0 +1,950 @@
+#include "Journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "Compression.h"
+#include "Exception.h"
+
+using namespace Octo;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+namespace {
+    /** Find the files named like "<prefix>-00000001.<suffix>", and return their numbers in order */
+    std::vector<uint32_t> listNumberedFiles(const std::string& directory, const char* prefix, const char* suffix) {
+        std::vector<uint32_t> numbers;
+        DIR* dir = ::opendir(directory.c_str());
+        if (not dir) {
+            return numbers;
+        }
+        const std::string format = std::string(prefix) + "-%8u.%15s";
+        while (const dirent* entry = ::readdir(dir)) {
+            unsigned number;
+            char found_suffix[16];
+            if (std::sscanf(entry->d_name, format.c_str(), &number, found_suffix) == 2 and
+                std::strcmp(found_suffix, suffix) == 0) {
+                numbers.push_back(number);
+            }
+        }
+        ::closedir(dir);
+        std::sort(numbers.begin(), numbers.end());
+        return numbers;
+    }
+
+    std::string numberedFilePath(const std::string& directory, const char* prefix, uint32_t number,
+                                 const char* suffix) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s-%08u.%s", prefix, number, suffix);
+        return directory + "/" + name;
+    }
+
+    /** Read a whole file into 'data' */
+    bool readFile(const std::string& path, std::string* data) {
+        data->clear();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        char buffer[64 << 10];
+        ssize_t n;
+        while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) {
+            data->append(buffer, static_cast<size_t>(n));
+        }
+        ::close(fd);
+        return n == 0;
+    }
+
+    /** Flush a directory, so that the files that were created or renamed in it are on the disk */
+    void syncDirectory(const std::string& directory) {
+        const int dir_fd = ::open(directory.c_str(), O_RDONLY);
+        if (dir_fd >= 0) {
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+}
+
+std::vector<uint32_t> Octo::listJournalSegments(const std::string& directory) {
+    return listNumberedFiles(directory, "segment", "journal");
+}
+
+std::vector<uint32_t> Octo::listJournalSnapshots(const std::string& directory) {
+    return listNumberedFiles(directory, "snapshot", "snapshot");
+}
+
+std::string Octo::journalSegmentPath(const std::string& directory, uint32_t number) {
+    return numberedFilePath(directory, "segment", number, "journal");
+}
+
+std::string Octo::journalSnapshotPath(const std::string& directory, uint32_t number) {
+    return numberedFilePath(directory, "snapshot", number, "snapshot");
+}
+
+void Octo::removeJournalBefore(const std::string& directory, uint32_t segment) {
+    for (uint32_t number : listJournalSegments(directory)) {
+        if (number < segment) {
+            ::unlink(journalSegmentPath(directory, number).c_str());
+        }
+    }
+    for (uint32_t number : listJournalSnapshots(directory)) {
+        if (number < segment) {
+            ::unlink(journalSnapshotPath(directory, number).c_str());
+        }
+    }
+    syncDirectory(directory);
+}
+
+namespace {
+    // A compressed segment starts with this. A plain segment can't, since every frame starts
+    // with its length and then the command ID tag.
+    const char COMPRESSED_SEGMENT_MARKER[4] = {'\0', 'O', 'C', 'Z'};
+    // A finished compressed segment ends with the offset of its block index, then this
+    const char BLOCK_INDEX_MARKER[4] = {'O', 'C', 'Z', 'I'};
+    const size_t BLOCK_INDEX_TRAILER_BYTES = 8 + sizeof(BLOCK_INDEX_MARKER);
+
+    /** Flush a file's data to the disk */
+    bool syncFile(int fd) {
+        #ifdef __linux__
+        return ::fdatasync(fd) == 0;
+        #else
+        return ::fsync(fd) == 0;
+        #endif
+    }
+
+    /** Get the size (including the length prefix) of the frame at 'data'. Returns false if its
+     *  length is unreadable or longer than the 'size' bytes available. */
+    bool frameSize(const uint8_t* data, size_t size, size_t* frameBytes) {
+        CodedInputStream input(data, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        uint32_t length;
+        if (not input.ReadVarint32(&length) or length > size - input.CurrentPosition()) {
+            return false;
+        }
+        *frameBytes = input.CurrentPosition() + length;
+        return true;
+    }
+}
+
+JournalWriter::JournalWriter(std::string directory, JournalDurability durability, size_t segmentBytes,
+                             size_t compressedBlockBytes)
+    : m_directory(std::move(directory)), m_durability(durability), m_segment_bytes(segmentBytes),
+      m_block_bytes(compressedBlockBytes)
+{
+    if (::mkdir(m_directory.c_str(), 0700) != 0 and errno != EEXIST) {
+        OCTO_THROW(StateException("Unable to create the journal directory " + m_directory));
+    }
+    const std::vector<uint32_t> segments = listJournalSegments(m_directory);
+    const std::vector<uint32_t> snapshots = listJournalSnapshots(m_directory);
+    // A compacted journal may have a snapshot but no segments
+    const uint32_t first_segment = std::max(segments.empty() ? 1 : segments.back() + 1,
+                                            snapshots.empty() ? 1 : snapshots.back());
+    if (not openSegment(first_segment)) {
+        OCTO_THROW(StateException("Unable to create a segment in the journal " + m_directory));
+    }
+    #ifndef EMSCRIPTEN
+    if (m_durability == JournalDurability::Batched or
+        (m_durability == JournalDurability::None and m_block_bytes > 0)) {
+        m_batch_thread = std::thread(&JournalWriter::flushBatches, this);
+    }
+    #endif
+}
+
+JournalWriter::~JournalWriter() {
+    #ifndef EMSCRIPTEN
+    if (m_batch_thread.joinable()) {
+        {
+            Lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_batch_ready.notify_one();
+        m_batch_thread.join(); // It flushes the last batch before exiting
+    }
+    #endif
+    Lock lock(m_mutex);
+    const bool flush = (m_durability != JournalDurability::None);
+    if (not m_pending.empty() and not m_failed) {
+        writePending(lock, flush);
+    }
+    if (m_failed) {
+        ::close(m_fd);
+    } else {
+        finishSegment(flush);
+    }
+}
+
+void JournalWriter::append(const JournalFrame& frame) {
+    const CommandFrame& command = frame.command;
+    const JournalFields fields { static_cast<uint32_t>(frame.op), frame.value };
+    const bool has_command = (frame.op == JournalOp::Command or frame.op == JournalOp::Apply);
+    const FieldMap& args = has_command ? *command.args : *MapPool::emptyMap();
+    const FieldMap& result = has_command ? *command.result : *MapPool::emptyMap();
+    const int32_t command_id = has_command ? command.command_id : 0;
+    const size_t size = commandDataSize(command_id, args, result, command.session_id) + journalFieldsSize(fields);
+
+    Lock lock(m_mutex);
+    if (m_failed) {
+        OCTO_THROW(StateException("Unable to write to the journal " + m_directory));
+    }
+    const bool new_batch = m_pending.empty();
+    if (new_batch) {
+        m_pending_since = Clock::now();
+    }
+    {
+        google::protobuf::io::StringOutputStream string_stream(&m_pending); // Appends to m_pending
+        CodedOutputStream output(&string_stream);
+        output.WriteVarint32(static_cast<uint32_t>(size));
+        writeCommandData(&output, command_id, args, result, command.session_id);
+        writeJournalFields(&output, fields);
+    }
+    const uint64_t count = ++m_appended;
+    switch (m_durability) {
+    case JournalDurability::None:
+        // If a thread is writing, it will write this frame too. Compressed frames wait for a full
+        // block, or until the batch window is over (so that a crash of the process loses no more).
+        if (not m_writing and (m_block_bytes == 0 or m_pending.size() >= m_block_bytes)) {
+            writePending(lock, false);
+        }
+        #ifndef EMSCRIPTEN
+        else if (new_batch and m_block_bytes > 0) {
+            m_batch_ready.notify_one(); // So that it starts timing the batch
+        }
+        #else
+        else if (not m_writing and Clock::now() >= m_pending_since + m_batch_delay) {
+            writePending(lock, false); // There is no batch thread
+        }
+        #endif
+        break;
+    case JournalDurability::Batched:
+        #ifndef EMSCRIPTEN
+        if (new_batch or m_pending.size() >= m_batch_bytes) {
+            m_batch_ready.notify_one(); // So that it starts timing the batch, or flushes it now that it's full
+        }
+        #else
+        if (m_pending.size() >= m_batch_bytes or Clock::now() >= m_pending_since + m_batch_delay) {
+            writePending(lock, true); // There is no batch thread
+        }
+        #endif
+        break;
+    case JournalDurability::Synchronous:
+        waitForSync(lock, count);
+        break;
+    }
+}
+
+void JournalWriter::sync() {
+    Lock lock(m_mutex);
+    if (m_durability != JournalDurability::None) {
+        waitForSync(lock, m_appended);
+        return;
+    }
+    // Frames are written without being flushed, so flush the segment even if nothing is pending:
+    while (m_writing) {
+        m_write_done.wait(lock);
+    }
+    if (not m_failed) {
+        writePending(lock, true);
+    }
+    if (m_failed) {
+        OCTO_THROW(StateException("Unable to write to the journal " + m_directory));
+    }
+}
+
+uint32_t JournalWriter::startSegment() {
+    Lock lock(m_mutex);
+    while (m_writing) {
+        m_write_done.wait(lock);
+    }
+    if (not m_failed) {
+        writePending(lock, true);
+    }
+    // No other thread can write while we hold the lock
+    if (not m_failed and m_segment_size > 0) {
+        m_failed = not finishSegment(true) or not openSegment(m_segment + 1);
+    }
+    if (m_failed) {
+        OCTO_THROW(StateException("Unable to write to the journal " + m_directory));
+    }
+    return m_segment;
+}
+
+void JournalWriter::setBatchWindow(std::chrono::microseconds delay, size_t maxBytes) {
+    Lock lock(m_mutex);
+    m_batch_delay = delay;
+    m_batch_bytes = maxBytes;
+}
+
+uint64_t JournalWriter::syncedFrames() const {
+    Lock lock(m_mutex);
+    return m_synced;
+}
+
+uint64_t JournalWriter::syncCount() const {
+    Lock lock(m_mutex);
+    return m_sync_count;
+}
+
+void JournalWriter::waitForSync(Lock& lock, uint64_t count) {
+    while (m_synced < count and not m_failed) {
+        if (m_writing) {
+            m_write_done.wait(lock); // Then flush whatever was appended while it was writing
+        } else {
+            writePending(lock, true);
+        }
+    }
+    if (m_failed) {
+        OCTO_THROW(StateException("Unable to write to the journal " + m_directory));
+    }
+}
+
+void JournalWriter::writePending(Lock& lock, bool flush) {
+    m_writing = true;
+    bool ok = true;
+    do {
+        // Take every pending frame, and write them with the lock released so that other threads
+        // can keep appending (their frames will be written by the next iteration, or flush):
+        m_write_buffer.swap(m_pending);
+        m_pending.clear();
+        const uint64_t count = m_appended;
+        lock.unlock();
+        ok = (m_block_bytes > 0) ? writeBlocks() : writeFrames();
+        lock.lock();
+        if (ok) {
+            m_written = count;
+        }
+    } while (ok and not m_pending.empty());
+    if (ok and flush) {
+        const uint64_t count = m_written;
+        lock.unlock();
+        ok = syncFile(m_fd);
+        lock.lock();
+        if (ok) {
+            m_synced = count;
+            m_sync_count++;
+        }
+    }
+    m_failed = m_failed or not ok;
+    m_writing = false;
+    m_write_done.notify_all();
+}
+
+bool JournalWriter::writeFrames() {
+    if (m_segment_size > 0 and m_segment_size + m_write_buffer.size() > m_segment_bytes) {
+        // A segment is always complete on disk before the next one is started
+        if (not finishSegment(true) or not openSegment(m_segment + 1)) {
+            return false;
+        }
+    }
+    return writeData(m_write_buffer.data(), m_write_buffer.size());
+}
+
+bool JournalWriter::writeBlocks() {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(m_write_buffer.data());
+    const size_t size = m_write_buffer.size();
+    for (size_t begin = 0, end; begin < size; begin = end) {
+        // Take whole frames until the block is full, using just their length prefixes:
+        uint64_t frames = 0;
+        size_t frame_bytes;
+        for (end = begin; end < size and end - begin < m_block_bytes; end += frame_bytes, frames++) {
+            if (not frameSize(data + end, size - end, &frame_bytes)) {
+                return false;
+            }
+        }
+        m_block_buffer.clear();
+        compressBlock(m_write_buffer.data() + begin, end - begin, &m_block_buffer);
+        if (m_segment_size > 0 and m_segment_size + m_block_buffer.size() > m_segment_bytes) {
+            if (not finishSegment(true) or not openSegment(m_segment + 1)) {
+                return false;
+            }
+        }
+        std::string header;
+        {
+            google::protobuf::io::StringOutputStream string_stream(&header);
+            CodedOutputStream output(&string_stream);
+            if (m_segment_size == 0) {
+                output.WriteRaw(COMPRESSED_SEGMENT_MARKER, sizeof(COMPRESSED_SEGMENT_MARKER));
+            }
+            output.WriteVarint64(m_block_buffer.size());
+            output.WriteVarint64(end - begin);
+            output.WriteVarint64(m_segment_frames);
+            output.WriteVarint64(frames);
+        }
+        const size_t offset = m_segment_size + (m_segment_size == 0 ? sizeof(COMPRESSED_SEGMENT_MARKER) : 0);
+        if (not writeData(header.data(), header.size()) or
+            not writeData(m_block_buffer.data(), m_block_buffer.size())) {
+            return false;
+        }
+        m_blocks.push_back(JournalBlock {m_segment_frames, frames, offset});
+        m_segment_frames += frames;
+    }
+    return true;
+}
+
+bool JournalWriter::writeData(const char* data, size_t size) {
+    for (size_t written = 0; written < size; ) {
+        const ssize_t n = ::write(m_fd, data + written, size - written);
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    m_segment_size += size;
+    return true;
+}
+
+#ifndef EMSCRIPTEN
+void JournalWriter::flushBatches() {
+    Lock lock(m_mutex);
+    while (not m_failed) {
+        if (m_pending.empty()) {
+            if (m_stop) {
+                return;
+            }
+            m_batch_ready.wait(lock);
+        } else if (not m_stop and m_pending.size() < m_batch_bytes and Clock::now() < m_pending_since + m_batch_delay) {
+            m_batch_ready.wait_until(lock, m_pending_since + m_batch_delay);
+        } else if (m_writing) {
+            m_write_done.wait(lock);
+        } else {
+            writePending(lock, m_durability == JournalDurability::Batched); // None only passes them to the OS
+        }
+    }
+}
+#endif
+
+bool JournalWriter::openSegment(uint32_t number) {
+    const std::string path = journalSegmentPath(m_directory, number);
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (m_fd < 0) {
+        return false;
+    }
+    m_segment = number;
+    m_segment_size = 0;
+    m_segment_frames = 0;
+    syncDirectory(m_directory); // Make sure the new file's directory entry is on the disk too
+    return true;
+}
+
+bool JournalWriter::finishSegment(bool flush) {
+    bool ok = true;
+    if (not m_blocks.empty()) {
+        std::string index;
+        {
+            google::protobuf::io::StringOutputStream string_stream(&index);
+            CodedOutputStream output(&string_stream);
+            for (const JournalBlock& block : m_blocks) {
+                output.WriteVarint64(block.first_frame);
+                output.WriteVarint64(block.frame_count);
+                output.WriteVarint64(block.offset);
+            }
+            output.WriteLittleEndian64(m_segment_size); // Where the index starts
+            output.WriteRaw(BLOCK_INDEX_MARKER, sizeof(BLOCK_INDEX_MARKER));
+        }
+        ok = writeData(index.data(), index.size());
+        m_blocks.clear();
+    }
+    ok = ok and (not flush or syncFile(m_fd));
+    ::close(m_fd);
+    m_fd = -1;
+    return ok;
+}
+
+struct JournalReader::SegmentData {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    void* mapping = nullptr; // The mapping that holds 'data', if the segment is memory-mapped
+    std::string buffer; // The buffer that holds 'data', if the segment is not memory-mapped
+    bool compressed = false;
+    size_t begin = 0, end = 0; // Where the frames (or compressed blocks) are in 'data'
+    std::vector<JournalBlock> index; // The block index of a compressed segment, if it was finished
+    ~SegmentData() {
+        #ifndef EMSCRIPTEN
+        if (mapping) {
+            ::munmap(mapping, size);
+        }
+        #endif
+    }
+};
+
+namespace {
+    const size_t DECODE_CHUNK_BYTES = 256 << 10; // Target size of the chunks decoded by each thread
+
+    /** Decode the frame at 'data' straight from the (mapped) segment. Returns the number of bytes
+     *  that it takes up, or zero if it is incomplete or corrupt. */
+    size_t decodeFrame(const uint8_t* data, size_t size, JournalFrame* frame) {
+        CodedInputStream input(data, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        input.SetTotalBytesLimit(INT_MAX, INT_MAX);
+        uint32_t length;
+        JournalFields fields;
+        if (not input.ReadVarint32(&length) or length > size - input.CurrentPosition()) {
+            return 0;
+        }
+        const CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(length));
+        if (not readCommandData(&input, &frame->command, &fields)) {
+            return 0;
+        }
+        input.PopLimit(limit);
+        frame->op = static_cast<JournalOp>(fields.op);
+        frame->value = fields.value;
+        return static_cast<size_t>(input.CurrentPosition());
+    }
+
+    /** Decode all of the 'size' bytes of frames at 'data'. Returns false if one is incomplete or
+     *  corrupt, in which case the frames before it are still added to 'frames'. */
+    bool decodeFrames(const uint8_t* data, size_t size, std::vector<JournalFrame>* frames) {
+        for (size_t offset = 0; offset < size; ) {
+            frames->emplace_back();
+            const size_t frame_bytes = decodeFrame(data + offset, size - offset, &frames->back());
+            if (frame_bytes == 0) {
+                frames->pop_back();
+                return false;
+            }
+            offset += frame_bytes;
+        }
+        return true;
+    }
+
+    /** BlockHeader: The header of a block in a compressed segment */
+    struct BlockHeader {
+        size_t compressed_size;
+        size_t raw_size;
+        uint64_t first_frame;
+        uint64_t frame_count;
+        size_t data; // Where the compressed frames start
+        size_t next; // Where the next block starts
+    };
+
+    /** Read the header of the block at 'offset', which must end before 'end' */
+    bool readBlockHeader(const uint8_t* data, size_t end, size_t offset, BlockHeader* header) {
+        if (offset >= end) {
+            return false;
+        }
+        CodedInputStream input(data + offset, static_cast<int>(std::min<size_t>(end - offset, INT_MAX)));
+        uint64_t compressed_size, raw_size;
+        if (not input.ReadVarint64(&compressed_size) or not input.ReadVarint64(&raw_size) or
+            not input.ReadVarint64(&header->first_frame) or not input.ReadVarint64(&header->frame_count)) {
+            return false;
+        }
+        header->data = offset + input.CurrentPosition();
+        // A block can't be more than 255 times smaller than its frames (a copy's length takes at
+        // least one byte for every 255 bytes copied), which catches corrupt sizes before allocating
+        if (compressed_size > end - header->data or raw_size > compressed_size * 255 + 16) {
+            return false;
+        }
+        header->compressed_size = static_cast<size_t>(compressed_size);
+        header->raw_size = static_cast<size_t>(raw_size);
+        header->next = header->data + header->compressed_size;
+        return true;
+    }
+
+    /** Decompress the frames of a block into 'frames' */
+    bool decompressFrames(const uint8_t* data, const BlockHeader& header, std::string* frames) {
+        frames->resize(header.raw_size);
+        return decompressBlock(data + header.data, header.compressed_size, &(*frames)[0], header.raw_size);
+    }
+
+    /** Read the block index at the end of a compressed segment of 'size' bytes, if it was
+     *  finished. Returns where the blocks end: the start of the index, or 'size' if there is none. */
+    size_t readBlockIndex(const uint8_t* data, size_t size, std::vector<JournalBlock>* index) {
+        const size_t begin = sizeof(COMPRESSED_SEGMENT_MARKER);
+        const uint8_t* marker = data + size - sizeof(BLOCK_INDEX_MARKER);
+        if (size < begin + BLOCK_INDEX_TRAILER_BYTES or
+            std::memcmp(marker, BLOCK_INDEX_MARKER, sizeof(BLOCK_INDEX_MARKER)) != 0) {
+            return size;
+        }
+        const size_t trailer = size - BLOCK_INDEX_TRAILER_BYTES;
+        uint64_t index_offset;
+        CodedInputStream::ReadLittleEndian64FromArray(data + trailer, &index_offset);
+        if (index_offset < begin or index_offset > trailer) {
+            return size;
+        }
+        const int index_bytes = static_cast<int>(std::min<size_t>(trailer - index_offset, INT_MAX));
+        CodedInputStream input(data + index_offset, index_bytes);
+        JournalBlock block;
+        while (input.CurrentPosition() < index_bytes) {
+            if (not input.ReadVarint64(&block.first_frame) or not input.ReadVarint64(&block.frame_count) or
+                not input.ReadVarint64(&block.offset)) {
+                index->clear(); // The blocks can still be found from their headers
+                break;
+            }
+            index->push_back(block);
+        }
+        return static_cast<size_t>(index_offset);
+    }
+}
+
+JournalReader::JournalReader(std::string directory, uint32_t firstSegment, size_t decodeThreads)
+    : m_directory(std::move(directory)), m_segments(listJournalSegments(m_directory)),
+      m_decode_threads(decodeThreads)
+{
+    m_segments.erase(m_segments.begin(), std::lower_bound(m_segments.begin(), m_segments.end(), firstSegment));
+}
+
+JournalReader::~JournalReader() {
+    #ifndef EMSCRIPTEN
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_jobs.clear(); // No need to decode them
+        m_stop = true;
+    }
+    m_job_ready.notify_all();
+    for (std::thread& decoder : m_decoders) {
+        decoder.join(); // The threads use the segments, which are released below
+    }
+    #endif
+}
+
+bool JournalReader::next(JournalFrame* frame) {
+    while (true) {
+        // Return the rest of the block that was decompressed by seek(), or by the loop below:
+        if (m_block_offset < m_block.size()) {
+            const uint8_t* block = reinterpret_cast<const uint8_t*>(m_block.data());
+            const size_t frame_bytes = decodeFrame(block + m_block_offset, m_block.size() - m_block_offset, frame);
+            if (frame_bytes > 0) {
+                m_block_offset += frame_bytes;
+                m_position = JournalPosition {m_segments[m_next_segment - 1], m_block_frame++};
+                return true;
+            }
+            m_truncated = true;
+            m_offset = m_segment->end;
+        }
+        m_block.clear();
+        m_block_offset = 0;
+        #ifndef EMSCRIPTEN
+        if (m_decode_threads > 0) {
+            while (m_chunk_position == m_chunk.frames.size()) {
+                const size_t truncated_segment = m_chunk.truncated ? m_chunk.segment : SIZE_MAX;
+                fillPipeline();
+                if (m_pipeline.empty()) {
+                    return false;
+                }
+                m_chunk = m_pipeline.front().get();
+                m_pipeline.pop_front();
+                m_chunk_position = 0;
+                if (m_chunk.segment == truncated_segment) {
+                    // The frames after a truncated chunk can't be trusted (see below)
+                    m_chunk.frames.clear();
+                    m_chunk.truncated = true;
+                }
+                m_truncated = m_truncated or m_chunk.truncated;
+            }
+            m_position = JournalPosition {m_segments[m_chunk.segment - 1], m_chunk.first_frame + m_chunk_position};
+            *frame = std::move(m_chunk.frames[m_chunk_position++]);
+            return true;
+        }
+        #endif
+        while (not m_segment or m_offset == m_segment->end) {
+            if (not loadNextSegment()) {
+                return false;
+            }
+        }
+        if (m_segment->compressed) {
+            BlockHeader header;
+            if (readBlockHeader(m_segment->data, m_segment->end, m_offset, &header) and
+                decompressFrames(m_segment->data, header, &m_block)) {
+                m_offset = header.next;
+                m_frame = header.first_frame + header.frame_count;
+                m_block_frame = header.first_frame;
+            } else {
+                m_truncated = true; // As below
+                m_offset = m_segment->end;
+            }
+            continue;
+        }
+        const size_t frame_bytes = decodeFrame(m_segment->data + m_offset, m_segment->end - m_offset, frame);
+        if (frame_bytes > 0) {
+            m_offset += frame_bytes;
+            m_position = JournalPosition {m_segments[m_next_segment - 1], m_frame++};
+            return true;
+        }
+        // The rest of this segment was not completely written; the next segment (if any) was
+        // started by a later JournalWriter.
+        m_truncated = true;
+        m_offset = m_segment->end;
+    }
+}
+
+void JournalReader::seek(JournalPosition position) {
+    #ifndef EMSCRIPTEN
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_mutex);
+        m_jobs.clear(); // Their futures are discarded below
+    }
+    for (auto& chunk : m_pipeline) {
+        chunk.wait(); // For the chunks that were already being decoded
+    }
+    m_pipeline.clear();
+    #endif
+    m_chunk = Chunk();
+    m_chunk_position = 0;
+    m_block.clear();
+    m_block_offset = 0;
+    m_segment.reset();
+    m_next_segment = std::lower_bound(m_segments.begin(), m_segments.end(), position.segment) - m_segments.begin();
+    if (m_next_segment == m_segments.size() or m_segments[m_next_segment] != position.segment or
+        not loadNextSegment()) {
+        return; // Carry on from the start of the next segment
+    }
+    const SegmentData& segment = *m_segment;
+    size_t frame_bytes;
+    if (not segment.compressed) {
+        // Skip the frames before the position, using just their length prefixes:
+        while (m_frame < position.frame and m_offset < segment.end and
+               frameSize(segment.data + m_offset, segment.end - m_offset, &frame_bytes)) {
+            m_offset += frame_bytes;
+            m_frame++;
+        }
+        return;
+    }
+    // Find the block that holds the frame:
+    BlockHeader header;
+    if (not segment.index.empty()) {
+        auto block = std::upper_bound(segment.index.begin(), segment.index.end(), position.frame,
+                                      [](uint64_t frame, const JournalBlock& entry) {
+                                          return frame < entry.first_frame;
+                                      });
+        block = (block == segment.index.begin()) ? block : block - 1;
+        const bool found = (position.frame < block->first_frame + block->frame_count);
+        m_offset = found ? static_cast<size_t>(std::min<uint64_t>(block->offset, segment.end)) : segment.end;
+    } else {
+        // The segment was not finished, so skip whole blocks using their headers:
+        while (readBlockHeader(segment.data, segment.end, m_offset, &header) and
+               position.frame >= header.first_frame + header.frame_count) {
+            m_offset = header.next;
+        }
+    }
+    if (m_offset == segment.end) {
+        return;
+    }
+    if (not readBlockHeader(segment.data, segment.end, m_offset, &header) or
+        not decompressFrames(segment.data, header, &m_block)) {
+        m_block.clear();
+        m_truncated = true;
+        m_offset = segment.end;
+        return;
+    }
+    m_offset = header.next;
+    m_frame = header.first_frame + header.frame_count;
+    m_block_frame = header.first_frame;
+    const uint8_t* block = reinterpret_cast<const uint8_t*>(m_block.data());
+    while (m_block_frame < position.frame and
+           frameSize(block + m_block_offset, m_block.size() - m_block_offset, &frame_bytes)) {
+        m_block_offset += frame_bytes;
+        m_block_frame++;
+    }
+}
+
+#ifndef EMSCRIPTEN
+void JournalReader::fillPipeline() {
+    if (m_decoders.empty()) {
+        m_decoders.reserve(m_decode_threads);
+        for (size_t i = 0; i < m_decode_threads; i++) {
+            m_decoders.emplace_back(&JournalReader::decodeJobs, this);
+        }
+    }
+    while (m_pipeline.size() < m_decode_threads) {
+        while (not m_segment or m_offset == m_segment->end) {
+            if (not loadNextSegment()) {
+                return;
+            }
+        }
+        const size_t begin = m_offset;
+        const uint64_t first_frame = m_frame;
+        size_t end = begin;
+        if (m_segment->compressed) {
+            // Take whole blocks until the chunk is full, using just their headers:
+            BlockHeader header;
+            for (size_t raw_bytes = 0; end < m_segment->end and raw_bytes < DECODE_CHUNK_BYTES; end = header.next) {
+                if (not readBlockHeader(m_segment->data, m_segment->end, end, &header)) {
+                    end = m_segment->end; // decodeChunk() will find the unreadable block and stop there
+                    break;
+                }
+                raw_bytes += header.raw_size;
+                m_frame = header.first_frame + header.frame_count;
+            }
+        } else {
+            // Split off the frames that fit in the next chunk, using just their length prefixes:
+            size_t frame_bytes;
+            while (end < m_segment->end and end - begin < DECODE_CHUNK_BYTES) {
+                if (not frameSize(m_segment->data + end, m_segment->end - end, &frame_bytes)) {
+                    end = m_segment->end; // decodeChunk() will find the unreadable frame and stop there
+                    break;
+                }
+                end += frame_bytes;
+                m_frame++;
+            }
+        }
+        m_offset = end;
+        DecodeJob job { m_segment, begin, end, m_next_segment, first_frame, std::promise<Chunk>() };
+        m_pipeline.push_back(job.chunk.get_future());
+        {
+            std::lock_guard<std::mutex> lock(m_jobs_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_job_ready.notify_one();
+    }
+}
+
+void JournalReader::decodeJobs() {
+    std::unique_lock<std::mutex> lock(m_jobs_mutex);
+    while (true) {
+        m_job_ready.wait(lock, [this] { return m_stop or not m_jobs.empty(); });
+        if (m_stop) {
+            return;
+        }
+        DecodeJob job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+        job.chunk.set_value(decodeChunk(std::move(job.segment), job.begin, job.end, job.segment_index,
+                                        job.first_frame));
+        lock.lock();
+    }
+}
+#endif
+
+JournalReader::Chunk JournalReader::decodeChunk(std::shared_ptr<const SegmentData> segment, size_t begin,
+                                                size_t end, size_t segmentIndex, uint64_t firstFrame) {
+    Chunk chunk;
+    chunk.segment = segmentIndex;
+    chunk.first_frame = firstFrame;
+    if (not segment->compressed) {
+        chunk.truncated = not decodeFrames(segment->data + begin, end - begin, &chunk.frames);
+        return chunk;
+    }
+    std::string frames;
+    BlockHeader header;
+    for (size_t offset = begin; offset < end and not chunk.truncated; offset = header.next) {
+        chunk.truncated = not readBlockHeader(segment->data, end, offset, &header) or
+                          not decompressFrames(segment->data, header, &frames) or
+                          not decodeFrames(reinterpret_cast<const uint8_t*>(frames.data()), frames.size(),
+                                           &chunk.frames);
+    }
+    return chunk;
+}
+
+bool JournalReader::loadNextSegment() {
+    if (m_next_segment == m_segments.size()) {
+        return false;
+    }
+    const std::string path = journalSegmentPath(m_directory, m_segments[m_next_segment++]);
+    auto segment = std::make_shared<SegmentData>();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 or ::fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        OCTO_THROW(StateException("Unable to read the journal segment " + path));
+    }
+    #ifndef EMSCRIPTEN
+    if (info.st_size > 0) {
+        void* mapping = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            segment->mapping = mapping;
+            segment->data = static_cast<const uint8_t*>(mapping);
+            segment->size = static_cast<size_t>(info.st_size);
+            ::madvise(mapping, segment->size, MADV_SEQUENTIAL); // Let the kernel read ahead
+        }
+    }
+    #endif
+    ::close(fd);
+    if (segment->mapping == nullptr) {
+        if (not readFile(path, &segment->buffer)) {
+            OCTO_THROW(StateException("Unable to read the journal segment " + path));
+        }
+        segment->data = reinterpret_cast<const uint8_t*>(segment->buffer.data());
+        segment->size = segment->buffer.size();
+    }
+    segment->end = segment->size;
+    if (segment->size >= sizeof(COMPRESSED_SEGMENT_MARKER) and
+        std::memcmp(segment->data, COMPRESSED_SEGMENT_MARKER, sizeof(COMPRESSED_SEGMENT_MARKER)) == 0) {
+        segment->compressed = true;
+        segment->begin = sizeof(COMPRESSED_SEGMENT_MARKER);
+        segment->end = readBlockIndex(segment->data, segment->size, &segment->index);
+    }
+    m_segment = std::move(segment);
+    m_offset = m_segment->begin;
+    m_frame = 0;
+    return true;
+}
+
+void Octo::writeSnapshotFile(const std::string& directory, uint32_t segment, const JournalSnapshot& snapshot) {
+    std::string data;
+    {
+        google::protobuf::io::StringOutputStream string_stream(&data);
+        CodedOutputStream output(&string_stream);
+        for (const FieldMap* map : {&snapshot.header, &snapshot.model}) {
+            output.WriteVarint32(static_cast<uint32_t>(map->byteSize()));
+            map->serialize(&output);
+        }
+        for (const CommandFrame& command : snapshot.history) {
+            const size_t size = commandDataSize(command.command_id, *command.args, *command.result, command.session_id);
+            output.WriteVarint32(static_cast<uint32_t>(size));
+            writeCommandData(&output, command.command_id, *command.args, *command.result, command.session_id);
+        }
+    }
+    const std::string path = journalSnapshotPath(directory, segment);
+    const std::string temp_path = path + ".tmp";
+    const int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        OCTO_THROW(StateException("Unable to create the snapshot " + temp_path));
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) {
+            break;
+        }
+        written += static_cast<size_t>(n);
+    }
+    const bool ok = (written == data.size()) and syncFile(fd);
+    ::close(fd);
+    if (not ok or ::rename(temp_path.c_str(), path.c_str()) != 0) {
+        ::unlink(temp_path.c_str());
+        OCTO_THROW(StateException("Unable to write the snapshot " + path));
+    }
+    syncDirectory(directory);
+}
+
+bool Octo::readSnapshotFile(const std::string& path, JournalSnapshot* snapshot) {
+    std::string data;
+    if (not readFile(path, &data) or data.size() > INT_MAX) {
+        return false;
+    }
+    CodedInputStream input(reinterpret_cast<const uint8_t*>(data.data()), static_cast<int>(data.size()));
+    input.SetTotalBytesLimit(INT_MAX, INT_MAX);
+    snapshot->header.clear();
+    snapshot->model.clear();
+    snapshot->history.clear();
+    uint32_t size;
+    for (FieldMap* map : {&snapshot->header, &snapshot->model}) {
+        if (not input.ReadVarint32(&size)) {
+            return false;
+        }
+        const CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(size));
+        if (not map->mergeFrom(&input) or not input.ConsumedEntireMessage()) {
+            return false;
+        }
+        input.PopLimit(limit);
+    }
+    while (input.ReadVarint32(&size)) {
+        const CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(size));
+        CommandFrame command;
+        if (not readCommandData(&input, &command)) {
+            return false;
+        }
+        input.PopLimit(limit);
+        snapshot->history.push_back(std::move(command));
+    }
+    return input.CurrentPosition() == static_cast<int>(data.size());
+}
@@ -0,0 +1,306 @@
+#include "OctoCore/Journal.h"
+#include "CommandFrame_test.h"
+
+#include <cstdio>
+#include <thread>
+#include <unistd.h>
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::JournalFrame;
+using Octo::JournalOp;
+using Octo::JournalReader;
+using Octo::JournalWriter;
+
+namespace {
+    void removeJournal(const std::string& directory) {
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+}
+
+namespace testing {
+
+    TEST(JournalTest, test_write_and_read) {
+        const std::string directory = "octocore_journal_test.tmp";
+        removeJournal(directory);
+        {
+            JournalWriter writer {directory, Octo::JournalDurability::None, 100}; // Small segments, so that it rotates
+            for (int32_t id = 1; id <= 10; id++) {
+                writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+            }
+            writer.append(JournalFrame { JournalOp::UndoTo, Octo::CommandFrame { 0, nullptr, nullptr }, 4 });
+            EXPECT_GT(writer.segmentNumber(), 1);
+        }
+        {
+            JournalWriter empty_writer {directory}; // Leaves an empty segment, which readers skip
+        }
+        {
+            // A new writer continues in a new segment:
+            JournalWriter writer {directory};
+            writer.append(JournalFrame { JournalOp::Redo, Octo::CommandFrame { 0, nullptr, nullptr }, 0 });
+        }
+        JournalReader reader {directory};
+        JournalFrame frame;
+        for (int32_t id = 1; id <= 10; id++) {
+            ASSERT_TRUE(reader.next(&frame));
+            EXPECT_EQ(frame.op, JournalOp::Command);
+            EXPECT_EQ(frame.command.command_id, id);
+            EXPECT_EQ(frame.command.args->at(1).int64(), id * 10);
+            EXPECT_EQ(frame.command.session_id, 3);
+            EXPECT_EQ(frame.value, 77);
+        }
+        ASSERT_TRUE(reader.next(&frame));
+        EXPECT_EQ(frame.op, JournalOp::UndoTo);
+        EXPECT_EQ(frame.value, 4);
+        ASSERT_TRUE(reader.next(&frame));
+        EXPECT_EQ(frame.op, JournalOp::Redo);
+        EXPECT_FALSE(reader.next(&frame));
+        EXPECT_FALSE(reader.isTruncated());
+        removeJournal(directory);
+    }
+
+    TEST(JournalTest, test_torn_frame) {
+        const std::string directory = "octocore_journal_torn_test.tmp";
+        removeJournal(directory);
+        uint32_t segment;
+        {
+            JournalWriter writer {directory};
+            writer.append(JournalFrame { JournalOp::Command, testCommand(1, 3), 77 });
+            writer.append(JournalFrame { JournalOp::Command, testCommand(2, 3), 77 });
+            segment = writer.segmentNumber();
+        }
+        // Cut the last frame short, as if the process had crashed while writing it:
+        const std::string path = Octo::journalSegmentPath(directory, segment);
+        FILE* file = std::fopen(path.c_str(), "rb");
+        ASSERT_NE(file, nullptr);
+        std::fseek(file, 0, SEEK_END);
+        const long size = std::ftell(file);
+        std::fclose(file);
+        ASSERT_EQ(::truncate(path.c_str(), size - 3), 0);
+        {
+            JournalWriter writer {directory};
+            writer.append(JournalFrame { JournalOp::Command, testCommand(3, 3), 77 });
+        }
+
+        // The torn frame is skipped, and reading continues with the next segment:
+        JournalReader reader {directory};
+        JournalFrame frame;
+        ASSERT_TRUE(reader.next(&frame));
+        EXPECT_EQ(frame.command.command_id, 1);
+        ASSERT_TRUE(reader.next(&frame));
+        EXPECT_EQ(frame.command.command_id, 3);
+        EXPECT_FALSE(reader.next(&frame));
+        EXPECT_TRUE(reader.isTruncated());
+        removeJournal(directory);
+    }
+
+    TEST(JournalTest, test_group_commit) {
+        const std::string directory = "octocore_journal_group_test.tmp";
+        removeJournal(directory);
+        {
+            // Batched: frames are flushed together, once the batch window has passed (or on sync()):
+            JournalWriter writer {directory, Octo::JournalDurability::Batched};
+            writer.setBatchWindow(std::chrono::seconds(10), 1 << 20);
+            for (int32_t id = 1; id <= 100; id++) {
+                writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+            }
+            EXPECT_EQ(writer.syncedFrames(), 0);
+            writer.sync();
+            EXPECT_EQ(writer.syncedFrames(), 100);
+            EXPECT_EQ(writer.syncCount(), 1);
+            writer.setBatchWindow(std::chrono::milliseconds(1), 1 << 20);
+            writer.append(JournalFrame { JournalOp::Command, testCommand(101, 3), 77 });
+            for (int i = 0; i < 5000 and writer.syncedFrames() < 101; i++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            EXPECT_EQ(writer.syncedFrames(), 101);
+        }
+        {
+            // Synchronous: each append() waits for its frame to be flushed, but concurrent appends
+            // can share a flush:
+            JournalWriter writer {directory, Octo::JournalDurability::Synchronous};
+            std::vector<std::thread> threads;
+            for (int32_t t = 0; t < 4; t++) {
+                threads.emplace_back([&writer, t] {
+                    for (int32_t id = 1; id <= 50; id++) {
+                        writer.append(JournalFrame { JournalOp::Command, testCommand(1000 * (t + 1) + id, 3), 77 });
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            EXPECT_EQ(writer.syncedFrames(), 200);
+            EXPECT_LE(writer.syncCount(), 200);
+        }
+        JournalReader reader {directory};
+        JournalFrame frame;
+        size_t count = 0;
+        int32_t last_id[5] = {0, 0, 0, 0, 0};
+        while (reader.next(&frame)) {
+            // Each thread's frames are in the order it appended them:
+            const int32_t thread = frame.command.command_id / 1000;
+            ASSERT_GT(frame.command.command_id, last_id[thread]);
+            last_id[thread] = frame.command.command_id;
+            count++;
+        }
+        EXPECT_EQ(count, 301);
+        EXPECT_FALSE(reader.isTruncated());
+        removeJournal(directory);
+    }
+
+    TEST(JournalTest, test_parallel_decode) {
+        const std::string directory = "octocore_journal_parallel_test.tmp";
+        removeJournal(directory);
+        {
+            JournalWriter writer {directory, Octo::JournalDurability::None, 300 << 10};
+            for (int32_t id = 1; id <= 20000; id++) {
+                writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+            }
+        }
+        // Tear a frame in the middle of the first segment, as if it had been corrupted:
+        const std::string path = Octo::journalSegmentPath(directory, Octo::listJournalSegments(directory)[0]);
+        FILE* file = std::fopen(path.c_str(), "r+b");
+        ASSERT_NE(file, nullptr);
+        std::fseek(file, 100 << 10, SEEK_SET);
+        for (int i = 0; i < 64; i++) {
+            std::fputc(0xFF, file);
+        }
+        std::fclose(file);
+
+        // Decoding in parallel returns the same frames, in the same order:
+        JournalReader sequential {directory};
+        JournalReader parallel {directory, 0, 4};
+        JournalFrame frame, parallel_frame;
+        size_t count = 0;
+        Octo::JournalPosition seek_position {0, 0};
+        int32_t seek_id = 0;
+        while (sequential.next(&frame)) {
+            ASSERT_TRUE(parallel.next(&parallel_frame));
+            ASSERT_EQ(parallel_frame.command.command_id, frame.command.command_id);
+            ASSERT_EQ(parallel_frame.command.args->at(1).int64(), frame.command.args->at(1).int64());
+            if (++count == 5000) {
+                seek_position = sequential.position();
+                seek_id = frame.command.command_id;
+            }
+        }
+        EXPECT_FALSE(parallel.next(&parallel_frame));
+        EXPECT_TRUE(sequential.isTruncated());
+        EXPECT_TRUE(parallel.isTruncated());
+        EXPECT_GT(count, 10000);
+        EXPECT_LT(count, 20000);
+        // Seeking, or destroying the reader, while chunks are still waiting to be decoded:
+        {
+            JournalReader seeking {directory, 0, 4};
+            ASSERT_TRUE(seeking.next(&parallel_frame));
+            seeking.seek(seek_position);
+            ASSERT_TRUE(seeking.next(&parallel_frame));
+            EXPECT_EQ(parallel_frame.command.command_id, seek_id);
+        }
+        removeJournal(directory);
+    }
+
+    TEST(JournalTest, test_compressed_segments) {
+        const std::string directory = "octocore_journal_compressed_test.tmp";
+        const std::string plain_directory = "octocore_journal_plain_test.tmp";
+        removeJournal(directory);
+        removeJournal(plain_directory);
+        const auto journalSize = [](const std::string& directory) {
+            long total = 0;
+            for (uint32_t segment : Octo::listJournalSegments(directory)) {
+                FILE* file = std::fopen(Octo::journalSegmentPath(directory, segment).c_str(), "rb");
+                std::fseek(file, 0, SEEK_END);
+                total += std::ftell(file);
+                std::fclose(file);
+            }
+            return total;
+        };
+        {
+            JournalWriter writer {directory, Octo::JournalDurability::None, 100 << 10, 16 << 10};
+            JournalWriter plain_writer {plain_directory, Octo::JournalDurability::None, 100 << 10};
+            EXPECT_TRUE(writer.isCompressed());
+            writer.setBatchWindow(std::chrono::seconds(10), 1 << 20); // Only full blocks (see below)
+            for (int32_t id = 1; id <= 20000; id++) {
+                writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+                plain_writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+            }
+            EXPECT_GT(writer.segmentNumber(), 1);
+        }
+        EXPECT_LT(journalSize(directory) * 3, journalSize(plain_directory));
+
+        // Every frame can be read back, sequentially or in parallel:
+        for (size_t threads : {0, 3}) {
+            JournalReader reader {directory, 0, threads};
+            JournalFrame frame;
+            for (int32_t id = 1; id <= 20000; id++) {
+                ASSERT_TRUE(reader.next(&frame));
+                ASSERT_EQ(frame.command.command_id, id);
+                ASSERT_EQ(frame.command.args->at(1).int64(), id * 10);
+            }
+            EXPECT_FALSE(reader.next(&frame));
+            EXPECT_FALSE(reader.isTruncated());
+        }
+
+        // Seeking to a position finds the same frame as reading up to it:
+        JournalReader reader {directory};
+        JournalFrame frame;
+        for (int32_t id = 1; id <= 12345; id++) {
+            ASSERT_TRUE(reader.next(&frame));
+        }
+        const Octo::JournalPosition position = reader.position();
+        for (size_t threads : {0, 2}) {
+            JournalReader seeker {directory, 0, threads};
+            seeker.seek(position);
+            ASSERT_TRUE(seeker.next(&frame));
+            EXPECT_EQ(frame.command.command_id, 12345);
+            EXPECT_EQ(seeker.position().segment, position.segment);
+            EXPECT_EQ(seeker.position().frame, position.frame);
+            ASSERT_TRUE(seeker.next(&frame));
+            EXPECT_EQ(frame.command.command_id, 12346);
+            // Seeking past the end of a segment continues with the next one:
+            seeker.seek(Octo::JournalPosition {position.segment, 1000000});
+            ASSERT_TRUE(seeker.next(&frame));
+            EXPECT_EQ(seeker.position().segment, position.segment + 1);
+            EXPECT_EQ(seeker.position().frame, 0);
+        }
+
+        // A segment that is still being written has no block index, but can be read and seeked:
+        removeJournal(directory);
+        JournalWriter writer {directory, Octo::JournalDurability::Synchronous, 64 << 20, 1 << 10};
+        for (int32_t id = 1; id <= 1000; id++) {
+            writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+        }
+        JournalReader unfinished {directory};
+        unfinished.seek(Octo::JournalPosition {writer.segmentNumber(), 900});
+        ASSERT_TRUE(unfinished.next(&frame));
+        EXPECT_EQ(frame.command.command_id, 901);
+        size_t count = 1;
+        while (unfinished.next(&frame)) {
+            count++;
+        }
+        EXPECT_EQ(count, 100);
+        EXPECT_FALSE(unfinished.isTruncated());
+
+        // With None durability, the frames of an unfinished block are passed to the OS once the
+        // batch window has passed, so a crash of the process can only lose that window of frames:
+        removeJournal(plain_directory);
+        JournalWriter lazy_writer {plain_directory, Octo::JournalDurability::None, 64 << 20, 16 << 10};
+        lazy_writer.setBatchWindow(std::chrono::milliseconds(1), 1 << 20);
+        for (int32_t id = 1; id <= 10; id++) {
+            lazy_writer.append(JournalFrame { JournalOp::Command, testCommand(id, 3), 77 });
+        }
+        count = 0;
+        for (int i = 0; i < 5000 and count < 10; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            JournalReader partial {plain_directory};
+            for (count = 0; partial.next(&frame); count++) {}
+        }
+        EXPECT_EQ(count, 10u);
+        EXPECT_EQ(lazy_writer.syncCount(), 0u);
+        removeJournal(directory);
+        removeJournal(plain_directory);
+    }
+}
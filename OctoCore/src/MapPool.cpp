@@ -0,0 +1,58 @@
+#include "MapPool.h"
+
+using namespace Octo;
+
+MapPool::~MapPool() {
+    for (void* block : m_free) {
+        ::operator delete(block);
+    }
+}
+
+std::shared_ptr<FieldMap> MapPool::acquire() {
+    return std::allocate_shared<FieldMap>(Allocator<FieldMap>(shared_from_this()));
+}
+
+std::shared_ptr<FieldMap> MapPool::acquire(const FieldMap& other) {
+    return std::allocate_shared<FieldMap>(Allocator<FieldMap>(shared_from_this()), other);
+}
+
+size_t MapPool::freeCount() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_free.size();
+}
+
+MapPool& MapPool::global() {
+    static const std::shared_ptr<MapPool> global_pool = std::make_shared<MapPool>();
+    return *global_pool;
+}
+
+void* MapPool::allocateBlock(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (bytes == m_block_bytes and not m_free.empty()) {
+            void* block = m_free.back();
+            m_free.pop_back();
+            return block;
+        }
+    }
+    return ::operator new(bytes);
+}
+
+void MapPool::releaseBlock(void* block, size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_block_bytes == 0) {
+            m_block_bytes = bytes;
+        }
+        if (bytes == m_block_bytes and m_free.size() < MaxFreeMaps) {
+            m_free.push_back(block);
+            return;
+        }
+    }
+    ::operator delete(block);
+}
+
+const std::shared_ptr<const FieldMap>& MapPool::emptyMap() {
+    static const std::shared_ptr<const FieldMap> empty_map = std::make_shared<const FieldMap>();
+    return empty_map;
+}
@@ -0,0 +1,53 @@
+#include "OctoCore/MapPool.h"
+
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::MapPool;
+
+namespace testing {
+
+    TEST(MapPoolTest, test_recycling) {
+        auto pool = std::make_shared<MapPool>();
+        EXPECT_EQ(pool->freeCount(), 0);
+        const Octo::FieldMap* first_address;
+        {
+            auto map = pool->acquire();
+            (*map)[1] = Octo::wrap("one");
+            (*map)[2] = Octo::wrap(2.0);
+            first_address = map.get();
+        }
+        // The map's memory should have been returned to the pool, to be re-used by the next map:
+        EXPECT_EQ(pool->freeCount(), 1);
+        auto map2 = pool->acquire();
+        EXPECT_EQ(map2.get(), first_address);
+        EXPECT_EQ(map2->size(), 0);
+        EXPECT_EQ(pool->freeCount(), 0);
+        auto map3 = pool->acquire();
+        EXPECT_NE(map3.get(), map2.get());
+    }
+
+    TEST(MapPoolTest, test_copy) {
+        auto pool = std::make_shared<MapPool>();
+        std::shared_ptr<const Octo::FieldMap> map = pool->acquire();
+        std::const_pointer_cast<Octo::FieldMap>(map)->overwrite(1) = Octo::wrap("one");
+        std::shared_ptr<const Octo::FieldMap> copy = pool->acquire(*map);
+        EXPECT_EQ(&copy->at(1), &map->at(1)); // The value is shared, not copied
+        map.reset();
+        copy.reset();
+        EXPECT_EQ(pool->freeCount(), 2);
+    }
+
+    TEST(MapPoolTest, test_maps_outlive_pool) {
+        auto pool = std::make_shared<MapPool>();
+        auto map = pool->acquire();
+        pool.reset();
+        (*map)[1] = Octo::wrap(true);
+        EXPECT_EQ(map->at(1).boolean(), true);
+    }
+
+    TEST(MapPoolTest, test_empty_map) {
+        EXPECT_EQ(MapPool::emptyMap()->size(), 0);
+        EXPECT_EQ(MapPool::emptyMap().get(), MapPool::emptyMap().get());
+    }
+}
@@ -0,0 +1,101 @@
+#include "SlabPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "Exception.h"
+
+using namespace Octo;
+
+namespace {
+    inline size_t alignUp(size_t bytes) {
+        return (bytes + SlabPool::Alignment - 1) & ~(SlabPool::Alignment - 1);
+    }
+}
+
+SlabPool::SlabPool(size_t blockBytes) :
+    m_block_bytes(alignUp(std::max(blockBytes, sizeof(void*)))),
+    m_header_bytes(alignUp(sizeof(Slab))),
+    m_blocks_per_slab((SlabBytes - m_header_bytes) / m_block_bytes)
+{
+    if (m_blocks_per_slab == 0) {
+        OCTO_THROW(std::invalid_argument("SlabPool blocks must be smaller than a slab"));
+    }
+}
+
+SlabPool::~SlabPool() {
+    // Only the available slabs can be found, but every slab should be empty by now
+    while (Slab* slab = m_available) {
+        unlink(slab);
+        std::free(slab);
+    }
+}
+
+void* SlabPool::allocate() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Slab* slab = m_available;
+    if (slab == nullptr) {
+        void* memory = nullptr;
+        if (::posix_memalign(&memory, SlabBytes, SlabBytes) != 0) {
+            OCTO_THROW(std::bad_alloc());
+        }
+        slab = new (memory) Slab { nullptr, nullptr, nullptr, 0, 0 };
+        link(slab);
+        m_slab_count++;
+    }
+    void* block;
+    if (slab->free) {
+        block = slab->free;
+        slab->free = *static_cast<void**>(block);
+    } else {
+        block = firstBlock(slab) + slab->fresh * m_block_bytes;
+        slab->fresh++;
+    }
+    if (++slab->used == m_blocks_per_slab) {
+        unlink(slab); // It's full
+    }
+    return block;
+}
+
+void SlabPool::deallocate(void* block) {
+    Slab* slab = slabOf(block);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    *static_cast<void**>(block) = slab->free;
+    slab->free = block;
+    if (slab->used-- == m_blocks_per_slab) {
+        link(slab); // It was full
+    }
+    if (slab->used == 0 and m_available_count > 1) {
+        unlink(slab);
+        std::free(slab);
+        m_slab_count--;
+    }
+}
+
+size_t SlabPool::slabCount() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_slab_count;
+}
+
+void SlabPool::link(Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = m_available;
+    if (m_available) {
+        m_available->prev = slab;
+    }
+    m_available = slab;
+    m_available_count++;
+}
+
+void SlabPool::unlink(Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        m_available = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    m_available_count--;
+}
@@ -0,0 +1,64 @@
+#include "OctoCore/SlabPool.h"
+
+#include <cstring>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+    using ::testing::Test;
+
+using Octo::SlabPool;
+
+namespace testing {
+
+    TEST(SlabPoolTest, test_blocks) {
+        SlabPool pool {20};
+        EXPECT_EQ(pool.blockBytes() % SlabPool::Alignment, 0u);
+        EXPECT_EQ(pool.slabCount(), 0u);
+        void* first = pool.allocate();
+        std::memset(first, 0xff, pool.blockBytes());
+        EXPECT_EQ(pool.slabCount(), 1u);
+        // A freed block is handed out again:
+        pool.deallocate(first);
+        EXPECT_EQ(pool.allocate(), first);
+        pool.deallocate(first);
+    }
+
+    TEST(SlabPoolTest, test_slabs_are_released) {
+        SlabPool pool {48};
+        const size_t count = 3 * SlabPool::SlabBytes / pool.blockBytes();
+        std::vector<void*> blocks;
+        std::set<void*> distinct;
+        for (size_t i = 0; i < count; i++) {
+            blocks.push_back(pool.allocate());
+            distinct.insert(blocks.back());
+            ASSERT_EQ(reinterpret_cast<uintptr_t>(blocks.back()) % SlabPool::Alignment, 0u);
+        }
+        EXPECT_EQ(distinct.size(), count);
+        const size_t slabs = pool.slabCount();
+        EXPECT_GT(slabs, 3u);
+        // Freeing the first half of the blocks releases the slabs that held them:
+        for (size_t i = 0; i < count / 2; i++) {
+            pool.deallocate(blocks[i]);
+        }
+        EXPECT_LT(pool.slabCount(), slabs);
+        EXPECT_GE(pool.slabCount(), slabs / 2);
+        // Freeing the rest releases all but one of the slabs:
+        for (size_t i = count / 2; i < count; i++) {
+            pool.deallocate(blocks[i]);
+        }
+        EXPECT_EQ(pool.slabCount(), 1u);
+    }
+
+    TEST(SlabPoolTest, test_allocator) {
+        // Objects created with std::allocate_shared() share a block with their reference count:
+        using Allocator = Octo::SlabAllocator<std::string>;
+        auto value = std::allocate_shared<std::string>(Allocator(), "a string that is long enough to be on the heap");
+        std::weak_ptr<std::string> weak = value;
+        value.reset();
+        EXPECT_TRUE(weak.expired());
+        std::vector<std::string, Allocator> values(100, "x"); // Arrays come from the heap
+        EXPECT_EQ(values.back(), "x");
+    }
+}
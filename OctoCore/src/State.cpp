@@ -2,12 +2,22 @@
 
 using namespace Octo;
 
+namespace {
+    // Fields of the header of a journal snapshot:
+    enum : FieldId {
+        snapshot_next_object_id_field_id = "next_object_id"_octo_field_name_hash,
+        snapshot_history_base_field_id = "history_base"_octo_field_name_hash,
+        snapshot_undo_count_field_id = "undo_count"_octo_field_name_hash,
+        snapshot_allow_merge_field_id = "allow_merge"_octo_field_name_hash,
+    };
+}
+
 State::State(SessionId sessionId) :
     m_session_id(sessionId),
     m_next_object_id(((int64_t)sessionId << 48) | 1) // see getNextObjectId()
 {
     if (m_session_id & 4<<14) {
-        throw StateException("Invalid session ID. Session ID must be 14 bytes or smaller.");
+        OCTO_THROW(StateException("Invalid session ID. Session ID must be 14 bytes or smaller."));
     }
 }
 
@@ -20,49 +30,780 @@ ObjectId State::getNextObjectId() {
     const ObjectId object_id = m_next_object_id++;
     if ((object_id >> 48) != m_session_id) {
         // We've reached the limit of the number of object IDs supported in a single session.
-        throw StateException("Reached limit of available object IDs for this session.");
+        OCTO_THROW(StateException("Reached limit of available object IDs for this session."));
     }
     return object_id;
 }
 
 CommandRegistry* State::_getCommandRegistry() const {
-    throw StateException("_getCommandRegistry not implemented. Add OCTO_STATE_DEFAULTS to use commands.");
+    OCTO_THROW(StateException("_getCommandRegistry not implemented. Add OCTO_STATE_DEFAULTS to use commands."));
 }
 
-std::shared_ptr<const Map> State::_runCommand(const CommandBase& command, bool allowUndo) {
-    auto wrapped_command = _getCommandRegistry()->getCommand(command.commandId());
-    if (wrapped_command == nullptr) {
-        throw InapplicableCommandException();
+State::Snapshot State::_saveSnapshot() const {
+    return nullptr;
+}
+void State::_restoreSnapshot(const Snapshot&) {
+    OCTO_THROW(StateException("_restoreSnapshot not implemented."));
+}
+bool State::_serializeState(FieldMap*) const {
+    return false;
+}
+void State::_deserializeState(const FieldMap&) {
+    OCTO_THROW(StateException("_deserializeState not implemented."));
+}
+
+std::shared_ptr<const FieldMap> State::runCommand(CommandBase::CommandId commandId,
+                                                  const std::shared_ptr<const FieldMap>& args, bool allowUndo) {
+    return valueOrThrow(tryRunCommand(commandId, args, allowUndo, m_session_id));
+}
+std::shared_ptr<const FieldMap> State::runCommand(CommandBase::CommandId commandId,
+                                                  const std::shared_ptr<const FieldMap>& args, bool allowUndo,
+                                                  SessionId sessionId) {
+    return valueOrThrow(tryRunCommand(commandId, args, allowUndo, sessionId));
+}
+StatusOr<std::shared_ptr<const FieldMap>> State::tryRunCommand(CommandBase::CommandId commandId,
+                                                               const std::shared_ptr<const FieldMap>& args,
+                                                               bool allowUndo) {
+    return tryRunCommand(commandId, args, allowUndo, m_session_id);
+}
+StatusOr<std::shared_ptr<const FieldMap>> State::tryRunCommand(CommandBase::CommandId commandId,
+                                                               const std::shared_ptr<const FieldMap>& args,
+                                                               bool allowUndo, SessionId sessionId) {
+    bool has_results = true; // Compound commands always have results
+    if (commandId != CommandBase::CompoundCommandId) {
+        auto wrapped_command = _getCommandRegistry()->getCommand(commandId);
+        if (wrapped_command == nullptr) {
+            return inapplicableCommandStatus();
+        }
+        has_results = wrapped_command->has_results;
+    }
+    std::shared_ptr<FieldMap> result = has_results ? _newResultMap()
+                                                   : std::const_pointer_cast<FieldMap>(MapPool::emptyMap());
+    Status status = _forward(commandId, args, result, has_results);
+    if (not status.ok()) {
+        return status;
     }
-    auto result = std::make_shared<Map>();
-    wrapped_command->forward(this, command.args(), result, true);
     if (allowUndo) {
-        CommandRecord r{ command.commandId(), command.args(), result };
-        m_undo.push_back(std::move(r));
-        if (not m_redo.empty()) {
-            m_redo.clear();
+        _recordCommand(commandId, args, result, sessionId);
+    } else if (m_journal) {
+        _journalCommand(JournalOp::Apply, commandId, args, result, sessionId);
+    }
+    return std::shared_ptr<const FieldMap>(std::move(result));
+}
+Status State::_forward(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                       const std::shared_ptr<FieldMap>& result, bool mutableResult,
+                       const std::vector<CommandFrame>* children) {
+    if (commandId == CommandBase::CompoundCommandId) {
+        std::vector<CommandFrame> commands;
+        if (children) {
+            commands = *children; // Shares the children's args and results
+        } else if (not decodeCompoundCommand(*args, *result, &commands)) {
+            return inapplicableCommandStatus();
+        }
+        return _forwardCompound(&commands, result, mutableResult);
+    }
+    auto wrapped_command = _getCommandRegistry()->getCommand(commandId);
+    if (wrapped_command == nullptr) {
+        return inapplicableCommandStatus();
+    }
+    return wrapped_command->forward(this, args, result, mutableResult);
+}
+Status State::_backward(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                        const std::shared_ptr<const FieldMap>& result, const std::vector<CommandFrame>* children) {
+    if (children) {
+        return _backwardAll(*children);
+    }
+    if (commandId == CommandBase::CompoundCommandId) {
+        std::vector<CommandFrame> children;
+        if (not decodeCompoundCommand(*args, *result, &children)) {
+            return inapplicableCommandStatus();
         }
+        return _backwardAll(children);
+    }
+    auto wrapped_command = _getCommandRegistry()->getCommand(commandId);
+    if (wrapped_command == nullptr) {
+        return inapplicableCommandStatus();
+    }
+    return wrapped_command->backward(this, args, result);
+}
+Status State::_forwardCompound(std::vector<CommandFrame>* children, const std::shared_ptr<FieldMap>& result,
+                               bool mutableResult) {
+    Status status = _forwardAll(children, mutableResult);
+    if (status.ok() and mutableResult) {
+        FieldMap unused_args;
+        encodeCompoundCommand(*children, &unused_args, result.get());
+    }
+    return status;
+}
+Status State::_forwardAll(std::vector<CommandFrame>* commands, bool newResults) {
+    // Look up every command before running any of them, so that none are run if one is not
+    // applicable. Compound commands (which aren't registered) are left as nullptr.
+    CommandRegistry* registry = _getCommandRegistry();
+    std::vector<decltype(registry->getCommand(0))> entries(commands->size(), nullptr);
+    for (size_t i = 0; i < commands->size(); i++) {
+        const CommandFrame& command = (*commands)[i];
+        if (command.command_id != CommandBase::CompoundCommandId) {
+            entries[i] = registry->getCommand(command.command_id);
+            if (entries[i] == nullptr) {
+                return inapplicableCommandStatus();
+            }
+        }
+    }
+    for (size_t i = 0; i < commands->size(); i++) {
+        CommandFrame& command = (*commands)[i];
+        const bool new_result = newResults and (entries[i] == nullptr or entries[i]->has_results);
+        if (new_result) {
+            command.result = _newResultMap();
+        }
+        const auto result = std::const_pointer_cast<FieldMap>(command.result); // Only modified if new_result
+        Status status = entries[i] ? entries[i]->forward(this, command.args, result, new_result)
+                                   : _forward(command.command_id, command.args, result, new_result,
+                                              command.children.get());
+        if (not status.ok()) {
+            // Undo the commands that were applied, so that together they have no effect
+            commands->resize(i);
+            Status undo_status = _backwardAll(*commands);
+            return undo_status.ok() ? status : undo_status;
+        }
+    }
+    return Status();
+}
+Status State::_backwardAll(const std::vector<CommandFrame>& commands) {
+    for (auto it = commands.rbegin(); it != commands.rend(); ++it) {
+        Status status = _backward(it->command_id, it->args, it->result, it->children.get());
+        if (not status.ok()) {
+            return status;
+        }
+    }
+    return Status();
+}
+CommandFrame State::_encodedRecord(size_t index) const {
+    const CommandHistory::Record& r = m_history.record(index);
+    CommandFrame frame { m_history.commandId(index), r.args, r.result, m_history.sessionId(index), r.children };
+    encodeChildren(&frame);
+    return frame;
+}
+std::shared_ptr<FieldMap> State::_newResultMap() {
+    if (not m_result_pool) {
+        m_result_pool = std::make_shared<MapPool>();
+    }
+    return m_result_pool->acquire();
+}
+void State::_recordCommand(CommandBase::CommandId commandId, std::shared_ptr<const FieldMap> args,
+                           std::shared_ptr<const FieldMap> result, SessionId sessionId,
+                           std::shared_ptr<const std::vector<CommandFrame>> children) {
+    if (m_journal and children) {
+        CommandFrame frame { commandId, args, result, sessionId, children };
+        encodeChildren(&frame);
+        _journalCommand(JournalOp::Command, commandId, frame.args, frame.result, sessionId);
+    } else if (m_journal) {
+        _journalCommand(JournalOp::Command, commandId, args, result, sessionId); // Before it may be merged
+    }
+    bool merged = false;
+    _detachRedo();
+    const size_t top = m_history.size() - 1;
+    if (m_allow_merge and not m_history.empty() and m_history.commandId(top) == commandId and
+        m_history.sessionId(top) == sessionId) {
+        // Try to merge this command into the previous one, so that they form a single undo step
+        auto wrapped_command = _getCommandRegistry()->getCommand(commandId); // nullptr for compound commands
+        auto merge = wrapped_command ? wrapped_command->merge : nullptr;
+        const CommandHistory::Record& r = m_history.record(top);
+        std::shared_ptr<const FieldMap> merged_args, merged_result;
+        if (merge and merge(r.args, r.result, args, result, &merged_args, &merged_result)) {
+            m_history.popBack();
+            args = std::move(merged_args);
+            result = std::move(merged_result);
+            merged = true;
+        }
+    }
+    m_allow_merge = true;
+    m_history.pushBack(commandId, std::move(args), std::move(result), sessionId, std::move(children));
+    if (m_checkpoint_interval) {
+        // Checkpoints from after this point in the history no longer match the state
+        const size_t position = historyPosition();
+        m_checkpoints.erase(m_checkpoints.lower_bound(position), m_checkpoints.end());
+        const bool due = m_checkpoints.empty() or position - m_checkpoints.rbegin()->first >= m_checkpoint_interval;
+        if (due and not merged) { // Merged commands don't get a checkpoint, since they may be merged again
+            Snapshot snapshot = _saveSnapshot();
+            if (snapshot) {
+                m_checkpoints.emplace(position, std::move(snapshot));
+                if (m_checkpoints.size() > m_checkpoint_max) {
+                    m_checkpoints.erase(m_checkpoints.begin());
+                }
+            }
+        }
+    }
+    if (m_history_max_bytes or m_history_max_records or m_spill) {
+        _enforceHistoryLimits();
+    }
+}
+void State::stopMerging() {
+    m_allow_merge = false;
+    if (m_journal and m_journal_depth == 0) {
+        m_journal->append(JournalFrame { JournalOp::StopMerging, CommandFrame { 0, nullptr, nullptr }, 0 });
+    }
+}
+void State::setHistoryLimits(size_t maxBytes, size_t maxRecords) {
+    m_history_max_bytes = maxBytes;
+    m_history_max_records = maxRecords;
+    m_history.trackBytes(maxBytes != 0); // Only the byte limit needs the footprint of each command
+    _enforceHistoryLimits();
+}
+void State::_enforceHistoryLimits() {
+    while (m_history_max_records and historyLength() > m_history_max_records and historyLength() > 1) {
+        if (m_spill and m_spill->commandCount() > 0) {
+            m_spill->dropOldest(); // The spilled commands are the oldest ones
+            m_history_base++;
+            m_checkpoints.erase(m_checkpoints.begin(), m_checkpoints.lower_bound(m_history_base));
+            _pruneBranches(historyPosition() + m_history.redoCount());
+            continue;
+        }
+        _dropOldestRecord();
+    }
+    if (m_spill) {
+        while (m_history.undoCount() > m_spill_hot_records + m_spill_block_records) {
+            _spillOldestRecords(m_spill_block_records);
+        }
+        while (m_history_max_bytes and m_history.bytes() > m_history_max_bytes and m_history.undoCount() > 1) {
+            _spillOldestRecords(std::min(m_spill_block_records, m_history.undoCount() - 1));
+        }
+        return;
+    }
+    while (m_history_max_bytes and m_history.bytes() > m_history_max_bytes and historyLength() > 1) {
+        _dropOldestRecord();
+    }
+}
+void State::_dropOldestRecord() {
+    if (m_history.undoCount() == 0) {
+        // Drop the redo entry that is furthest from the present instead:
+        m_history.popBack();
+        const size_t end_position = historyPosition() + m_history.redoCount();
+        m_checkpoints.erase(m_checkpoints.upper_bound(end_position), m_checkpoints.end());
+        _pruneBranches(end_position);
+    } else {
+        m_history.popFront();
+        m_history_base++;
+        m_checkpoints.erase(m_checkpoints.begin(), m_checkpoints.lower_bound(m_history_base));
+        _pruneBranches(historyPosition() + m_history.redoCount());
+    }
+}
+void State::enableHistorySpill(std::string path, size_t hotRecords, size_t recordsPerBlock) {
+    m_spill.reset(new HistorySpill(std::move(path)));
+    m_spill_hot_records = hotRecords;
+    m_spill_block_records = recordsPerBlock > 0 ? recordsPerBlock : 1;
+    _enforceHistoryLimits();
+}
+void State::_spillOldestRecords(size_t count) {
+    std::vector<CommandFrame> block;
+    block.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        block.push_back(_encodedRecord(0));
+        m_history.popFront();
+    }
+    m_spill->pushBlock(block);
+}
+void State::enableCheckpoints(size_t interval, size_t maxCheckpoints) {
+    m_checkpoint_interval = interval;
+    m_checkpoint_max = maxCheckpoints > 0 ? maxCheckpoints : 1;
+    m_checkpoints.clear();
+    if (interval) {
+        // Start with a checkpoint of the current state
+        Snapshot snapshot = _saveSnapshot();
+        if (snapshot) {
+            m_checkpoints.emplace(historyPosition(), std::move(snapshot));
+        }
+    }
+}
+void State::enableUndoTree(size_t maxBranches) {
+    m_max_branches = maxBranches;
+    _pruneBranches(historyPosition() + m_history.redoCount());
+}
+std::vector<State::BranchInfo> State::branches() const {
+    std::vector<BranchInfo> result;
+    result.reserve(m_branches.size());
+    for (const Branch& branch : m_branches) {
+        result.push_back(branch.info);
     }
     return result;
 }
+void State::switchBranch(uint64_t branchId) {
+    throwIfError(trySwitchBranch(branchId));
+}
+Status State::trySwitchBranch(uint64_t branchId) {
+    return _journaled(JournalOp::SwitchBranch, branchId, 0, [this, branchId] { return _switchBranch(branchId); });
+}
+Status State::_switchBranch(uint64_t branchId) {
+    auto find = [this](uint64_t id) {
+        return std::find_if(m_branches.begin(), m_branches.end(), [id](const Branch& b) { return b.info.id == id; });
+    };
+    auto branch = find(branchId);
+    if (branch == m_branches.end()) {
+        return Status(StatusCode::NOT_FOUND, "There is no such branch.");
+    }
+    if (branch->info.parent_id != 0) {
+        // First switch to the parent branch, redoing only as far as the point where this branch leaves it
+        const size_t fork_position = branch->info.fork_position;
+        Status status = _switchBranch(branch->info.parent_id);
+        if (status.ok()) {
+            status = _undoTo(fork_position);
+        }
+        if (not status.ok()) {
+            return status;
+        }
+        branch = find(branchId);
+    }
+    // Walk back to the common ancestor of the current history and the branch:
+    Status status = _undoTo(branch->info.fork_position);
+    if (not status.ok()) {
+        return status;
+    }
+    Branch target = std::move(*branch);
+    m_branches.erase(branch);
+    _detachRedo(); // The commands we just undid become a new branch
+    for (Branch& other : m_branches) {
+        if (other.info.parent_id == target.info.id) {
+            other.info.parent_id = 0; // It now leaves the current history
+        }
+    }
+    const size_t undo_count = m_history.undoCount();
+    for (CommandFrame& command : target.commands) {
+        m_history.pushBack(command.command_id, std::move(command.args), std::move(command.result), command.session_id,
+                           std::move(command.children));
+    }
+    m_history.setCursor(undo_count);
+    // Then walk forward along the branch:
+    return _redoTo(historyPosition() + m_history.redoCount());
+}
+void State::_detachRedo() {
+    if (m_history.redoCount() == 0) {
+        return;
+    }
+    const size_t position = historyPosition();
+    m_checkpoints.erase(m_checkpoints.upper_bound(position), m_checkpoints.end());
+    if (m_max_branches == 0) {
+        m_history.discardRedo();
+        return;
+    }
+    Branch branch {BranchInfo {m_next_branch_id++, 0, position, m_history.redoCount()}, {}};
+    branch.commands.reserve(m_history.redoCount());
+    for (size_t i = m_history.undoCount(); i < m_history.size(); i++) {
+        const CommandHistory::Record& r = m_history.record(i);
+        branch.commands.push_back(CommandFrame { m_history.commandId(i), r.args, r.result, m_history.sessionId(i),
+                                                 r.children });
+    }
+    m_history.discardRedo();
+    for (Branch& other : m_branches) {
+        if (other.info.parent_id == 0 and other.info.fork_position > position) {
+            other.info.parent_id = branch.info.id; // It leaves one of the commands that were just detached
+        }
+    }
+    m_branches.push_back(std::move(branch));
+    _pruneBranches(position);
+}
+void State::_pruneBranches(size_t maxForkPosition) {
+    if (m_branches.empty()) {
+        return;
+    }
+    std::vector<uint64_t> removed;
+    const size_t excess = m_branches.size() > m_max_branches ? m_branches.size() - m_max_branches : 0;
+    for (size_t i = 0; i < m_branches.size(); i++) {
+        const BranchInfo& info = m_branches[i].info;
+        if (i < excess or (info.parent_id == 0 and
+                           (info.fork_position < m_history_base or info.fork_position > maxForkPosition))) {
+            removed.push_back(info.id);
+        }
+    }
+    // Remove the sub-branches of the removed branches too:
+    auto is_removed = [&removed](uint64_t id) {
+        return std::find(removed.begin(), removed.end(), id) != removed.end();
+    };
+    for (bool changed = not removed.empty(); changed; ) {
+        changed = false;
+        for (const Branch& branch : m_branches) {
+            if (branch.info.parent_id != 0 and is_removed(branch.info.parent_id) and not is_removed(branch.info.id)) {
+                removed.push_back(branch.info.id);
+                changed = true;
+            }
+        }
+    }
+    m_branches.erase(std::remove_if(m_branches.begin(), m_branches.end(), [&is_removed](const Branch& b) {
+        return is_removed(b.info.id);
+    }), m_branches.end());
+}
 void State::undo() {
     if (canUndo()) {
-        CommandRecord r = std::move(m_undo.back());
-        m_undo.pop_back();
-        auto wrapped_command = _getCommandRegistry()->getCommand(r.command_id);
-        wrapped_command->backward(this, r.args, r.result);
-        m_redo.push_back(std::move(r));
+        throwIfError(tryUndo());
     }
 }
 void State::redo() {
     if (canRedo()) {
-        CommandRecord r = std::move(m_redo.back());
-        m_redo.pop_back();
-        auto wrapped_command = _getCommandRegistry()->getCommand(r.command_id);
-        // Unfortunately we need to do a const_cast<> here. But guarantees are in place
-        // that 'result' won't be modified since we're passing mutable_result = false
-        std::shared_ptr<Map> mutable_result = std::const_pointer_cast<Map>(r.result);
-        wrapped_command->forward(this, r.args, mutable_result, false);
-        m_undo.push_back(std::move(r));
+        throwIfError(tryRedo());
+    }
+}
+void State::undoTo(size_t position) {
+    throwIfError(tryUndoTo(position));
+}
+void State::redoTo(size_t position) {
+    throwIfError(tryRedoTo(position));
+}
+Status State::tryUndoTo(size_t position) {
+    return _journaled(JournalOp::UndoTo, position, 0, [this, position] { return _undoTo(position); });
+}
+Status State::tryRedoTo(size_t position) {
+    return _journaled(JournalOp::RedoTo, position, 0, [this, position] { return _redoTo(position); });
+}
+Status State::_undoTo(size_t position) {
+    const size_t current = historyPosition();
+    if (position > current or position < m_history_base) {
+        return Status(StatusCode::OUT_OF_RANGE, "That position is not in the undo history.");
+    }
+    auto checkpoint = _findCheckpoint(position);
+    if (checkpoint != m_checkpoints.end() and position - checkpoint->first < current - position) {
+        return _jumpFromCheckpoint(checkpoint, position); // Redoing from the checkpoint is quicker
+    }
+    while (historyPosition() > position) {
+        Status status = _undo();
+        if (not status.ok()) {
+            return status;
+        }
+    }
+    return Status();
+}
+Status State::_redoTo(size_t position) {
+    const size_t current = historyPosition();
+    if (position < current or position - current > m_history.redoCount()) {
+        return Status(StatusCode::OUT_OF_RANGE, "That position is not in the redo history.");
+    }
+    auto checkpoint = _findCheckpoint(position);
+    if (checkpoint != m_checkpoints.end() and checkpoint->first > current) {
+        return _jumpFromCheckpoint(checkpoint, position);
+    }
+    while (historyPosition() < position) {
+        Status status = _redo();
+        if (not status.ok()) {
+            return status;
+        }
+    }
+    return Status();
+}
+std::map<size_t, State::Snapshot>::const_iterator State::_findCheckpoint(size_t position) const {
+    auto it = m_checkpoints.upper_bound(position);
+    if (it == m_checkpoints.begin()) {
+        return m_checkpoints.end();
+    }
+    --it;
+    if (it->first < historyPosition() - m_history.undoCount()) {
+        return m_checkpoints.end(); // Some of the commands after this checkpoint are in the spill file
+    }
+    return it;
+}
+Status State::_jumpFromCheckpoint(std::map<size_t, Snapshot>::const_iterator checkpoint, size_t position) {
+    _restoreSnapshot(checkpoint->second);
+    m_allow_merge = false;
+    // Every command after the checkpoint is now undone:
+    m_history.setCursor(checkpoint->first - (historyPosition() - m_history.undoCount()));
+    while (historyPosition() < position) {
+        Status status = _redo();
+        if (not status.ok()) {
+            return status;
+        }
+    }
+    return Status();
+}
+void State::undoSession(SessionId sessionId) {
+    throwIfError(tryUndoSession(sessionId));
+}
+Status State::tryUndoSession(SessionId sessionId) {
+    return _journaled(JournalOp::UndoSession, 0, sessionId, [this, sessionId] { return _undoSession(sessionId); });
+}
+Status State::_undoSession(SessionId sessionId) {
+    size_t index;
+    if (not m_history.lastFromSession(sessionId, &index)) {
+        return Status(StatusCode::OUT_OF_RANGE, "That session has no command to undo.");
+    }
+    if (index + 1 == m_history.undoCount()) {
+        return _undo(); // No other commands have been run since
+    }
+    // Check that the command commutes with every command that has been run since:
+    const CommandHistory::Record& r = m_history.record(index);
+    std::vector<ObjectId> objects, later_objects;
+    bool known = _affectedObjects(m_history.commandId(index), r.args, r.result, &objects, r.children.get());
+    for (size_t i = index + 1; known and i < m_history.undoCount(); i++) {
+        const CommandHistory::Record& later = m_history.record(i);
+        known = _affectedObjects(m_history.commandId(i), later.args, later.result, &later_objects,
+                                 later.children.get());
+    }
+    if (known) {
+        std::sort(objects.begin(), objects.end());
+        std::sort(later_objects.begin(), later_objects.end());
+        auto a = objects.begin(), b = later_objects.begin();
+        while (a != objects.end() and b != later_objects.end() and *a != *b) {
+            (*a < *b) ? ++a : ++b;
+        }
+        known = (a == objects.end() or b == later_objects.end()); // i.e. no object is in both lists
+    }
+    if (not known) {
+        return Status(StatusCode::FAILED_PRECONDITION, "A later command affects the same objects.");
+    }
+    Status status = _backward(m_history.commandId(index), r.args, r.result, r.children.get());
+    if (status.ok()) {
+        // The state no longer matches the history from this point on:
+        const size_t position = historyPosition() - m_history.undoCount() + index;
+        m_checkpoints.erase(m_checkpoints.upper_bound(position), m_checkpoints.end());
+        m_history.discardRedo();
+        m_history.erase(index);
+        m_allow_merge = false;
+        _pruneBranches(position); // Later branches depend on the command that was undone
+    }
+    return status;
+}
+bool State::_affectedObjects(CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                             const std::shared_ptr<const FieldMap>& result, std::vector<ObjectId>* objects,
+                             const std::vector<CommandFrame>* children) {
+    if (commandId == CommandBase::CompoundCommandId) {
+        std::vector<CommandFrame> decoded;
+        if (children == nullptr) {
+            if (not decodeCompoundCommand(*args, *result, &decoded)) {
+                return false;
+            }
+            children = &decoded;
+        }
+        for (const CommandFrame& child : *children) {
+            if (not _affectedObjects(child.command_id, child.args, child.result, objects, child.children.get())) {
+                return false;
+            }
+        }
+        return true;
+    }
+    auto wrapped_command = _getCommandRegistry()->getCommand(commandId);
+    if (wrapped_command == nullptr or wrapped_command->affected == nullptr) {
+        return false;
+    }
+    wrapped_command->affected(args, result, objects);
+    return true;
+}
+Status State::tryUndo() {
+    return _journaled(JournalOp::Undo, 0, 0, [this] { return _undo(); });
+}
+Status State::tryRedo() {
+    return _journaled(JournalOp::Redo, 0, 0, [this] { return _redo(); });
+}
+Status State::_undo() {
+    if (not canUndo()) {
+        return Status(StatusCode::OUT_OF_RANGE, "There is no command to undo.");
+    }
+    if (m_history.undoCount() == 0) {
+        // Read the most recent block of commands back in from the spill file
+        std::vector<CommandFrame> block = m_spill->popBlock();
+        for (auto it = block.rbegin(); it != block.rend(); ++it) {
+            m_history.pushFront(it->command_id, std::move(it->args), std::move(it->result), it->session_id);
+        }
+    }
+    const size_t index = m_history.undoCount() - 1;
+    const CommandHistory::Record& r = m_history.record(index);
+    Status status = _backward(m_history.commandId(index), r.args, r.result, r.children.get());
+    if (status.ok()) {
+        m_history.undo();
+        m_allow_merge = false; // Don't extend an older undo step with new commands
+        if (m_spill and m_history.undoCount() < m_spill_block_records) {
+            m_spill->prefetch(); // Start loading the next block of commands that undo() will need
+        }
+    }
+    return status;
+}
+Status State::_redo() {
+    if (not canRedo()) {
+        return Status(StatusCode::OUT_OF_RANGE, "There is no command to redo.");
+    }
+    const size_t index = m_history.undoCount();
+    const CommandHistory::Record& r = m_history.record(index);
+    // Unfortunately we need to do a const_cast<> here. But guarantees are in place
+    // that 'result' won't be modified since we're passing mutable_result = false
+    std::shared_ptr<FieldMap> mutable_result = std::const_pointer_cast<FieldMap>(r.result);
+    Status status = _forward(m_history.commandId(index), r.args, mutable_result, false, r.children.get());
+    if (status.ok()) {
+        m_history.redo();
+        m_allow_merge = false;
+    }
+    return status;
+}
+void State::enableJournal(std::string directory, JournalDurability durability, uint32_t batchMicroseconds,
+                          size_t batchBytes, size_t compressedBlockBytes) {
+    m_journal.reset(); // Flush the previous journal first, if any
+    m_journal.reset(new JournalWriter(std::move(directory), durability, 64 << 20, compressedBlockBytes));
+    m_journal->setBatchWindow(std::chrono::microseconds(batchMicroseconds), batchBytes);
+}
+void State::syncJournal() {
+    if (m_journal) {
+        m_journal->sync();
+    }
+}
+void State::_journalCommand(JournalOp op, CommandBase::CommandId commandId, const std::shared_ptr<const FieldMap>& args,
+                            const std::shared_ptr<const FieldMap>& result, SessionId sessionId) {
+    if (m_journal_depth == 0) {
+        // Record the next object ID, so that replaying doesn't re-use the IDs of the objects it created
+        m_journal->append(JournalFrame { op, CommandFrame { commandId, args, result, sessionId },
+                                         static_cast<uint64_t>(m_next_object_id) });
+    }
+}
+void State::replayJournal(const std::string& directory, size_t decodeThreads) {
+    throwIfError(tryReplayJournal(directory, decodeThreads));
+}
+Status State::tryReplayJournal(const std::string& directory, size_t decodeThreads) {
+    JournalPause pause(this);
+    // Start from the most recent snapshot that can be read, if any:
+    uint32_t first_segment = 0;
+    const std::vector<uint32_t> snapshots = listJournalSnapshots(directory);
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        JournalSnapshot snapshot;
+        if (readSnapshotFile(journalSnapshotPath(directory, *it), &snapshot)) {
+            _loadJournalSnapshot(snapshot);
+            first_segment = *it;
+            break;
+        }
+    }
+    JournalReader reader(directory, first_segment, decodeThreads);
+    JournalFrame frame;
+    bool stop_merging_after = false; // Set for the command of a transaction
+    while (reader.next(&frame)) {
+        const CommandFrame& command = frame.command;
+        switch (frame.op) {
+        case JournalOp::Command:
+        case JournalOp::Apply: {
+            auto result = std::const_pointer_cast<FieldMap>(command.result); // Not modified, as in tryRedo()
+            Status status = _forward(command.command_id, command.args, result, false);
+            if (not status.ok()) {
+                return status;
+            }
+            if (frame.op == JournalOp::Command) {
+                _recordCommand(command.command_id, command.args, command.result, command.session_id);
+                m_allow_merge = not stop_merging_after;
+                stop_merging_after = false;
+            }
+            const ObjectId next_object_id = static_cast<ObjectId>(frame.value);
+            if ((next_object_id >> 48) == m_session_id and next_object_id > m_next_object_id) {
+                m_next_object_id = next_object_id;
+            }
+            break;
+        }
+        // These were journaled because they changed the state (even if they failed part way), so
+        // replaying them has the same effect:
+        case JournalOp::Undo: _undo(); break;
+        case JournalOp::Redo: _redo(); break;
+        case JournalOp::UndoTo: _undoTo(frame.value); break;
+        case JournalOp::RedoTo: _redoTo(frame.value); break;
+        case JournalOp::UndoSession: _undoSession(command.session_id); break;
+        case JournalOp::SwitchBranch: _switchBranch(frame.value); break;
+        case JournalOp::StopMerging:
+            m_allow_merge = false;
+            stop_merging_after = frame.value != 0;
+            break;
+        }
+    }
+    return Status();
+}
+void State::writeJournalSnapshot() {
+    if (not m_journal) {
+        OCTO_THROW(StateException("The journal is not enabled."));
+    }
+    const JournalSnapshot snapshot = _saveJournalSnapshot();
+    // Everything journaled so far is included in the snapshot, so replaying starts at the next segment:
+    const uint32_t segment = m_journal->startSegment();
+    writeSnapshotFile(m_journal->directory(), segment, snapshot);
+}
+void State::compactJournal() {
+    writeJournalSnapshot();
+    // The snapshot is on the disk, so the segments and snapshots before it are no longer needed:
+    removeJournalBefore(m_journal->directory(), m_journal->segmentNumber());
+}
+void State::compactJournal(const std::string& directory) {
+    replayJournal(directory);
+    const JournalSnapshot snapshot = _saveJournalSnapshot();
+    // Number the snapshot after the last segment that it includes:
+    const std::vector<uint32_t> segments = listJournalSegments(directory);
+    const std::vector<uint32_t> snapshots = listJournalSnapshots(directory);
+    const uint32_t segment = std::max(segments.empty() ? 1 : segments.back() + 1,
+                                      snapshots.empty() ? 1 : snapshots.back());
+    writeSnapshotFile(directory, segment, snapshot);
+    removeJournalBefore(directory, segment);
+}
+JournalSnapshot State::_saveJournalSnapshot() const {
+    JournalSnapshot snapshot;
+    if (not _serializeState(&snapshot.model)) {
+        OCTO_THROW(StateException("_serializeState not implemented."));
+    }
+    snapshot.header[snapshot_next_object_id_field_id] = wrap(static_cast<int64_t>(m_next_object_id));
+    // Commands in the spill file are left out, as if they had been dropped from the history:
+    snapshot.header[snapshot_history_base_field_id] =
+        wrap(static_cast<int64_t>(historyPosition() - m_history.undoCount()));
+    snapshot.header[snapshot_undo_count_field_id] = wrap(static_cast<int64_t>(m_history.undoCount()));
+    snapshot.header[snapshot_allow_merge_field_id] = wrap(m_allow_merge);
+    snapshot.history.reserve(m_history.size());
+    for (size_t i = 0; i < m_history.size(); i++) {
+        snapshot.history.push_back(_encodedRecord(i));
+    }
+    return snapshot;
+}
+void State::_loadJournalSnapshot(const JournalSnapshot& snapshot) {
+    auto header_value = [&snapshot](FieldId field) {
+        auto it = snapshot.header.find(field);
+        return it == snapshot.header.end() ? 0 : it->second.int64();
+    };
+    _deserializeState(snapshot.model);
+    while (not m_history.empty()) {
+        m_history.popBack();
+    }
+    m_checkpoints.clear();
+    m_branches.clear();
+    m_history_base = static_cast<size_t>(header_value(snapshot_history_base_field_id));
+    for (const CommandFrame& command : snapshot.history) {
+        m_history.pushBack(command.command_id, command.args, command.result, command.session_id);
+    }
+    m_history.setCursor(std::min(static_cast<size_t>(header_value(snapshot_undo_count_field_id)), m_history.size()));
+    auto allow_merge = snapshot.header.find(snapshot_allow_merge_field_id);
+    m_allow_merge = allow_merge != snapshot.header.end() and allow_merge->second.boolean();
+    const ObjectId next_object_id = header_value(snapshot_next_object_id_field_id);
+    if ((next_object_id >> 48) == m_session_id and next_object_id > m_next_object_id) {
+        m_next_object_id = next_object_id;
+    }
+    _enforceHistoryLimits();
+}
+
+void State::Transaction::commit() {
+    if (m_state == nullptr) {
+        return;
+    }
+    State* state = m_state;
+    m_state = nullptr;
+    if (m_commands.empty()) {
+        return;
+    }
+    // The transaction is an undo step of its own. A single journal frame stops the merging on
+    // both sides of it:
+    state->m_allow_merge = false;
+    if (state->m_journal and state->m_journal_depth == 0) {
+        state->m_journal->append(JournalFrame { JournalOp::StopMerging, CommandFrame { 0, nullptr, nullptr }, 1 });
+    }
+    if (m_commands.size() == 1) {
+        // A single command does not need to be wrapped
+        state->_recordCommand(m_commands[0].command_id, m_commands[0].args, m_commands[0].result, state->m_session_id);
+    } else {
+        // The children are kept as they are, and only encoded into the compound command's args
+        // and result if it is journaled, spilled or saved in a snapshot
+        auto children = std::make_shared<const std::vector<CommandFrame>>(std::move(m_commands));
+        state->_recordCommand(CommandBase::CompoundCommandId, MapPool::emptyMap(), MapPool::emptyMap(),
+                              state->m_session_id, std::move(children));
+    }
+    state->m_allow_merge = false;
+    m_commands.clear();
+}
+Status State::Transaction::rollback() {
+    if (m_state == nullptr) {
+        return Status();
     }
+    State* state = m_state;
+    m_state = nullptr;
+    Status status = state->_backwardAll(m_commands);
+    m_commands.clear();
+    return status;
 }
@@ -1,6 +1,7 @@
 #include "OctoCore/Exception.h"
 #include "OctoCore/State.h"
 
+#include <unistd.h>
 #include <gtest/gtest.h>
     using ::testing::Test;
 
@@ -53,6 +54,35 @@ public:
     }
     
     OCTO_STATE_DEFAULTS; // Use default command registry
+protected:
+    // Serialization for journal snapshots:
+    bool _serializeState(Octo::FieldMap* data) const override {
+        auto& inventory = *(*data)[1].mutable_str_map()->mutable_entries();
+        for (const auto& item : m_inventory) {
+            inventory[item.first].set_real(item.second);
+        }
+        auto& ledger = *(*data)[2].mutable_list()->mutable_entries();
+        for (const auto& entry : m_ledger) {
+            auto& fields = *ledger.Add()->mutable_map()->mutable_entries();
+            fields[1].set_int64(entry.first);
+            fields[2].set_int64(entry.second.date());
+            fields[3].set_real(entry.second.amount());
+            fields[4].set_string(entry.second.description());
+        }
+        return true;
+    }
+    void _deserializeState(const Octo::FieldMap& data) override {
+        m_inventory.clear();
+        m_ledger.clear();
+        for (const auto& item : data.at(1).str_map().entries()) {
+            m_inventory[item.first] = item.second.real();
+        }
+        for (const auto& entry : data.at(2).list().entries()) {
+            const auto& fields = entry.map().entries();
+            m_ledger[fields.at(1).int64()] =
+                Transaction(fields.at(2).int64(), fields.at(3).real(), fields.at(4).string());
+        }
+    }
 };
 
 namespace {
@@ -86,35 +116,37 @@ struct FundCompanyCommand : public Command<InventoryState, 17> {
 
 REGISTER_OCTO_COMMAND(FundCompanyCommand);
 
-/** PurchaseCommand */
+/** PurchaseCommand: A frequently-used command, so it uses flat args */
 struct PurchaseCommand : public Command<InventoryState, 37> {
     using Command::Command;
     
-    OCTO_ARG(std::string, item);
-    OCTO_ARG(double, unit_price);
-    OCTO_ARG(double, qty);
+    OCTO_FLAT_ARGS(
+        OCTO_FLAT_ARG(std::string, item);
+        OCTO_FLAT_ARG(double, unit_price);
+        OCTO_FLAT_ARG(double, qty);
+    )
     OCTO_RESULTS(
         OCTO_RESULT(ObjectId, new_ledger_entry_id);
     )
 
     PurchaseCommand(std::string&& _item, double _unitPrice, double _qty = 1) {
-        item() = _item;
-        unit_price() = _unitPrice;
-        qty() = _qty;
+        flatArgs().item = std::move(_item);
+        flatArgs().unit_price = _unitPrice;
+        flatArgs().qty = _qty;
     }
 
     void forward(State* state, Result& result) const {
         if (not result.has_new_ledger_entry_id()) {
             result.set_new_ledger_entry_id(state->getNextObjectId());
         }
-        const std::string description = std::string("Purchased ") + item();
-        const double cost = qty() * unit_price();
-        state->m_inventory[item()] += qty();
+        const std::string description = std::string("Purchased ") + flatArgs().item;
+        const double cost = flatArgs().qty * flatArgs().unit_price;
+        state->m_inventory[flatArgs().item] += flatArgs().qty;
         state->m_ledger[result.new_ledger_entry_id()] = InventoryState::Transaction(0, -cost, description);
     }
 
     void backward(State* state, const Result result) const {
-        state->m_inventory[item()] -= qty();
+        state->m_inventory[flatArgs().item] -= flatArgs().qty;
         state->m_ledger.erase(result.new_ledger_entry_id());
     }
 };
@@ -150,8 +182,8 @@ struct BakeCommand : public Command<InventoryState, 19> {
         state->m_inventory[item()] += forward ? qty() : -qty();
     }
 
-    void forward(State* state, Result& result) const { run(state, true); }
-    void backward(State* state, const Result result) const { run(state, false); }
+    void forward(State* state, Result&) const { run(state, true); }
+    void backward(State* state, const Result) const { run(state, false); }
 
 };
 
@@ -162,8 +194,8 @@ REGISTER_OCTO_COMMAND(BakeCommand);
     struct OtherCommand ## number : public Command<InventoryState, number> { \
         using Command::Command; \
         OCTO_RESULTS() \
-        void forward(State* state, Result& result) const {} \
-        void backward(State* state, const Result result) const {} \
+        void forward(State*, Result&) const {} \
+        void backward(State*, const Result) const {} \
     }; \
     REGISTER_OCTO_COMMAND(OtherCommand ## number);
 ADD_EMPTY_COMMAND(1);
@@ -242,4 +274,93 @@ namespace testing {
         }
     }
 
+    TEST(StateBenchmark, benchmark_deep_history) {
+        InventoryState bakery { 1 };
+        bakery.runCommand(FundCompanyCommand(100000.0));
+        for (int i = 0; i < 20 * NUM_ITERATIONS; i++) {
+            bakery.runCommand(PurchaseCommand(EGGS, 1, 1));
+        }
+        ASSERT_EQ(bakery.checkInventoryOf(EGGS), 20 * NUM_ITERATIONS);
+        while (bakery.canUndo()) { bakery.undo(); }
+        ASSERT_EQ(bakery.getAccountBalance(), 0.0);
+        while (bakery.canRedo()) { bakery.redo(); }
+        ASSERT_EQ(bakery.getAccountBalance(), 100000.0 - 20 * NUM_ITERATIONS);
+        // Running a new command discards the redo history:
+        for (int i = 0; i < NUM_ITERATIONS; i++) { bakery.undo(); }
+        bakery.runCommand(PurchaseCommand(FLOUR, 1, 1));
+        ASSERT_EQ(bakery.checkInventoryOf(EGGS), 19 * NUM_ITERATIONS);
+        ASSERT_EQ(bakery.checkInventoryOf(FLOUR), 1);
+    }
+
+    TEST(StateBenchmark, benchmark_batched_journal) {
+        const string directory = "octocore_benchmark_journal.tmp";
+        {
+            InventoryState bakery { 1 };
+            bakery.enableJournal(directory, Octo::JournalDurability::Batched);
+            bakery.runCommand(FundCompanyCommand(100000.0));
+            for (int i = 0; i < 20 * NUM_ITERATIONS; i++) {
+                bakery.runCommand(PurchaseCommand(EGGS, 1, 1));
+            }
+            bakery.syncJournal();
+        }
+        InventoryState bakery { 1 };
+        bakery.replayJournal(directory, 2); // Decode on other threads
+        ASSERT_EQ(bakery.checkInventoryOf(EGGS), 20 * NUM_ITERATIONS);
+        ASSERT_EQ(bakery.getAccountBalance(), 100000.0 - 20 * NUM_ITERATIONS);
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+
+    TEST(StateBenchmark, benchmark_compressed_journal) {
+        const string directory = "octocore_benchmark_compressed.tmp";
+        {
+            InventoryState bakery { 1 };
+            bakery.enableJournal(directory, Octo::JournalDurability::None, 2000, 1 << 20, 64 << 10);
+            bakery.runCommand(FundCompanyCommand(100000.0));
+            for (int i = 0; i < 20 * NUM_ITERATIONS; i++) {
+                bakery.runCommand(PurchaseCommand(EGGS, 1, 1));
+            }
+        }
+        InventoryState bakery { 1 };
+        bakery.replayJournal(directory);
+        ASSERT_EQ(bakery.checkInventoryOf(EGGS), 20 * NUM_ITERATIONS);
+        ASSERT_EQ(bakery.getAccountBalance(), 100000.0 - 20 * NUM_ITERATIONS);
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+
+    TEST(StateBenchmark, benchmark_snapshot_startup) {
+        const string directory = "octocore_benchmark_snapshot.tmp";
+        {
+            InventoryState bakery { 1 };
+            bakery.enableJournal(directory);
+            bakery.runCommand(FundCompanyCommand(100000.0));
+            for (int i = 0; i < 20 * NUM_ITERATIONS; i++) {
+                bakery.runCommand(PurchaseCommand(EGGS, 1, 1));
+            }
+            bakery.writeJournalSnapshot();
+            bakery.runCommand(PurchaseCommand(FLOUR, 1, 1));
+        }
+        // Starting up loads the snapshot and replays just the last command:
+        for (int i = 0; i < 5; i++) {
+            InventoryState bakery { 1 };
+            bakery.replayJournal(directory);
+            ASSERT_EQ(bakery.checkInventoryOf(EGGS), 20 * NUM_ITERATIONS);
+            ASSERT_EQ(bakery.checkInventoryOf(FLOUR), 1);
+            ASSERT_EQ(bakery.getAccountBalance(), 100000.0 - 20 * NUM_ITERATIONS - 1);
+            ASSERT_EQ(bakery.historyPosition(), 20 * NUM_ITERATIONS + 2);
+        }
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        for (uint32_t snapshot : Octo::listJournalSnapshots(directory)) {
+            std::remove(Octo::journalSnapshotPath(directory, snapshot).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+
 }
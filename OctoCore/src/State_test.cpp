@@ -1,6 +1,7 @@
 #include "OctoCore/Exception.h"
 #include "OctoCore/State.h"
 
+#include <unistd.h>
 #include <gtest/gtest.h>
     using ::testing::Test;
 
@@ -18,12 +19,18 @@ public:
 struct PlaceOrder : public Command<FoodOrdersState, 1> {
     using Command::Command;
     OCTO_RESULTS()
-    void forward(State* state, Result& result) const { state->m_orders++; }
+    void forward(State* state, Result&) const { state->m_orders++; }
     void backward(State* state, Result) const { state->m_orders--; }
 };
 
 REGISTER_OCTO_COMMAND(PlaceOrder);
 
+// A subclass with a command registry of its own, with which PlaceOrder is not registered
+class OtherOrdersState : public FoodOrdersState {
+public:
+    OCTO_STATE_DEFAULTS;
+};
+
 
 namespace testing {
 
@@ -51,6 +58,40 @@ namespace testing {
         EXPECT_TRUE(state.canUndo());
         EXPECT_FALSE(state.canRedo());
     }
+
+    TEST(StateTest, test_unregistered_command) {
+        // PlaceOrder accepts this type of state, but is not registered for use with it. This is
+        // only checked the first time, so check that it is still rejected the second time:
+        OtherOrdersState other;
+        EXPECT_THROW(other.runCommand(PlaceOrder()), Octo::InapplicableCommandException);
+        EXPECT_THROW(other.runCommand(PlaceOrder()), Octo::InapplicableCommandException);
+        EXPECT_EQ(0, other.m_orders);
+        FoodOrdersState state;
+        state.runCommand(PlaceOrder());
+        EXPECT_EQ(1, state.m_orders);
+    }
+
+    TEST(StateTest, test_run_command_by_id) {
+        // Commands whose type is not known at compile time can be run using their ID and args:
+        FoodOrdersState state;
+        state.runCommand(PlaceOrder::commandId(), PlaceOrder().args());
+        EXPECT_EQ(1, state.m_orders);
+        state.undo();
+        EXPECT_EQ(0, state.m_orders);
+        state.redo();
+        EXPECT_EQ(1, state.m_orders);
+        EXPECT_THROW(state.runCommand(9999, PlaceOrder().args()), Octo::InapplicableCommandException);
+    }
+
+    TEST(StateTest, test_empty_results_are_shared) {
+        // PlaceOrder has no result fields, so running it should not allocate a result map
+        FoodOrdersState state;
+        auto result1 = state.runCommand(PlaceOrder());
+        auto result2 = state.runCommand(PlaceOrder::commandId(), PlaceOrder().args());
+        EXPECT_EQ(result1.data(), Octo::MapPool::emptyMap().get());
+        EXPECT_EQ(result2.get(), Octo::MapPool::emptyMap().get());
+        EXPECT_EQ(2, state.m_orders);
+    }
 }
 
 // BasicState: State for basic tests that involve the OctoStore
@@ -71,6 +112,32 @@ namespace {
         }
         OCTO_STATE_DEFAULTS;
         std::map<ObjectId, Employee> m_employees;
+        int m_restore_count = 0;
+    protected:
+        Snapshot _saveSnapshot() const override { return std::make_shared<decltype(m_employees)>(m_employees); }
+        void _restoreSnapshot(const Snapshot& snapshot) override {
+            m_employees = *std::static_pointer_cast<const decltype(m_employees)>(snapshot);
+            m_restore_count++;
+        }
+        bool _serializeState(Octo::FieldMap* data) const override {
+            Octo::IntList ids;
+            Octo::StrList names;
+            for (const auto& employee : m_employees) {
+                ids.Add(employee.first);
+                *names.Add() = employee.second.name;
+            }
+            (*data)[1] = Octo::wrap(std::move(ids));
+            (*data)[2] = Octo::wrap(std::move(names));
+            return true;
+        }
+        void _deserializeState(const Octo::FieldMap& data) override {
+            m_employees.clear();
+            const auto& ids = data.at(1).int_list().entries();
+            const auto& names = data.at(2).str_list().entries();
+            for (int i = 0; i < ids.size(); i++) {
+                m_employees[ids.Get(i)] = Employee { names.Get(i), 0 };
+            }
+        }
     };
     struct InsertEmployeesCommand : public Command<BasicState, 1> {
         OCTO_ARG(StrList, names);
@@ -98,9 +165,53 @@ namespace {
             }
             result.set_employee_ids(new_ids);
         }
-        void backward(State* state, Result) const { throw Octo::StateException("Not implemented"); }
+        void backward(State*, Result) const { throw Octo::StateException("Not implemented"); }
     };
     REGISTER_OCTO_COMMAND(InsertEmployeesCommand);
+    // Like InsertEmployeesCommand, but rejects duplicate names without throwing an exception:
+    struct InsertEmployeeCommand : public Command<BasicState, 2> {
+        OCTO_ARG(string, name);
+        OCTO_RESULTS(
+            OCTO_RESULT(ObjectId, employee_id);
+        )
+        using Command::Command;
+        void forward(State* state, Result& result) const {
+            if (state->hasName(name().c_str())) {
+                return result.willNotApply("Name already exists: " + name());
+            }
+            if (not result.has_employee_id()) {
+                result.set_employee_id(state->getNextObjectId());
+            }
+            state->m_employees[result.employee_id()] = Employee { name(), 0 };
+        }
+        void backward(State* state, const Result result) const { state->m_employees.erase(result.employee_id()); }
+        void affectedObjects(const Result& result, std::vector<ObjectId>* objects) const {
+            objects->push_back(result.employee_id());
+        }
+    };
+    REGISTER_OCTO_COMMAND(InsertEmployeeCommand);
+    struct RenameEmployeeCommand : public Command<BasicState, 3> {
+        OCTO_ARG(ObjectId, employee_id);
+        OCTO_ARG(string, name);
+        OCTO_RESULTS(
+            OCTO_RESULT(string, old_name);
+        )
+        using Command::Command;
+        void forward(State* state, Result& result) const {
+            std::string& name_ref = state->m_employees.at(employee_id()).name;
+            if (not result.has_old_name()) {
+                result.set_old_name(name_ref);
+            }
+            name_ref = name();
+        }
+        void backward(State* state, const Result result) const {
+            state->m_employees.at(employee_id()).name = result.old_name();
+        }
+        void affectedObjects(const Result&, std::vector<ObjectId>* objects) const {
+            objects->push_back(employee_id());
+        }
+    };
+    REGISTER_OCTO_COMMAND(RenameEmployeeCommand);
 }
 
 namespace testing {
@@ -137,6 +248,561 @@ namespace testing {
         );
         EXPECT_EQ(state.hasName("cameron"), false);
     }
+
+    TEST(BasicStateTest, test_will_not_apply_without_exceptions) {
+        BasicState state;
+        InsertEmployeeCommand insert_alice;
+        insert_alice.name() = "alice";
+        auto result = state.tryRunCommand(insert_alice);
+        ASSERT_TRUE(result.ok());
+        EXPECT_TRUE(state.hasName("alice"));
+        const State::ObjectId alice_id = result.ValueOrDie().employee_id();
+
+        // Running it again is rejected, and does not change the state or the undo history:
+        auto rejected = state.tryRunCommand(insert_alice);
+        EXPECT_EQ(rejected.status().error_code(), Octo::StatusCode::FAILED_PRECONDITION);
+        EXPECT_EQ(rejected.status().error_message(), "Name already exists: alice");
+        auto rejected_by_id = state.tryRunCommand(InsertEmployeeCommand::commandId(), insert_alice.args());
+        EXPECT_EQ(rejected_by_id.status().error_code(), Octo::StatusCode::FAILED_PRECONDITION);
+        EXPECT_EQ(state.m_employees.size(), 1);
+        // The throwing API converts the status to an exception:
+        try {
+            state.runCommand(insert_alice);
+            FAIL() << "Expected CommandWillNotApplyException";
+        } catch (const Octo::CommandWillNotApplyException& e) {
+            EXPECT_STREQ(e.what(), "Name already exists: alice");
+        }
+
+        EXPECT_TRUE(state.tryUndo().ok());
+        EXPECT_FALSE(state.hasName("alice"));
+        EXPECT_EQ(state.tryUndo().error_code(), Octo::StatusCode::OUT_OF_RANGE);
+        EXPECT_TRUE(state.tryRedo().ok());
+        EXPECT_EQ(state.m_employees.at(alice_id).name, "alice");
+        EXPECT_EQ(state.tryRedo().error_code(), Octo::StatusCode::OUT_OF_RANGE);
+
+        // If a redo will not apply, the command stays in the redo queue:
+        state.undo();
+        state.m_employees[1] = Employee { "alice", 0 };
+        EXPECT_EQ(state.tryRedo().error_code(), Octo::StatusCode::FAILED_PRECONDITION);
+        EXPECT_TRUE(state.canRedo());
+        state.m_employees.erase(1);
+        EXPECT_TRUE(state.tryRedo().ok());
+        EXPECT_FALSE(state.canRedo());
+    }
+
+    TEST(BasicStateTest, test_history_limits) {
+        BasicState state;
+        InsertEmployeeCommand cmd;
+        const char* names[] = {"alice", "bob", "cameron", "diana", "eve"};
+        for (auto name : names) {
+            cmd.name() = name;
+            state.runCommand(cmd);
+        }
+        EXPECT_EQ(state.historyLength(), 5);
+        const size_t footprint = state.historyFootprint();
+        EXPECT_GT(footprint, 5 * strlen("alice"));
+
+        // Limit the number of records:
+        state.setHistoryLimits(0, 3);
+        EXPECT_EQ(state.historyLength(), 3);
+        EXPECT_LT(state.historyFootprint(), footprint);
+        state.undo();
+        state.undo();
+        state.undo();
+        EXPECT_FALSE(state.canUndo());
+        EXPECT_EQ(state.m_employees.size(), 2); // The oldest two commands can no longer be undone
+        EXPECT_EQ(state.historyLength(), 3);
+
+        // Running a new command clears the redo queue:
+        cmd.name() = "frank";
+        state.runCommand(cmd);
+        EXPECT_EQ(state.historyLength(), 1);
+        const size_t one_footprint = state.historyFootprint();
+
+        // Limit the number of bytes:
+        state.setHistoryLimits(one_footprint * 2);
+        cmd.name() = "gina";
+        state.runCommand(cmd);
+        cmd.name() = "hana";
+        state.runCommand(cmd);
+        EXPECT_EQ(state.historyLength(), 2);
+        EXPECT_LE(state.historyFootprint(), one_footprint * 2);
+
+        // The most recent command is always kept:
+        state.setHistoryLimits(1);
+        EXPECT_EQ(state.historyLength(), 1);
+        state.undo();
+        EXPECT_FALSE(state.hasName("hana"));
+        EXPECT_TRUE(state.hasName("gina"));
+    }
+
+    TEST(BasicStateTest, test_history_spill) {
+        BasicState state;
+        state.enableHistorySpill("octocore_state_spill_test.tmp", 4, 3);
+        InsertEmployeeCommand cmd;
+        for (int i = 0; i < 20; i++) {
+            cmd.name() = "employee " + std::to_string(i);
+            state.runCommand(cmd);
+        }
+        EXPECT_EQ(state.historyLength(), 20);
+        const size_t footprint = state.historyFootprint(); // Only 4 to 6 commands are still in memory
+        state.setHistoryLimits(0, 18); // The two oldest commands are dropped from the spill file
+        EXPECT_EQ(state.historyLength(), 18);
+        EXPECT_EQ(state.historyFootprint(), footprint);
+
+        int undo_count = 0;
+        while (state.canUndo()) {
+            state.undo();
+            undo_count++;
+        }
+        EXPECT_EQ(undo_count, 18);
+        EXPECT_EQ(state.m_employees.size(), 2);
+        EXPECT_TRUE(state.hasName("employee 1"));
+        EXPECT_FALSE(state.hasName("employee 2"));
+        while (state.canRedo()) {
+            state.redo();
+        }
+        EXPECT_EQ(state.m_employees.size(), 20);
+        EXPECT_TRUE(state.hasName("employee 19"));
+    }
+
+    TEST(BasicStateTest, test_try_inapplicable_command) {
+        BasicState state;
+        auto result = state.tryRunCommand(9999, PlaceOrder().args());
+        EXPECT_EQ(result.status().error_code(), Octo::StatusCode::INVALID_ARGUMENT);
+        EXPECT_EQ(state.tryRunCommand(PlaceOrder()).status().error_code(), Octo::StatusCode::INVALID_ARGUMENT);
+        EXPECT_FALSE(state.canUndo());
+    }
+
+    TEST(BasicStateTest, test_compound_transaction) {
+        BasicState state;
+        InsertEmployeeCommand cmd;
+        auto transaction = state.beginTransaction();
+        cmd.name() = "alice";
+        const State::ObjectId alice_id = transaction.run(cmd).employee_id();
+        cmd.name() = "bob";
+        transaction.run(cmd);
+        transaction.commit();
+        EXPECT_TRUE(transaction.isFinished());
+        EXPECT_EQ(state.m_employees.size(), 2);
+        EXPECT_EQ(state.historyLength(), 1);
+
+        // The whole transaction is undone and redone as one step:
+        state.undo();
+        EXPECT_TRUE(state.m_employees.empty());
+        EXPECT_FALSE(state.canUndo());
+        state.redo();
+        EXPECT_EQ(state.m_employees.at(alice_id).name, "alice");
+        EXPECT_TRUE(state.hasName("bob"));
+
+        // The compound command can be run on another state by its ID:
+        BasicState other_state;
+        std::vector<Octo::CommandFrame> frames;
+        frames.push_back({InsertEmployeeCommand::commandId(), cmd.args(), Octo::MapPool::emptyMap()});
+        cmd.name() = "cameron";
+        frames.push_back({InsertEmployeeCommand::commandId(), cmd.args(), Octo::MapPool::emptyMap()});
+        auto compound_args = std::make_shared<Octo::FieldMap>();
+        Octo::FieldMap unused_result;
+        Octo::encodeCompoundCommand(frames, compound_args.get(), &unused_result);
+        other_state.runCommand(Octo::CommandBase::CompoundCommandId, compound_args);
+        EXPECT_TRUE(other_state.hasName("bob"));
+        EXPECT_TRUE(other_state.hasName("cameron"));
+        other_state.undo();
+        EXPECT_TRUE(other_state.m_employees.empty());
+        other_state.redo();
+        EXPECT_EQ(other_state.m_employees.size(), 2);
+        // ... and is applied atomically:
+        auto status = state.tryRunCommand(Octo::CommandBase::CompoundCommandId, compound_args).status();
+        EXPECT_EQ(status.error_code(), Octo::StatusCode::FAILED_PRECONDITION); // "bob" already exists
+        EXPECT_FALSE(state.hasName("cameron"));
+        EXPECT_EQ(state.historyLength(), 1);
+
+        // A committed transaction is encoded when it leaves memory, e.g. for the spill file:
+        BasicState spill_state;
+        spill_state.enableHistorySpill("octocore_compound_spill_test.tmp", 1, 1);
+        auto spilled = spill_state.beginTransaction();
+        spilled.run(cmd);
+        cmd.name() = "diana";
+        spilled.run(cmd);
+        spilled.commit();
+        for (auto name : {"eve", "frank"}) {
+            cmd.name() = name;
+            spill_state.runCommand(cmd);
+        }
+        spill_state.undo();
+        spill_state.undo();
+        spill_state.undo(); // Read back from the spill file
+        EXPECT_TRUE(spill_state.m_employees.empty());
+        spill_state.redo();
+        EXPECT_TRUE(spill_state.hasName("cameron"));
+        EXPECT_TRUE(spill_state.hasName("diana"));
+    }
+
+    TEST(BasicStateTest, test_transaction_rollback) {
+        BasicState state;
+        InsertEmployeeCommand cmd;
+        {
+            auto transaction = state.beginTransaction();
+            cmd.name() = "alice";
+            transaction.run(cmd);
+            cmd.name() = "bob";
+            transaction.run(cmd);
+            cmd.name() = "alice";
+            EXPECT_THROW(transaction.run(cmd), Octo::CommandWillNotApplyException);
+            EXPECT_TRUE(transaction.isFinished());
+            EXPECT_TRUE(state.m_employees.empty());
+            EXPECT_EQ(transaction.tryRun(cmd).status().error_code(), Octo::StatusCode::FAILED_PRECONDITION);
+        }
+        {
+            // If a command throws, the transaction is rolled back when it is destroyed:
+            auto transaction = state.beginTransaction();
+            cmd.name() = "cameron";
+            transaction.run(cmd);
+            EXPECT_THROW(transaction.run(InsertEmployeesCommand().addName("diana").addName("cameron")),
+                         Octo::CommandException);
+        }
+        EXPECT_TRUE(state.m_employees.empty());
+        EXPECT_FALSE(state.canUndo());
+    }
+
+    TEST(BasicStateTest, test_undo_session) {
+        BasicState state; // Session 10
+        const State::SessionId remote_session = 20;
+        InsertEmployeeCommand cmd;
+        cmd.name() = "alice";
+        const State::ObjectId alice_id = state.runCommand(cmd).employee_id();
+        cmd.name() = "bob";
+        auto bob_result = state.runCommand(InsertEmployeeCommand::commandId(), cmd.args(), true, remote_session);
+        const State::ObjectId bob_id = bob_result->at(InsertEmployeeCommand::Result::employee_id_field_id).int64();
+        EXPECT_EQ(state.historyLength(), 2);
+
+        // Undoing this session's command leaves the remote session's later command in place:
+        state.undoSession(10);
+        EXPECT_EQ(state.m_employees.count(alice_id), 0);
+        EXPECT_EQ(state.m_employees.at(bob_id).name, "bob");
+        EXPECT_EQ(state.historyLength(), 1);
+        EXPECT_EQ(state.tryUndoSession(10).error_code(), Octo::StatusCode::OUT_OF_RANGE);
+
+        // A command can't be undone if a later command from another session affects the same object:
+        cmd.name() = "cameron";
+        const State::ObjectId cameron_id = state.runCommand(cmd).employee_id();
+        RenameEmployeeCommand rename;
+        rename.employee_id() = cameron_id;
+        rename.name() = "Cameron";
+        state.runCommand(RenameEmployeeCommand::commandId(), rename.args(), true, remote_session);
+        EXPECT_EQ(state.tryUndoSession(10).error_code(), Octo::StatusCode::FAILED_PRECONDITION);
+        EXPECT_THROW(state.undoSession(10), Octo::CommandWillNotApplyException);
+        EXPECT_EQ(state.m_employees.at(cameron_id).name, "Cameron");
+        // ... but the other session can undo its own last command, which is a normal undo:
+        state.undoSession(remote_session);
+        EXPECT_EQ(state.m_employees.at(cameron_id).name, "cameron");
+        EXPECT_TRUE(state.canRedo());
+        state.undoSession(10);
+        EXPECT_EQ(state.m_employees.size(), 1);
+        state.undoSession(remote_session);
+        EXPECT_TRUE(state.m_employees.empty());
+    }
+
+    TEST(BasicStateTest, test_undo_tree) {
+        BasicState state;
+        state.enableUndoTree();
+        InsertEmployeeCommand cmd;
+        for (auto name : {"alice", "bob", "cameron"}) {
+            cmd.name() = name;
+            state.runCommand(cmd);
+        }
+        state.undo();
+        state.undo();
+        // Running a new command keeps the undone commands as a branch:
+        cmd.name() = "diana";
+        state.runCommand(cmd);
+        EXPECT_FALSE(state.canRedo());
+        auto branches = state.branches();
+        ASSERT_EQ(branches.size(), 1);
+        EXPECT_EQ(branches[0].parent_id, 0);
+        EXPECT_EQ(branches[0].fork_position, 1);
+        EXPECT_EQ(branches[0].length, 2);
+        const uint64_t bob_branch = branches[0].id;
+
+        // Make a branch of a branch:
+        cmd.name() = "eve";
+        state.runCommand(cmd);
+        state.undo();
+        cmd.name() = "frank";
+        state.runCommand(cmd); // alice, diana, frank
+        ASSERT_EQ(state.branches().size(), 2);
+        const uint64_t eve_branch = state.branches()[1].id;
+
+        // Switching undoes back to the common ancestor, then redoes the branch:
+        state.switchBranch(bob_branch); // alice, bob, cameron
+        EXPECT_EQ(state.m_employees.size(), 3);
+        EXPECT_TRUE(state.hasName("cameron"));
+        EXPECT_FALSE(state.hasName("diana"));
+        EXPECT_EQ(state.historyPosition(), 3);
+        // The diana branch now contains the eve branch:
+        branches = state.branches();
+        ASSERT_EQ(branches.size(), 2);
+        EXPECT_EQ(branches[0].id, eve_branch);
+        EXPECT_EQ(branches[0].parent_id, branches[1].id);
+        EXPECT_EQ(branches[1].parent_id, 0);
+        EXPECT_EQ(branches[1].length, 2);
+
+        // Switch to the nested branch:
+        state.switchBranch(eve_branch); // alice, diana, eve
+        EXPECT_EQ(state.m_employees.size(), 3);
+        EXPECT_TRUE(state.hasName("eve"));
+        EXPECT_FALSE(state.hasName("frank"));
+        EXPECT_FALSE(state.hasName("bob"));
+        EXPECT_EQ(state.branches().size(), 2); // bob's branch, and frank's branch
+        state.undoTo(0);
+        EXPECT_TRUE(state.m_employees.empty());
+        state.redoTo(3);
+        EXPECT_TRUE(state.hasName("eve"));
+        EXPECT_EQ(state.trySwitchBranch(eve_branch).error_code(), Octo::StatusCode::NOT_FOUND);
+
+        // The number of branches is limited:
+        state.enableUndoTree(1);
+        EXPECT_EQ(state.branches().size(), 1);
+    }
+
+    TEST(BasicStateTest, test_undo_to_checkpoint) {
+        BasicState state;
+        state.enableCheckpoints(10);
+        InsertEmployeeCommand cmd;
+        for (int i = 0; i < 100; i++) {
+            cmd.name() = "employee " + std::to_string(i);
+            state.runCommand(cmd);
+        }
+        EXPECT_EQ(state.historyPosition(), 100);
+
+        // Undoing a few commands doesn't need a checkpoint:
+        state.undoTo(97);
+        EXPECT_EQ(state.m_restore_count, 0);
+        EXPECT_EQ(state.m_employees.size(), 97);
+        // Long jumps restore the nearest checkpoint, then redo the remaining commands:
+        state.undoTo(12);
+        EXPECT_EQ(state.m_restore_count, 1);
+        EXPECT_EQ(state.historyPosition(), 12);
+        EXPECT_EQ(state.m_employees.size(), 12);
+        EXPECT_TRUE(state.hasName("employee 11"));
+        EXPECT_FALSE(state.hasName("employee 12"));
+        state.redoTo(95);
+        EXPECT_EQ(state.m_restore_count, 2);
+        EXPECT_EQ(state.m_employees.size(), 95);
+        state.undo();
+        EXPECT_FALSE(state.hasName("employee 94"));
+        state.redoTo(100);
+        EXPECT_TRUE(state.hasName("employee 99"));
+        state.undoTo(0);
+        EXPECT_TRUE(state.m_employees.empty());
+        EXPECT_FALSE(state.canUndo());
+        EXPECT_EQ(state.tryUndoTo(1).error_code(), Octo::StatusCode::OUT_OF_RANGE);
+        EXPECT_EQ(state.tryRedoTo(101).error_code(), Octo::StatusCode::OUT_OF_RANGE);
+
+        // Running a new command discards the checkpoints of the commands that can no longer be redone:
+        state.redoTo(25);
+        cmd.name() = "new employee";
+        state.runCommand(cmd);
+        state.undoTo(3);
+        const int restore_count = state.m_restore_count;
+        state.redoTo(26);
+        EXPECT_EQ(state.m_restore_count, restore_count + 1); // Restored the checkpoint at 20
+        EXPECT_EQ(state.m_employees.size(), 26);
+        EXPECT_TRUE(state.hasName("new employee"));
+        EXPECT_FALSE(state.hasName("employee 25"));
+    }
+
+    TEST(BasicStateTest, test_replay_journal) {
+        const std::string directory = "octocore_state_journal_test.tmp";
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        InsertEmployeeCommand cmd;
+        State::ObjectId bob_id;
+        {
+            BasicState state;
+            state.enableJournal(directory, Octo::JournalDurability::Batched);
+            for (auto name : {"alice", "bob", "cameron"}) {
+                cmd.name() = name;
+                state.runCommand(cmd);
+            }
+            bob_id = state.m_employees.begin()->first + 1;
+            state.undo();
+            RenameEmployeeCommand rename;
+            rename.employee_id() = bob_id;
+            rename.name() = "robert";
+            state.runCommand(rename);
+            auto transaction = state.beginTransaction();
+            cmd.name() = "diana";
+            transaction.run(cmd);
+            cmd.name() = "eve";
+            transaction.run(cmd);
+            transaction.commit();
+            state.undo();
+            state.redo();
+            state.undo();
+            cmd.name() = "frank";
+            state.runCommand(cmd, false); // Not in the undo history
+            EXPECT_EQ(state.tryUndoTo(10).error_code(), Octo::StatusCode::OUT_OF_RANGE); // Not journaled
+        }
+
+        BasicState state;
+        state.replayJournal(directory);
+        EXPECT_EQ(state.m_employees.size(), 3);
+        EXPECT_EQ(state.m_employees.at(bob_id).name, "robert");
+        EXPECT_TRUE(state.hasName("frank"));
+        EXPECT_EQ(state.historyPosition(), 3);
+        EXPECT_TRUE(state.canRedo());
+        // New objects don't re-use the IDs of replayed ones:
+        cmd.name() = "gina";
+        const State::ObjectId gina_id = state.runCommand(cmd).employee_id();
+        for (const auto& employee : state.m_employees) {
+            EXPECT_LE(employee.first, gina_id);
+        }
+        state.undo();
+        state.undo();
+        EXPECT_EQ(state.m_employees.at(bob_id).name, "bob");
+        state.undo();
+        state.undo();
+        EXPECT_EQ(state.m_employees.size(), 1); // Just frank
+        EXPECT_FALSE(state.canUndo());
+        // Decoding the journal on other threads gives the same result:
+        BasicState parallel_state;
+        parallel_state.replayJournal(directory, 2);
+        EXPECT_EQ(parallel_state.m_employees.size(), 3);
+        EXPECT_EQ(parallel_state.m_employees.at(bob_id).name, "robert");
+        EXPECT_EQ(parallel_state.historyPosition(), 3);
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+
+    TEST(BasicStateTest, test_journal_snapshot) {
+        const std::string directory = "octocore_state_snapshot_test.tmp";
+        auto remove_files = [&directory] {
+            for (uint32_t segment : Octo::listJournalSegments(directory)) {
+                std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+            }
+            for (uint32_t snapshot : Octo::listJournalSnapshots(directory)) {
+                std::remove(Octo::journalSnapshotPath(directory, snapshot).c_str());
+            }
+        };
+        remove_files();
+        InsertEmployeeCommand cmd;
+        {
+            BasicState state;
+            EXPECT_THROW(state.writeJournalSnapshot(), Octo::StateException); // The journal is not enabled
+            state.enableJournal(directory);
+            for (auto name : {"alice", "bob", "cameron"}) {
+                cmd.name() = name;
+                state.runCommand(cmd);
+            }
+            state.undo();
+            state.writeJournalSnapshot();
+            cmd.name() = "diana";
+            state.runCommand(cmd);
+            state.undo();
+            state.undo(); // Undoes a command from before the snapshot
+        }
+        // Only the journal after the snapshot is needed:
+        ASSERT_EQ(Octo::listJournalSnapshots(directory).size(), 1);
+        const uint32_t snapshot_segment = Octo::listJournalSnapshots(directory)[0];
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            if (segment < snapshot_segment) {
+                std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+            }
+        }
+
+        BasicState state;
+        state.replayJournal(directory);
+        EXPECT_EQ(state.m_employees.size(), 1);
+        EXPECT_TRUE(state.hasName("alice"));
+        EXPECT_EQ(state.historyPosition(), 1);
+        state.redo();
+        EXPECT_TRUE(state.hasName("bob"));
+        state.redo();
+        EXPECT_TRUE(state.hasName("diana"));
+        EXPECT_FALSE(state.canRedo());
+        state.undoTo(0);
+        EXPECT_TRUE(state.m_employees.empty());
+        // New objects don't re-use the IDs of earlier objects:
+        cmd.name() = "eve";
+        const State::ObjectId eve_id = state.runCommand(cmd).employee_id();
+        state.redo(); // Nothing to redo
+        EXPECT_EQ(state.m_employees.size(), 1);
+        EXPECT_EQ(eve_id & 0xFFFFFFFFFFFF, 5); // alice, bob, cameron and diana used the first four
+        remove_files();
+        ::rmdir(directory.c_str());
+    }
+
+    TEST(BasicStateTest, test_compact_journal) {
+        const std::string directory = "octocore_state_compact_test.tmp";
+        auto remove_files = [&directory] {
+            Octo::removeJournalBefore(directory, UINT32_MAX);
+        };
+        remove_files();
+        InsertEmployeeCommand cmd;
+        {
+            BasicState state;
+            state.setHistoryLimits(0, 5); // The undo depth that the compacted journal keeps
+            state.enableJournal(directory);
+            for (int i = 0; i < 20; i++) {
+                cmd.name() = "employee " + std::to_string(i);
+                state.runCommand(cmd);
+            }
+            state.undo();
+            state.undo();
+            cmd.name() = "fred"; // Discards the two undone commands
+            state.runCommand(cmd);
+            state.compactJournal();
+            // Just the snapshot and the (empty) segment after it are left:
+            EXPECT_EQ(Octo::listJournalSnapshots(directory).size(), 1);
+            EXPECT_EQ(Octo::listJournalSegments(directory).size(), 1);
+            cmd.name() = "gina";
+            state.runCommand(cmd);
+            state.undo();
+        }
+        {
+            BasicState state;
+            state.setHistoryLimits(0, 5);
+            state.replayJournal(directory);
+            EXPECT_EQ(state.m_employees.size(), 19);
+            EXPECT_TRUE(state.hasName("fred"));
+            EXPECT_FALSE(state.hasName("employee 19"));
+            EXPECT_EQ(state.historyPosition(), 19);
+            EXPECT_EQ(state.historyLength(), 5);
+            state.redo();
+            EXPECT_TRUE(state.hasName("gina"));
+        }
+
+        // Compacting offline replays the journal, and leaves a snapshot that replaces it:
+        {
+            BasicState compactor;
+            compactor.setHistoryLimits(0, 5);
+            compactor.compactJournal(directory);
+            EXPECT_EQ(compactor.m_employees.size(), 19);
+        }
+        EXPECT_EQ(Octo::listJournalSnapshots(directory).size(), 1);
+        EXPECT_TRUE(Octo::listJournalSegments(directory).empty());
+        {
+            // The journal can be continued after the snapshot:
+            BasicState state;
+            state.setHistoryLimits(0, 5);
+            state.replayJournal(directory);
+            state.enableJournal(directory);
+            state.redo();
+            EXPECT_TRUE(state.hasName("gina"));
+        }
+        BasicState state;
+        state.setHistoryLimits(0, 5);
+        state.replayJournal(directory);
+        EXPECT_EQ(state.m_employees.size(), 20);
+        EXPECT_TRUE(state.hasName("gina"));
+        EXPECT_FALSE(state.canRedo());
+        remove_files();
+        ::rmdir(directory.c_str());
+    }
 }
 
 // DataTypesState: State for testing all supported datatypes
@@ -298,7 +964,7 @@ namespace testing {
         cmd.str_map_arg()["beta"] = Octo::wrap("β");
 
         // Copy the command:
-        auto args = std::make_shared<Octo::Map>(*cmd.args());
+        auto args = std::make_shared<Octo::FieldMap>(*cmd.args());
         SetValueCommand cmd_copy{ args };
         ASSERT_EQ(cmd_copy.int_list_arg()->size(), 2);
         ASSERT_EQ(cmd_copy.int_list_arg()->Get(0), 1);
@@ -353,21 +1019,21 @@ public:
 struct EdibleCommand : public Command<IEdible, 1> {
     using Command::Command;
     OCTO_RESULTS()
-    void forward(State* state, Result& result) const { state->edible_cmd_count++; }
+    void forward(State* state, Result&) const { state->edible_cmd_count++; }
     void backward(State* state, Result) const { state->edible_cmd_count--; }
 };
 REGISTER_OCTO_COMMAND(EdibleCommand);
 struct TreeCommand : public Command<TreeState, 2> {
     using Command::Command;
     OCTO_RESULTS()
-    void forward(State* state, Result& result) const { state->tree_cmd_count++; }
+    void forward(State* state, Result&) const { state->tree_cmd_count++; }
     void backward(State* state, Result) const { state->tree_cmd_count--; }
 };
 REGISTER_OCTO_COMMAND(TreeCommand);
 struct PlantCommand : public Command<PlantState, 3> {
     using Command::Command;
     OCTO_RESULTS()
-    void forward(State* state, Result& result) const { state->plant_cmd_count++; }
+    void forward(State* state, Result&) const { state->plant_cmd_count++; }
     void backward(State* state, Result) const { state->plant_cmd_count--; }
 };
 REGISTER_OCTO_COMMAND(PlantCommand);
@@ -424,4 +1090,132 @@ namespace testing {
         
         EXPECT_THROW(potato.runCommand(TreeCommand()), Octo::InapplicableCommandException);
     }
+
+    TEST(PolymorphismTest, test_cached_state_ptr) {
+        // acceptStatePtr() caches the pointer adjustment for each concrete state type, so check
+        // that repeated conversions (including to a secondary base class) stay correct.
+        PotatoState potato1, potato2;
+        CedarState cedar;
+        for (int i = 0; i < 3; i++) {
+            EXPECT_EQ(EdibleCommand::acceptStatePtr(&potato1), static_cast<IEdible*>(&potato1));
+            EXPECT_EQ(EdibleCommand::acceptStatePtr(&potato2), static_cast<IEdible*>(&potato2));
+            EXPECT_EQ(EdibleCommand::acceptStatePtr(&cedar), nullptr);
+            EXPECT_EQ(TreeCommand::acceptStatePtr(&cedar), static_cast<TreeState*>(&cedar));
+            EXPECT_EQ(TreeCommand::acceptStatePtr(&potato1), nullptr);
+        }
+        // A null state gives nullptr, as dynamic_cast does:
+        EXPECT_EQ(EdibleCommand::acceptStatePtr(nullptr), nullptr);
+    }
+}
+
+// TextState: State for testing commands that merge into a single undo step
+namespace {
+    class TextState : public State {
+    public:
+        TextState() : State(11) {}
+        std::string m_text;
+        OCTO_STATE_DEFAULTS;
+    };
+    struct InsertTextCommand : public Command<TextState, 1> {
+        using Command::Command;
+        OCTO_ARG(int64_t, position);
+        OCTO_ARG(string, text);
+        OCTO_RESULTS()
+        InsertTextCommand(int64_t pos, const char* str) { position() = pos; text() = str; }
+        void forward(State* state, Result&) const { state->m_text.insert(position(), text()); }
+        void backward(State* state, const Result) const { state->m_text.erase(position(), text().size()); }
+        bool merge(Result&, const InsertTextCommand& next, const Result&) {
+            if (next.position() != position() + static_cast<int64_t>(text()->size())) {
+                return false;
+            }
+            *text() += next.text();
+            return true;
+        }
+    };
+    REGISTER_OCTO_COMMAND(InsertTextCommand);
+}
+
+namespace testing {
+    TEST(TextStateTest, test_merge) {
+        TextState state;
+        state.runCommand(InsertTextCommand(0, "H"));
+        state.runCommand(InsertTextCommand(1, "e"));
+        state.runCommand(InsertTextCommand::commandId(), InsertTextCommand(2, "y").args());
+        EXPECT_EQ(state.m_text, "Hey");
+        EXPECT_EQ(state.historyLength(), 1);
+        // Not adjacent, so not merged:
+        state.runCommand(InsertTextCommand(0, "Oh! "));
+        EXPECT_EQ(state.historyLength(), 2);
+        state.stopMerging();
+        state.runCommand(InsertTextCommand(4, "Hi. "));
+        EXPECT_EQ(state.historyLength(), 3);
+        EXPECT_EQ(state.m_text, "Oh! Hi. Hey");
+
+        state.undo();
+        state.undo();
+        EXPECT_EQ(state.m_text, "Hey");
+        state.undo();
+        EXPECT_EQ(state.m_text, "");
+        EXPECT_FALSE(state.canUndo());
+        state.redo();
+        EXPECT_EQ(state.m_text, "Hey");
+
+        // After an undo or redo, new commands start a new undo step:
+        state.runCommand(InsertTextCommand(3, "!"));
+        EXPECT_EQ(state.historyLength(), 2);
+        state.undo();
+        EXPECT_EQ(state.m_text, "Hey");
+    }
+
+    TEST(TextStateTest, test_transaction_is_not_merged) {
+        TextState state;
+        state.runCommand(InsertTextCommand(0, "H"));
+        auto transaction = state.beginTransaction();
+        transaction.run(InsertTextCommand(1, "e"));
+        transaction.commit();
+        state.runCommand(InsertTextCommand(2, "y"));
+        EXPECT_EQ(state.m_text, "Hey");
+        // The transaction is an undo step of its own, although it has a single command:
+        EXPECT_EQ(state.historyLength(), 3);
+        state.undo();
+        state.undo();
+        EXPECT_EQ(state.m_text, "H");
+    }
+
+    TEST(TextStateTest, test_replay_transaction_is_not_merged) {
+        const std::string directory = "octocore_text_journal_test.tmp";
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        {
+            TextState state;
+            state.enableJournal(directory);
+            state.runCommand(InsertTextCommand(0, "H"));
+            auto transaction = state.beginTransaction();
+            transaction.run(InsertTextCommand(1, "e"));
+            transaction.commit();
+            state.runCommand(InsertTextCommand(2, "y"));
+            state.runCommand(InsertTextCommand(3, "!"));
+            EXPECT_EQ(state.historyLength(), 3);
+        }
+        // The transaction is journaled with a single StopMerging frame:
+        Octo::JournalReader reader {directory};
+        Octo::JournalFrame frame;
+        int stop_merging_frames = 0;
+        while (reader.next(&frame)) {
+            stop_merging_frames += frame.op == Octo::JournalOp::StopMerging ? 1 : 0;
+        }
+        EXPECT_EQ(stop_merging_frames, 1);
+        // Which keeps it from merging with the commands on either side of it when replayed:
+        TextState state;
+        state.replayJournal(directory);
+        EXPECT_EQ(state.m_text, "Hey!");
+        EXPECT_EQ(state.historyLength(), 3);
+        state.undo();
+        EXPECT_EQ(state.m_text, "He");
+        for (uint32_t segment : Octo::listJournalSegments(directory)) {
+            std::remove(Octo::journalSegmentPath(directory, segment).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
 }